@@ -0,0 +1,369 @@
+#ifndef ASYNCLOG_H
+#define ASYNCLOG_H
+
+// Asynchronous logger: the calling thread never formats or writes.
+//
+// alog_write() captures the format pointer and its arguments as a binary
+// record (numbers as 8-byte slots, strings copied inline) into a ring owned
+// by the calling thread. A background thread drains every ring, formats the
+// records with stdio and writes them to stdout. Each ring has a single
+// producer and a single consumer, so no locks are taken on the way in; when
+// a ring is full the record is dropped and counted, and the writer reports
+// the number dropped instead of blocking.
+//
+// Supported conversions: d i u x X o c (with h, l, ll, z, j, t), f e g,
+// s and p, with any flags, width and precision, but no '*'.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+enum { ALOG_DEBUG, ALOG_INFO, ALOG_WARN, ALOG_ERROR, ALOG_OFF };
+
+#define ALOG_RING_SIZE (64 * 1024)      // per thread, power of two
+#define ALOG_MAX_RECORD 1024            // longer records are cut short
+#define ALOG_IDLE_US 2000               // writer poll interval when idle
+#define ALOG_PAD 0xff                   // level of a filler record at the ring's end
+
+typedef struct alog_ring {
+    struct alog_ring *next;
+    uint64_t head;                      // written by the owning thread
+    uint64_t tail;                      // written by the writer thread
+    unsigned long dropped;
+    char data[ALOG_RING_SIZE];
+} alog_ring_t;
+
+typedef struct {
+    uint32_t len;                       // whole record, multiple of 8
+    uint8_t level;
+    uint8_t pad[3];
+    const char *fmt;
+} alog_header_t;
+
+static struct {
+    volatile int level;
+    volatile int running;
+    int sample_every;                   // alog_sampled(): keep 1 in n, 0 = none
+    alog_ring_t *rings;
+    pthread_t writer;
+    unsigned long reported_drops;
+} alog = { ALOG_INFO, 0, 1, NULL, 0, 0 };
+
+static __thread alog_ring_t *alog_my_ring;
+static __thread unsigned long alog_sample_count;
+
+static const char *alog_level_names[] = { "debug", "info", "warning", "error" };
+
+// parse a level name; returns -1 if unknown
+static inline int alog_parse_level(const char *name)
+{
+    for (int i = 0; i < ALOG_OFF; i++) {
+        if (strcmp(name, alog_level_names[i]) == 0) return i;
+    }
+    return strcmp(name, "off") == 0 ? ALOG_OFF : -1;
+}
+
+static alog_ring_t *alog_ring(void)
+{
+    if (alog_my_ring) {
+        return alog_my_ring;
+    }
+    alog_ring_t *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    alog_ring_t *head = __atomic_load_n(&alog.rings, __ATOMIC_RELAXED);
+    do {
+        r->next = head;
+    } while (!__atomic_compare_exchange_n(&alog.rings, &head, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    alog_my_ring = r;
+    return r;
+}
+
+// walk one conversion spec starting after '%'; returns the conversion
+// character and sets *end past it, *longs to the number of 'l's (or 2 for
+// z/j/t, which are 64-bit here)
+static char alog_spec(const char *p, const char **end, int *longs)
+{
+    *longs = 0;
+    while (*p && strchr("-+ #0123456789.", *p)) p++;
+    while (*p && strchr("hlzjtL", *p)) {
+        if (*p == 'l') (*longs)++;
+        else if (*p == 'z' || *p == 'j' || *p == 't') *longs = 2;
+        p++;
+    }
+    *end = *p ? p + 1 : p;
+    return *p;
+}
+
+static inline size_t alog_align(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static void alog_vwrite(int level, const char *fmt, va_list ap)
+{
+    alog_ring_t *r = alog_ring();
+    if (!r) return;
+
+    // build the record on the stack, then copy it into the ring whole
+    uint64_t scratch[ALOG_MAX_RECORD / 8];
+    char *rec = (char *)scratch;
+    size_t len = sizeof(alog_header_t);
+    const char *p = fmt;
+    int truncated = 0;
+
+    while ((p = strchr(p, '%')) != NULL && !truncated) {
+        int longs;
+        const char *end;
+        char conv = alog_spec(p + 1, &end, &longs);
+        p = end;
+        uint64_t v;
+        double d;
+        switch (conv) {
+        case 'd': case 'i': case 'c':
+            v = longs >= 2 ? (uint64_t)va_arg(ap, long long) : longs == 1 ? (uint64_t)va_arg(ap, long) : (uint64_t)(int64_t)va_arg(ap, int);
+            break;
+        case 'u': case 'x': case 'X': case 'o':
+            v = longs >= 2 ? (uint64_t)va_arg(ap, unsigned long long) : longs == 1 ? (uint64_t)va_arg(ap, unsigned long) : (uint64_t)va_arg(ap, unsigned int);
+            break;
+        case 'p':
+            v = (uint64_t)(uintptr_t)va_arg(ap, void *);
+            break;
+        case 'f': case 'e': case 'g': case 'F': case 'E': case 'G':
+            d = va_arg(ap, double);
+            memcpy(&v, &d, sizeof(v));
+            break;
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            if (!s) s = "(null)";
+            size_t n = strlen(s);
+            if (len + 8 >= ALOG_MAX_RECORD) {
+                truncated = 1;
+                continue;
+            }
+            size_t room = ALOG_MAX_RECORD - len - 4;   // after the length word
+            if (n + 1 > room) {
+                n = room - 1;
+                truncated = 1;
+            }
+            uint32_t slen = (uint32_t)n;
+            memcpy(rec + len, &slen, 4);
+            memcpy(rec + len + 4, s, n);
+            rec[len + 4 + n] = '\0';
+            len = alog_align(len + 4 + n + 1);
+            continue;
+        }
+        default:
+            continue;   // "%%" or something we do not know: no argument
+        }
+        if (len + 8 > ALOG_MAX_RECORD) {
+            truncated = 1;
+            continue;
+        }
+        memcpy(rec + len, &v, 8);
+        len += 8;
+    }
+    alog_header_t h = { (uint32_t)len, (uint8_t)level, { 0 }, fmt };
+    memcpy(rec, &h, sizeof(h));
+
+    uint64_t head = r->head;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t pos = head & (ALOG_RING_SIZE - 1);
+    size_t contiguous = ALOG_RING_SIZE - pos;
+    size_t need = len <= contiguous ? len : contiguous + len;
+    if (need > ALOG_RING_SIZE - (head - tail)) {
+        r->dropped++;
+        return;
+    }
+    if (len > contiguous) {
+        alog_header_t filler = { (uint32_t)contiguous, ALOG_PAD, { 0 }, NULL };
+        memcpy(r->data + pos, &filler, sizeof(filler) <= contiguous ? sizeof(filler) : contiguous);
+        head += contiguous;
+        pos = 0;
+    }
+    memcpy(r->data + pos, rec, len);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+}
+
+static void alog_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void alog_write(int level, const char *fmt, ...)
+{
+    if (level < alog.level) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    alog_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+#define alog_debug(...) alog_write(ALOG_DEBUG, __VA_ARGS__)
+#define alog_info(...) alog_write(ALOG_INFO, __VA_ARGS__)
+#define alog_warn(...) alog_write(ALOG_WARN, __VA_ARGS__)
+#define alog_error(...) alog_write(ALOG_ERROR, __VA_ARGS__)
+
+// per-request logging: only every sample_every-th call per thread is kept
+#define alog_sampled(lvl, ...) \
+    do { \
+        if ((lvl) >= alog.level && alog.sample_every > 0 && \
+            ++alog_sample_count % (unsigned long)alog.sample_every == 0) { \
+            alog_write((lvl), __VA_ARGS__); \
+        } \
+    } while (0)
+
+// format one record (writer thread)
+static void alog_format(const char *rec, FILE *out)
+{
+    alog_header_t h;
+    memcpy(&h, rec, sizeof(h));
+    const char *end_of_rec = rec + h.len;
+    const char *arg = rec + sizeof(h);
+    const char *p = h.fmt;
+
+    if (h.level >= ALOG_WARN) {
+        fprintf(out, "%s: ", alog_level_names[h.level]);
+    }
+    while (*p) {
+        const char *pct = strchr(p, '%');
+        if (!pct) {
+            fputs(p, out);
+            break;
+        }
+        fwrite(p, 1, pct - p, out);
+        int longs;
+        const char *end;
+        char conv = alog_spec(pct + 1, &end, &longs);
+        p = end;
+
+        // the spec without its length modifier, to which we add our own
+        char spec[32];
+        size_t n = 0;
+        for (const char *q = pct; q < end - 1 && n < sizeof(spec) - 4; q++) {
+            if (!strchr("hlzjtL", *q)) spec[n++] = *q;
+        }
+
+        uint64_t v;
+        double d;
+        switch (conv) {
+        case 'd': case 'i':
+        case 'u': case 'x': case 'X': case 'o':
+            if (arg + 8 > end_of_rec) goto cut;
+            memcpy(&v, arg, 8);
+            arg += 8;
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            spec[n++] = conv;
+            spec[n] = '\0';
+            if (conv == 'd' || conv == 'i') fprintf(out, spec, (long long)v);
+            else fprintf(out, spec, (unsigned long long)v);
+            break;
+        case 'c':
+            if (arg + 8 > end_of_rec) goto cut;
+            memcpy(&v, arg, 8);
+            arg += 8;
+            spec[n++] = 'c';
+            spec[n] = '\0';
+            fprintf(out, spec, (int)v);
+            break;
+        case 'p':
+            if (arg + 8 > end_of_rec) goto cut;
+            memcpy(&v, arg, 8);
+            arg += 8;
+            fprintf(out, "%p", (void *)(uintptr_t)v);
+            break;
+        case 'f': case 'e': case 'g': case 'F': case 'E': case 'G':
+            if (arg + 8 > end_of_rec) goto cut;
+            memcpy(&d, arg, 8);
+            arg += 8;
+            spec[n++] = conv;
+            spec[n] = '\0';
+            fprintf(out, spec, d);
+            break;
+        case 's': {
+            if (arg + 4 > end_of_rec) goto cut;
+            uint32_t slen;
+            memcpy(&slen, arg, 4);
+            spec[n++] = 's';
+            spec[n] = '\0';
+            fprintf(out, spec, arg + 4);
+            arg += alog_align(4 + slen + 1);
+            break;
+        }
+        case '%':
+            fputc('%', out);
+            break;
+        default:
+            break;
+        }
+    }
+    return;
+cut:
+    fputs(" [cut]\n", out);   // arguments beyond ALOG_MAX_RECORD were not kept
+}
+
+// drain every ring once; returns the number of records written
+static int alog_drain(FILE *out)
+{
+    int written = 0;
+    unsigned long dropped = 0;
+    for (alog_ring_t *r = __atomic_load_n(&alog.rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        uint64_t tail = r->tail;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            const char *rec = r->data + (tail & (ALOG_RING_SIZE - 1));
+            alog_header_t h;
+            memcpy(&h, rec, sizeof(h) <= ALOG_RING_SIZE - (tail & (ALOG_RING_SIZE - 1)) ? sizeof(h) : 8);
+            if (h.level != ALOG_PAD) {
+                alog_format(rec, out);
+                written++;
+            }
+            tail += h.len;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    if (dropped > alog.reported_drops) {
+        fprintf(out, "warning: %lu log records dropped (ring full)\n", dropped - alog.reported_drops);
+        alog.reported_drops = dropped;
+        written++;
+    }
+    if (written > 0) {
+        fflush(out);
+    }
+    return written;
+}
+
+static void *alog_writer_thread(void *arg)
+{
+    (void)arg;
+    while (alog.running) {
+        if (alog_drain(stdout) == 0) {
+            usleep(ALOG_IDLE_US);
+        }
+    }
+    alog_drain(stdout);
+    return NULL;
+}
+
+// start the writer thread; records logged before this are kept until then
+static inline int alog_start(void)
+{
+    alog.running = 1;
+    return pthread_create(&alog.writer, NULL, alog_writer_thread, NULL);
+}
+
+// write out everything still queued and stop the writer
+static inline void alog_stop(void)
+{
+    if (!alog.running) {
+        return;
+    }
+    alog.running = 0;
+    pthread_join(alog.writer, NULL);
+}
+
+#endif
@@ -8,6 +8,8 @@
 
 #define CLIENT_PORT 6666
 #define CHAT_HISTORY_LINES 500
+#define REL_TICK_MS 5
+#define SESSION_FILE ".chat_admin_session"   // token and last message id survive restarts
 
 //since this version of chat_admin uses ncurses for ui, the way it is compiled is different
 //also, pthread.h is included. So both of these appear as flags in the compile command:
@@ -28,10 +30,61 @@ typedef struct {
     int  hist_count;      // number of stored lines
     int  hist_start;      // index of oldest line
     int  scroll_offset;   // 0 = bottom
+
+    // optional reliable delivery (-r)
+    int reliable;
+    rel_session_t rel;
+
+    // long messages travel as frag$ pieces
+    frag_table_t frags;
+    uint32_t next_frag_id;
+
+    // id of the last global message received, sent along with conn$ so
+    // the server only replays what we missed, and the epoch it counts in.
+    // The listener updates them and the token, the sender reads them:
+    // all three under session_lock
+    pthread_mutex_t session_lock;
+    unsigned long long last_msg_id;
+    unsigned int history_epoch;   // 0 = not told yet
+
+    // session token from the server; requests carry it so the session
+    // survives an address change
+    unsigned long long token;
+
+    // every request is tagged id$<n>$ so the server can drop repeats
+    unsigned long long next_request_id;
+    unsigned long long request_run;   // this process's run, sent with every id
 } client_context_t;
 
+static void session_load(client_context_t *ctx)
+{
+    FILE *f = fopen(SESSION_FILE, "r");
+    if (!f) return;
+    int fields = fscanf(f, "%llx %llu %x", &ctx->token, &ctx->last_msg_id, &ctx->history_epoch);
+    if (fields < 2) {
+        ctx->token = 0;
+        ctx->last_msg_id = 0;
+    }
+    if (fields < 3) {
+        ctx->history_epoch = 0;
+    }
+    fclose(f);
+}
+
+static void session_save(client_context_t *ctx)
+{
+    if (ctx->token == 0) {
+        remove(SESSION_FILE);
+        return;
+    }
+    FILE *f = fopen(SESSION_FILE, "w");
+    if (!f) return;
+    fprintf(f, "%llx %llu %x\n", ctx->token, ctx->last_msg_id, ctx->history_epoch);
+    fclose(f);
+}
+
 // add chat history so that the client can scroll up and down and navigate through it
-static void chat_history_add(client_context_t *ctx, const char *msg)
+static void chat_history_add_line(client_context_t *ctx, const char *msg)
 {
     int idx;
     if (ctx->hist_count < CHAT_HISTORY_LINES) {
@@ -45,6 +98,18 @@ static void chat_history_add(client_context_t *ctx, const char *msg)
     ctx->chat_history[idx][BUFFER_SIZE - 1] = '\0';
 }
 
+// long (reassembled) messages are kept as several history lines
+static void chat_history_add(client_context_t *ctx, const char *msg)
+{
+    size_t len = strlen(msg);
+    do {
+        chat_history_add_line(ctx, msg);
+        size_t step = len < BUFFER_SIZE - 1 ? len : BUFFER_SIZE - 1;
+        msg += step;
+        len -= step;
+    } while (len > 0);
+}
+
 // assume ctx->ui_lock already held
 static void chat_redraw_locked(client_context_t *ctx)
 {
@@ -77,35 +142,84 @@ static void chat_redraw_locked(client_context_t *ctx)
 
 
 
-void *listener_thread(void *arg)
+// handle one line from the server (a datagram may carry several)
+static void handle_server_message(void *arg, char *msg)
 {
     client_context_t *ctx = (client_context_t *)arg;
-    char server_response[BUFFER_SIZE];
-    struct sockaddr_in responder_addr;
+    char gap_note[128];
+
+    if (strncmp(msg, TOKEN_TAG, TOKEN_TAG_LEN) == 0) {
+        char *end;
+        pthread_mutex_lock(&ctx->session_lock);
+        ctx->token = strtoull(msg + TOKEN_TAG_LEN, &end, 16);
+        if (*end == '$') {
+            unsigned int epoch = (unsigned int)strtoul(end + 1, NULL, 16);
+            if (epoch != ctx->history_epoch) {
+                ctx->last_msg_id = 0;   // our ids mean nothing to this server run
+            }
+            ctx->history_epoch = epoch;
+        }
+        session_save(ctx);
+        pthread_mutex_unlock(&ctx->session_lock);
+        return;
+    }
 
-    while (ctx->running) {
-        int rc = udp_socket_read(ctx->sd, &responder_addr, server_response, BUFFER_SIZE);
+    if (strncmp(msg, MSG_TAG, MSG_TAG_LEN) == 0) {
+        char *end;
+        unsigned long long id = strtoull(msg + MSG_TAG_LEN, &end, 10);
+        if (*end == '$') {
+            pthread_mutex_lock(&ctx->session_lock);
+            ctx->last_msg_id = id;
+            pthread_mutex_unlock(&ctx->session_lock);
+            msg = end + 1;
+        }
+    }
+    else if (strncmp(msg, GAP_TAG, GAP_TAG_LEN) == 0) {
+        unsigned long long last = 0, oldest = 0;
+        sscanf(msg + GAP_TAG_LEN, "%llu$%llu", &last, &oldest);
+        snprintf(gap_note, sizeof(gap_note), "[missed messages after #%llu; history resumes at #%llu]", last, oldest);
+        msg = gap_note;
+    }
+    else if (strncmp(msg, QUEUED_TAG, QUEUED_TAG_LEN) == 0) {
+        snprintf(gap_note, sizeof(gap_note), "[%.64s is offline; message queued]", msg + QUEUED_TAG_LEN);
+        msg = gap_note;
+    }
 
-        if (rc > 0) {
-            if (rc < BUFFER_SIZE) server_response[rc] = '\0';
-            
-            else server_response[BUFFER_SIZE - 1] = '\0';
+    pthread_mutex_lock(&ctx->ui_lock);
 
-            pthread_mutex_lock(&ctx->ui_lock);
+    chat_history_add(ctx, msg); // add server response to history
 
-            chat_history_add(ctx, server_response); // add server response to history
+    chat_redraw_locked(ctx); // redraw window based on scroll offset
 
-            chat_redraw_locked(ctx); // redraw window based on scroll offset
+    pthread_mutex_unlock(&ctx->ui_lock);
 
-            pthread_mutex_unlock(&ctx->ui_lock);
+    if (strcmp(msg, "ping$") == 0) {
+        const char *reply = "ret-ping$";
+        udp_socket_write(ctx->sd, &ctx->server_addr, (char *)reply, strlen(reply));
+    }
+}
 
-            if (strcmp(server_response, "ping$") == 0) {
-                const char *reply = "ret-ping$";
-                udp_socket_write(ctx->sd, &ctx->server_addr, (char *)reply, strlen(reply));
-                continue;
-            }
+void *listener_thread(void *arg)
+{
+    client_context_t *ctx = (client_context_t *)arg;
+    char server_response[UDP_MTU + 1];
+    struct sockaddr_in responder_addr;
+
+    while (ctx->running) {
+        int rc = udp_socket_read(ctx->sd, &responder_addr, server_response, UDP_MTU);
 
-        } else if (rc <= 0) {
+        if (rc > 0) {
+            char *payload;
+            int n = rel_receive(&ctx->rel, ctx->sd, &responder_addr, server_response, rc, &payload);
+            if (n > 0) {
+                char *msg;
+                n = frag_receive(&ctx->frags, &responder_addr, payload, n, &msg);
+                if (n > 0) {
+                    udp_for_each_message(msg, n, handle_server_message, ctx);
+                }
+            }
+        }
+        else if (rc <= 0) {
             break;
         }
     }
@@ -113,13 +227,44 @@ void *listener_thread(void *arg)
     return NULL;
 }
 
+// retransmit unacked requests when running with -r
+void *rel_timer_thread(void *arg)
+{
+    client_context_t *ctx = (client_context_t *)arg;
+
+    while (ctx->running) {
+        rel_poll(&ctx->rel, ctx->sd, &ctx->server_addr);
+        usleep(REL_TICK_MS * 1000);
+    }
+
+    return NULL;
+}
+
+static int client_write_cb(void *arg, const char *buffer, int n)
+{
+    client_context_t *ctx = (client_context_t *)arg;
+    if (ctx->reliable) {
+        return rel_send(&ctx->rel, ctx->sd, &ctx->server_addr, buffer, n);
+    }
+    return udp_socket_write(ctx->sd, &ctx->server_addr, (char *)buffer, n);
+}
+
+// send a request, as frag$ pieces if it does not fit in one datagram
+static int send_request(client_context_t *ctx, const char *request, int n)
+{
+    if (n > UDP_PAYLOAD_MAX) {
+        return frag_send(ctx->next_frag_id++, request, n, client_write_cb, ctx) < 0 ? -1 : n;
+    }
+    return client_write_cb(ctx, request, n);
+}
+
 void *sender_thread(void *arg)
 {
     client_context_t *ctx = (client_context_t *)arg;
 
     while (ctx->running) {
 
-        char client_request[BUFFER_SIZE];
+        static char client_request[FRAG_MAX_MESSAGE];   // room for long pastes
         int len = 0;
         int pos = 0;
         client_request[0] = '\0';
@@ -178,7 +323,7 @@ void *sender_thread(void *arg)
                 pthread_mutex_unlock(&ctx->ui_lock);
                 continue;
             }
-            else if (isprint(ch) && len < BUFFER_SIZE - 1) {
+            else if (isprint(ch) && len < FRAG_MAX_MESSAGE - 1) {
                 memmove(&client_request[pos + 1], &client_request[pos], (size_t)(len - pos + 1));
                 client_request[pos] = (char)ch;
                 pos++;
@@ -193,7 +338,25 @@ void *sender_thread(void *arg)
 
         client_request[len] = '\0';
 
-        int rc = udp_socket_write(ctx->sd, &ctx->server_addr, client_request, (int)strlen(client_request));
+        // reconnecting: tell the server where our history ends
+        pthread_mutex_lock(&ctx->session_lock);
+        if (strncmp(client_request, "conn$", 5) == 0 && strchr(client_request + 5, '$') == NULL &&
+            ctx->last_msg_id > 0 && len < FRAG_MAX_MESSAGE - 32) {
+            snprintf(client_request + len, FRAG_MAX_MESSAGE - len, "$%llu$%x", ctx->last_msg_id, ctx->history_epoch);
+        }
+        unsigned long long token = ctx->token;
+        pthread_mutex_unlock(&ctx->session_lock);
+
+        static char wrapped[FRAG_MAX_MESSAGE + 64];
+        int n;
+        if (token != 0) {
+            n = snprintf(wrapped, sizeof(wrapped), TOK_TAG "%llx$" ID_TAG "%llu:%llx$%s",
+                         token, ctx->next_request_id++, ctx->request_run, client_request);
+        }
+        else {
+            n = snprintf(wrapped, sizeof(wrapped), ID_TAG "%llu:%llx$%s", ctx->next_request_id++, ctx->request_run, client_request);
+        }
+        int rc = send_request(ctx, wrapped, n);
         if (rc <= 0) {
             perror("udp_socket_write");
             ctx->running = 0;
@@ -201,6 +364,9 @@ void *sender_thread(void *arg)
         }
 
         if (strncmp(client_request, "disconn$", 8) == 0) {
+            pthread_mutex_lock(&ctx->session_lock);
+            ctx->token = 0; // the server forgets the session
+            pthread_mutex_unlock(&ctx->session_lock);
             ctx->running = 0;
             break;
         }
@@ -210,8 +376,11 @@ void *sender_thread(void *arg)
 }
 
 // initialise client
+// usage: chat_admin [-r]   (-r: retransmit until the server acks)
 int main(int argc, char *argv[])
 {
+    int reliable = (argc > 1 && strcmp(argv[1], "-r") == 0);
+
     int sd = udp_socket_open(CLIENT_PORT);
     if (sd < 0) {
         perror("udp_socket_open");
@@ -269,8 +438,19 @@ int main(int argc, char *argv[])
     ctx.hist_count = 0;
     ctx.hist_start = 0;
     ctx.scroll_offset = 0;
-
-    pthread_t listener_tid, sender_tid;
+    ctx.reliable = reliable;
+    rel_init(&ctx.rel);
+    frag_table_init(&ctx.frags);
+    ctx.next_frag_id = 1;
+    pthread_mutex_init(&ctx.session_lock, NULL);
+    ctx.last_msg_id = 0;
+    ctx.history_epoch = 0;
+    ctx.token = 0;
+    ctx.next_request_id = 1;
+    ctx.request_run = request_run_new();
+    session_load(&ctx);
+
+    pthread_t listener_tid, sender_tid, rel_tid;
 
     rc = pthread_create(&listener_tid, NULL, listener_thread, &ctx);
     if (rc != 0) {
@@ -288,8 +468,19 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (ctx.reliable) {
+        rc = pthread_create(&rel_tid, NULL, rel_timer_thread, &ctx);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to create retransmit thread\n");
+            ctx.reliable = 0;
+        }
+    }
+
     pthread_join(sender_tid, NULL);
     ctx.running = 0;
+    if (ctx.reliable) {
+        pthread_join(rel_tid, NULL);
+    }
     close(sd);
     pthread_join(listener_tid, NULL);
 
@@ -298,6 +489,10 @@ int main(int argc, char *argv[])
     delwin(input_win);
     endwin();
     pthread_mutex_destroy(&ctx.ui_lock);
+    rel_destroy(&ctx.rel);
+    session_save(&ctx);
+    pthread_mutex_destroy(&ctx.session_lock);
+    frag_table_destroy(&ctx.frags);
 
     printf("Client exiting.\n");
     return 0;
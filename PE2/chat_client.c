@@ -4,10 +4,20 @@
 #include <pthread.h>
 #include <ncursesw/ncurses.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
 #include "udp.h"
+#include "trace.h"
+#include "histogram.h"
 
 #define CLIENT_PORT 0
 #define CHAT_HISTORY_LINES 500
+#define REL_TICK_MS 5
+#define SESSION_NAME_LEN 64
+#define MAX_REDIRECTS 4                          // stop following if nodes disagree on the owner
+#define BENCH_KEY_MS 20                          // -b: a keystroke redraw this often
+#define BENCH_LINE_LEN 72
 
 //since this version of chat_client uses ncurses for ui, the way it is compiled is different
 //also, pthread.h is included. So both of these appear as flags in the compile command:
@@ -15,7 +25,8 @@
 
 typedef struct {
     int sd;
-    struct sockaddr_in server_addr;
+    struct sockaddr_in server_addr;   // moved by redirect$; read via server_addr_get
+    pthread_mutex_t addr_lock;
     volatile int running;
 
     // ncurses UI
@@ -28,10 +39,141 @@ typedef struct {
     int  hist_count;      // number of stored lines
     int  hist_start;      // index of oldest line
     int  scroll_offset;   // 0 = bottom
+    int  drawn_rows;      // chat_win size at the last full redraw (0: none yet),
+    int  drawn_cols;      // so new lines can be drawn on their own until it changes
+    int  full_redraws;    // -F: redraw everything for every line, as before
+
+    // optional reliable delivery (-r)
+    int reliable;
+    rel_session_t rel;
+
+    // long messages travel as frag$ pieces; both threads send, so the
+    // frag and request ids are taken with __atomic_fetch_add
+    frag_table_t frags;
+    uint32_t next_frag_id;
+
+    // id of the last global message received, sent along with conn$ so
+    // the server only replays what we missed, and the epoch it counts in
+    unsigned long long last_msg_id;
+    unsigned int history_epoch;   // 0 = not told yet
+
+    // token, last id and epoch survive restarts in a file per user name
+    // (see session_open), locked while this client has it open. The sender
+    // and the listener both use them: session_lock guards them, and the
+    // conn$ state below
+    pthread_mutex_t session_lock;
+    int session_fd;               // -1 before the first conn$
+    char session_name[SESSION_NAME_LEN];
+
+    // session token from the server; requests carry it so the session
+    // survives an address change
+    unsigned long long token;
+
+    // every request is tagged id$<n>$ so the server can drop repeats
+    unsigned long long next_request_id;
+    unsigned long long request_run;   // this process's run, sent with every id
+
+    // last conn$ we sent, replayed to the owner node after a redirect$
+    char conn_request[BUFFER_SIZE];
+    int redirects;
+
+    // when the datagram being handled arrived (-T), for tracing
+    struct timespec rx_kernel;
+    uint64_t rx_read_ns;
 } client_context_t;
 
+// Sessions are kept per user name in $XDG_RUNTIME_DIR (or $HOME), readable
+// by us alone, as "chat_client-<name>.session". Each client holds an
+// exclusive lock on its file, so a second client for the same name never
+// picks up a token that is in use and so cannot take the session over;
+// it starts a session of its own instead.
+static int session_path(char *path, size_t size, const char *name)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir) dir = getenv("HOME");
+    if (!dir || !*dir) return -1;
+
+    char safe[SESSION_NAME_LEN];
+    size_t i = 0;
+    for (; name[i] && name[i] != '$' && i < sizeof(safe) - 1; i++) {
+        unsigned char c = (unsigned char)name[i];
+        safe[i] = (isalnum(c) || c == '-' || c == '_') ? (char)c : '_';
+    }
+    safe[i] = '\0';
+    return snprintf(path, size, "%s/chat_client-%s.session", dir, safe) < (int)size ? 0 : -1;
+}
+
+// hold ctx->session_lock
+static void session_save_locked(client_context_t *ctx)
+{
+    if (ctx->session_fd < 0) return;
+    char line[96];
+    int n = 0;
+    if (ctx->token != 0) {
+        n = snprintf(line, sizeof(line), "%llx %llu %x\n", ctx->token, ctx->last_msg_id, ctx->history_epoch);
+        if (pwrite(ctx->session_fd, line, (size_t)n, 0) != n) return;
+    }
+    if (ftruncate(ctx->session_fd, n) < 0) return;
+}
+
+// switch to the session file for name (the part of a conn$ before any
+// '$'), loading its token and history position; without one, or if
+// another client holds it, we start with none
+static void session_open(client_context_t *ctx, const char *name)
+{
+    size_t len = strcspn(name, "$");
+    pthread_mutex_lock(&ctx->session_lock);
+    if (ctx->session_fd >= 0 && strlen(ctx->session_name) == len && strncmp(ctx->session_name, name, len) == 0) {
+        pthread_mutex_unlock(&ctx->session_lock);
+        return;     // still the same user
+    }
+
+    if (ctx->session_fd >= 0) {
+        session_save_locked(ctx);
+        close(ctx->session_fd);     // and with it the lock
+        ctx->session_fd = -1;
+    }
+    ctx->token = 0;
+    ctx->last_msg_id = 0;
+    ctx->history_epoch = 0;
+    snprintf(ctx->session_name, sizeof(ctx->session_name), "%.*s", (int)len, name);
+
+    char path[512];
+    int fd = session_path(path, sizeof(path), ctx->session_name) == 0 ? open(path, O_RDWR | O_CREAT, 0600) : -1;
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        close(fd);  // another client is this user right now
+        fd = -1;
+    }
+    if (fd >= 0) {
+        char line[96];
+        ssize_t n = pread(fd, line, sizeof(line) - 1, 0);
+        if (n > 0) {
+            line[n] = '\0';
+            int fields = sscanf(line, "%llx %llu %x", &ctx->token, &ctx->last_msg_id, &ctx->history_epoch);
+            if (fields < 2) {
+                ctx->token = 0;
+                ctx->last_msg_id = 0;
+            }
+            if (fields < 3) {
+                ctx->history_epoch = 0;
+            }
+        }
+        ctx->session_fd = fd;
+    }
+    pthread_mutex_unlock(&ctx->session_lock);
+}
+
+static void session_close(client_context_t *ctx)
+{
+    pthread_mutex_lock(&ctx->session_lock);
+    session_save_locked(ctx);
+    if (ctx->session_fd >= 0) close(ctx->session_fd);
+    ctx->session_fd = -1;
+    pthread_mutex_unlock(&ctx->session_lock);
+}
+
 // add chat history so that the client can scroll up and down and navigate through it
-static void chat_history_add(client_context_t *ctx, const char *msg)
+static void chat_history_add_line(client_context_t *ctx, const char *msg)
 {
     int idx;
     if (ctx->hist_count < CHAT_HISTORY_LINES) {
@@ -41,8 +183,57 @@ static void chat_history_add(client_context_t *ctx, const char *msg)
         idx = ctx->hist_start;
         ctx->hist_start = (ctx->hist_start + 1) % CHAT_HISTORY_LINES;
     }
-    strncpy(ctx->chat_history[idx], msg, BUFFER_SIZE - 1);
-    ctx->chat_history[idx][BUFFER_SIZE - 1] = '\0';
+    size_t n = strlen(msg);
+    if (n > BUFFER_SIZE - 1) n = BUFFER_SIZE - 1;
+    memcpy(ctx->chat_history[idx], msg, n);
+    ctx->chat_history[idx][n] = '\0';
+}
+
+// a message is wrapped into rows no wider than the chat window, at the
+// last space when there is one in the second half of the row, and never
+// inside a UTF-8 sequence; returns how many history lines were added
+// assume ctx->ui_lock already held
+static int chat_history_add(client_context_t *ctx, const char *msg)
+{
+    int cols = getmaxx(ctx->chat_win);
+    size_t width = cols > 0 && cols < BUFFER_SIZE ? (size_t)cols : BUFFER_SIZE - 1;
+
+    size_t len = strlen(msg);
+    int added = 0;
+    char row[BUFFER_SIZE];
+    do {
+        size_t step = len;
+        size_t skip = 0;
+        if (len > width) {
+            step = width;
+            while (step > 0 && ((unsigned char)msg[step] & 0xc0) == 0x80) step--;
+            for (size_t i = step; i > width / 2; i--) {
+                if (msg[i] == ' ') {
+                    step = i;
+                    skip = 1;   // the space itself starts no row
+                    break;
+                }
+            }
+            if (step == 0) step = width;
+        }
+        memcpy(row, msg, step);
+        row[step] = '\0';
+        chat_history_add_line(ctx, row);
+        added++;
+        msg += step + skip;
+        len -= step + skip;
+    } while (len > 0);
+    return added;
+}
+
+// one history line per row. chat_history_add wraps rows to the width at
+// the time; after the window shrinks the rest is cut here, so a row never
+// wraps into the next one (or, on the last row, scrolls the window)
+static void chat_draw_line(WINDOW *win, int row, int cols, const char *text)
+{
+    wmove(win, row, 0);
+    wclrtoeol(win);
+    waddnstr(win, text, cols);
 }
 
 // assume ctx->ui_lock already held
@@ -53,6 +244,8 @@ static void chat_redraw_locked(client_context_t *ctx)
     int win_lines = maxy;
 
     werase(ctx->chat_win);
+    ctx->drawn_rows = maxy;
+    ctx->drawn_cols = maxx;
 
     int n = ctx->hist_count;
     if (n > 0) {
@@ -68,40 +261,205 @@ static void chat_redraw_locked(client_context_t *ctx)
         for (int i = 0; i < lines_to_show; i++) {
             int logical_idx = start_logical + i;
             int buf_idx = (ctx->hist_start + logical_idx) % CHAT_HISTORY_LINES;
-            mvwprintw(ctx->chat_win, i, 0, "%s", ctx->chat_history[buf_idx]);
+            chat_draw_line(ctx->chat_win, i, maxx, ctx->chat_history[buf_idx]);
         }
     }
 
     wrefresh(ctx->chat_win);
 }
 
+// the last `added` history lines are new: scroll them in at the bottom and
+// draw just those rows. Everything else on screen is already right, unless
+// the window changed size since the last full redraw.
+// assume ctx->ui_lock already held
+static void chat_append_locked(client_context_t *ctx, int added)
+{
+    WINDOW *win = ctx->chat_win;
+    int rows, cols;
+    getmaxyx(win, rows, cols);
+    int n = ctx->hist_count;
+
+    if (ctx->full_redraws || rows != ctx->drawn_rows || cols != ctx->drawn_cols || added >= rows) {
+        chat_redraw_locked(ctx);
+        return;
+    }
+
+    if (ctx->scroll_offset > 0) {
+        // reading older lines: keep them in place while new ones arrive
+        int max_offset = n > rows ? n - rows : 0;
+        if (ctx->scroll_offset + added > max_offset) {
+            ctx->scroll_offset = max_offset;
+            chat_redraw_locked(ctx);    // top of the history: the view has to move
+            return;
+        }
+        ctx->scroll_offset += added;
+        return;
+    }
+
+    for (int i = added; i > 0; i--) {
+        int row = n - i;    // rows fill from the top until the window is full
+        if (row >= rows) {
+            scrollok(win, TRUE);
+            wscrl(win, 1);
+            scrollok(win, FALSE);
+            row = rows - 1;
+        }
+        chat_draw_line(win, row, cols, ctx->chat_history[(ctx->hist_start + n - i) % CHAT_HISTORY_LINES]);
+    }
+
+    wrefresh(win);
+}
+
+
+
+// handle one line from the server (a datagram may carry several)
+static int send_request(client_context_t *ctx, const char *request, int n);
+
+// the node we talk to; the listener may move it while others send
+static struct sockaddr_in server_addr_get(client_context_t *ctx)
+{
+    pthread_mutex_lock(&ctx->addr_lock);
+    struct sockaddr_in addr = ctx->server_addr;
+    pthread_mutex_unlock(&ctx->addr_lock);
+    return addr;
+}
+
+// redirect$<ip>:<port>: our name belongs to another node, reconnect there
+static void follow_redirect(client_context_t *ctx, const char *target, char *note, size_t note_size)
+{
+    char ip[32];
+    const char *colon = strrchr(target, ':');
+    struct sockaddr_in addr;
+
+    if (!colon || colon - target >= (long)sizeof(ip)) {
+        snprintf(note, note_size, "[server redirected us to %s; not following]", target);
+        return;
+    }
+    memcpy(ip, target, colon - target);
+    ip[colon - target] = '\0';
+    if (set_socket_addr(&addr, ip, atoi(colon + 1)) < 0) {
+        snprintf(note, note_size, "[bad redirect to %s]", target);
+        return;
+    }
+
+    char request[BUFFER_SIZE + 32];
+    pthread_mutex_lock(&ctx->session_lock);
+    if (ctx->redirects >= MAX_REDIRECTS) {
+        pthread_mutex_unlock(&ctx->session_lock);
+        snprintf(note, note_size, "[server redirected us to %s; not following]", target);
+        return;
+    }
+    ctx->redirects++;
+    ctx->token = 0; // tokens are issued per node
+    int n = snprintf(request, sizeof(request), ID_TAG "%llu:%llx$%s",
+                     __atomic_fetch_add(&ctx->next_request_id, 1, __ATOMIC_RELAXED), ctx->request_run, ctx->conn_request);
+    pthread_mutex_unlock(&ctx->session_lock);
+
+    pthread_mutex_lock(&ctx->addr_lock);
+    ctx->server_addr = addr;
+    pthread_mutex_unlock(&ctx->addr_lock);
+    send_request(ctx, request, n);
+    snprintf(note, note_size, "[redirected to %s]", target);
+}
+
+static void handle_server_message(void *arg, char *msg)
+{
+    client_context_t *ctx = (client_context_t *)arg;
+    char gap_note[128];
+    unsigned long long traced = 0;
+
+    if (strncmp(msg, TOKEN_TAG, TOKEN_TAG_LEN) == 0) {
+        char *end;
+        pthread_mutex_lock(&ctx->session_lock);
+        ctx->token = strtoull(msg + TOKEN_TAG_LEN, &end, 16);
+        if (*end == '$') {
+            unsigned int epoch = (unsigned int)strtoul(end + 1, NULL, 16);
+            if (epoch != ctx->history_epoch) {
+                ctx->last_msg_id = 0;   // our ids mean nothing to this server run
+            }
+            ctx->history_epoch = epoch;
+        }
+        session_save_locked(ctx);
+        pthread_mutex_unlock(&ctx->session_lock);
+        return;
+    }
+
+    if (strncmp(msg, MSG_TAG, MSG_TAG_LEN) == 0) {
+        char *end;
+        unsigned long long id = strtoull(msg + MSG_TAG_LEN, &end, 10);
+        if (*end == '$') {
+            pthread_mutex_lock(&ctx->session_lock);
+            ctx->last_msg_id = id;
+            pthread_mutex_unlock(&ctx->session_lock);
+            msg = end + 1;
+            if (trace_sampled(id)) traced = id;
+        }
+    }
+    else if (strncmp(msg, GAP_TAG, GAP_TAG_LEN) == 0) {
+        unsigned long long last = 0, oldest = 0;
+        sscanf(msg + GAP_TAG_LEN, "%llu$%llu", &last, &oldest);
+        snprintf(gap_note, sizeof(gap_note), "[missed messages after #%llu; history resumes at #%llu]", last, oldest);
+        msg = gap_note;
+    }
+    else if (strncmp(msg, QUEUED_TAG, QUEUED_TAG_LEN) == 0) {
+        snprintf(gap_note, sizeof(gap_note), "[%.64s is offline; message queued]", msg + QUEUED_TAG_LEN);
+        msg = gap_note;
+    }
+    else if (strncmp(msg, REDIRECT_TAG, REDIRECT_TAG_LEN) == 0) {
+        follow_redirect(ctx, msg + REDIRECT_TAG_LEN, gap_note, sizeof(gap_note));
+        msg = gap_note;
+    }
+
+    if (strcmp(msg, "ping$") == 0) {
+        const char *reply = "ret-ping$";
+        struct sockaddr_in server_addr = server_addr_get(ctx);
+        udp_socket_write(ctx->sd, &server_addr, (char*)reply, strlen(reply));
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->ui_lock);
+
+    int added = chat_history_add(ctx, msg);
+    chat_append_locked(ctx, added);
+
+    pthread_mutex_unlock(&ctx->ui_lock);
 
+    if (traced) {
+        uint64_t shown = trace_now_ns();
+        if (ctx->rx_kernel.tv_sec != 0) {
+            trace_span(traced, "client kernel queue", trace_from_realtime(&ctx->rx_kernel), ctx->rx_read_ns, NULL);
+        }
+        trace_span(traced, "client receive", ctx->rx_read_ns, shown, NULL);
+        trace_export();     // sampled, so rare enough to write straight away
+    }
+}
 
 void *listener_thread(void *arg)
 {
     client_context_t *ctx = (client_context_t *)arg;
-    char server_response[BUFFER_SIZE];
+    char server_response[UDP_MTU + 1];
     struct sockaddr_in responder_addr;
 
     while (ctx->running) {
-        int rc = udp_socket_read(ctx->sd, &responder_addr, server_response, BUFFER_SIZE);
+        int rc;
+        if (tracer.every) {
+            rc = udp_socket_read_stamped(ctx->sd, &responder_addr, server_response, UDP_MTU, &ctx->rx_kernel);
+            ctx->rx_read_ns = trace_now_ns();
+        }
+        else {
+            rc = udp_socket_read(ctx->sd, &responder_addr, server_response, UDP_MTU);
+        }
 
         if (rc > 0) {
-            if (rc < BUFFER_SIZE) server_response[rc] = '\0';
-            else server_response[BUFFER_SIZE - 1] = '\0';
-
-            if (strcmp(server_response, "ping$") == 0) {
-                const char *reply = "ret-ping$";
-                udp_socket_write(ctx->sd, &ctx->server_addr, (char*)reply, strlen(reply));
-                continue;
+            char *payload;
+            int n = rel_receive(&ctx->rel, ctx->sd, &responder_addr, server_response, rc, &payload);
+            if (n > 0) {
+                char *msg;
+                n = frag_receive(&ctx->frags, &responder_addr, payload, n, &msg);
+                if (n > 0) {
+                    udp_for_each_message(msg, n, handle_server_message, ctx);
+                }
             }
-
-            pthread_mutex_lock(&ctx->ui_lock);
-
-            chat_history_add(ctx, server_response);
-            chat_redraw_locked(ctx);
-
-            pthread_mutex_unlock(&ctx->ui_lock);
         }
         else if (rc <= 0) {
             break;
@@ -111,13 +469,47 @@ void *listener_thread(void *arg)
     return NULL;
 }
 
+// retransmit unacked requests when running with -r
+void *rel_timer_thread(void *arg)
+{
+    client_context_t *ctx = (client_context_t *)arg;
+
+    while (ctx->running) {
+        struct sockaddr_in server_addr = server_addr_get(ctx);
+        rel_poll(&ctx->rel, ctx->sd, &server_addr);
+        usleep(REL_TICK_MS * 1000);
+    }
+
+    return NULL;
+}
+
+static int client_write_cb(void *arg, const char *buffer, int n)
+{
+    client_context_t *ctx = (client_context_t *)arg;
+    struct sockaddr_in server_addr = server_addr_get(ctx);
+    if (ctx->reliable) {
+        return rel_send(&ctx->rel, ctx->sd, &server_addr, buffer, n);
+    }
+    return udp_socket_write(ctx->sd, &server_addr, (char *)buffer, n);
+}
+
+// send a request, as frag$ pieces if it does not fit in one datagram
+static int send_request(client_context_t *ctx, const char *request, int n)
+{
+    if (n > UDP_PAYLOAD_MAX) {
+        uint32_t msg_id = __atomic_fetch_add(&ctx->next_frag_id, 1, __ATOMIC_RELAXED);
+        return frag_send(msg_id, request, n, client_write_cb, ctx) < 0 ? -1 : n;
+    }
+    return client_write_cb(ctx, request, n);
+}
+
 void *sender_thread(void *arg)
 {
     client_context_t *ctx = (client_context_t *)arg;
 
     while (ctx->running) {
 
-        char client_request[BUFFER_SIZE];
+        static char client_request[FRAG_MAX_MESSAGE];   // room for long pastes
         int len = 0;
         int pos = 0;
         client_request[0] = '\0';
@@ -176,7 +568,12 @@ void *sender_thread(void *arg)
                 pthread_mutex_unlock(&ctx->ui_lock);
                 continue;
             }
-            else if (isprint(ch) && len < BUFFER_SIZE - 1) {
+            else if (ch == KEY_RESIZE) {
+                pthread_mutex_lock(&ctx->ui_lock);
+                chat_redraw_locked(ctx);
+                pthread_mutex_unlock(&ctx->ui_lock);
+            }
+            else if (isprint(ch) && len < FRAG_MAX_MESSAGE - 1) {
                 memmove(&client_request[pos + 1], &client_request[pos], (size_t)(len - pos + 1));
                 client_request[pos] = (char)ch;
                 pos++;
@@ -191,7 +588,33 @@ void *sender_thread(void *arg)
 
         client_request[len] = '\0';
 
-        int rc = udp_socket_write(ctx->sd, &ctx->server_addr, client_request, (int)strlen(client_request));
+        if (strncmp(client_request, "conn$", 5) == 0) {
+            session_open(ctx, client_request + 5);
+        }
+
+        pthread_mutex_lock(&ctx->session_lock);
+        if (strncmp(client_request, "conn$", 5) == 0) {
+            // reconnecting: tell the server where our history ends
+            if (strchr(client_request + 5, '$') == NULL && ctx->last_msg_id > 0 && len < FRAG_MAX_MESSAGE - 32) {
+                snprintf(client_request + len, FRAG_MAX_MESSAGE - len, "$%llu$%x", ctx->last_msg_id, ctx->history_epoch);
+            }
+            snprintf(ctx->conn_request, sizeof(ctx->conn_request), "%s", client_request);
+            ctx->redirects = 0;
+        }
+        unsigned long long token = ctx->token;
+        pthread_mutex_unlock(&ctx->session_lock);
+
+        static char wrapped[FRAG_MAX_MESSAGE + 64];
+        unsigned long long request_id = __atomic_fetch_add(&ctx->next_request_id, 1, __ATOMIC_RELAXED);
+        int n;
+        if (token != 0) {
+            n = snprintf(wrapped, sizeof(wrapped), TOK_TAG "%llx$" ID_TAG "%llu:%llx$%s",
+                         token, request_id, ctx->request_run, client_request);
+        }
+        else {
+            n = snprintf(wrapped, sizeof(wrapped), ID_TAG "%llu:%llx$%s", request_id, ctx->request_run, client_request);
+        }
+        int rc = send_request(ctx, wrapped, n);
         if (rc <= 0) {
             perror("udp_socket_write");
             ctx->running = 0;
@@ -199,6 +622,9 @@ void *sender_thread(void *arg)
         }
 
         if (strncmp(client_request, "disconn$", 8) == 0) {
+            pthread_mutex_lock(&ctx->session_lock);
+            ctx->token = 0; // the server forgets the session
+            pthread_mutex_unlock(&ctx->session_lock);
             ctx->running = 0;
             break;
         }
@@ -207,14 +633,145 @@ void *sender_thread(void *arg)
     return NULL;
 }
 
+// -b: render benchmark. Synthetic lines go through the same path as
+// messages from the server (history, then chat_append_locked) at a fixed
+// rate, with no network involved, while another thread stands in for
+// someone typing and redraws the input line every BENCH_KEY_MS. Reports
+// what a line costs to show, how long a keystroke waits for ui_lock, and
+// the CPU used; run it again with -F to compare with full redraws.
+typedef struct {
+    client_context_t *ctx;
+    volatile int running;
+    hist_t line_ns;       // history add + render, per line, under ui_lock
+    hist_t key_ns;        // lock wait + input line redraw, per keystroke
+} render_bench_t;
+
+static void *bench_keys_thread(void *arg)
+{
+    render_bench_t *b = arg;
+    client_context_t *ctx = b->ctx;
+    int n = 0;
+    while (b->running) {
+        usleep(BENCH_KEY_MS * 1000);
+        uint64_t t0 = trace_now_ns();
+        pthread_mutex_lock(&ctx->ui_lock);
+        wmove(ctx->input_win, 1, 1);
+        wclrtoeol(ctx->input_win);
+        mvwprintw(ctx->input_win, 1, 1, "> typing %d", n++);
+        wrefresh(ctx->input_win);
+        pthread_mutex_unlock(&ctx->ui_lock);
+        hist_record(&b->key_ns, trace_now_ns() - t0);
+    }
+    return NULL;
+}
+
+// lines per second for secs seconds; results go to stdout after endwin
+static void render_bench(client_context_t *ctx, int rate, int secs, WINDOW *chat_win, WINDOW *input_win)
+{
+    render_bench_t *b = calloc(1, sizeof(*b));
+    if (!b) return;
+    b->ctx = ctx;
+    b->running = 1;
+    pthread_t keys_tid;
+    int keys = pthread_create(&keys_tid, NULL, bench_keys_thread, b) == 0;
+
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    uint64_t start = trace_now_ns();
+    uint64_t end = start + (uint64_t)secs * 1000000000ULL;
+    uint64_t sent = 0;
+    char line[BENCH_LINE_LEN + 1];
+    uint64_t now;
+    while ((now = trace_now_ns()) < end) {
+        // catch up with the schedule, then sleep about a millisecond
+        uint64_t due = (now - start) * (uint64_t)rate / 1000000000ULL;
+        for (; sent < due; sent++) {
+            int n = snprintf(line, sizeof(line), "[bench%llu]: ", (unsigned long long)(sent % 7));
+            for (; n < BENCH_LINE_LEN; n++) line[n] = (char)('a' + (sent + (uint64_t)n) % 26);
+            line[n] = '\0';
+            pthread_mutex_lock(&ctx->ui_lock);
+            uint64_t t0 = trace_now_ns();
+            int added = chat_history_add(ctx, line);
+            chat_append_locked(ctx, added);
+            hist_record(&b->line_ns, trace_now_ns() - t0);
+            pthread_mutex_unlock(&ctx->ui_lock);
+        }
+        usleep(1000);
+    }
+    double elapsed = (trace_now_ns() - start) / 1e9;
+    getrusage(RUSAGE_SELF, &ru1);
+    b->running = 0;
+    if (keys) pthread_join(keys_tid, NULL);
+
+    delwin(chat_win);
+    delwin(input_win);
+    endwin();
+
+    double cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) + (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1e6
+               + (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6;
+    printf("%s rendering: %llu lines in %.2f s (%.0f lines/s), cpu %.2f s (%.0f%%)\n",
+           ctx->full_redraws ? "full" : "incremental",
+           (unsigned long long)sent, elapsed, sent / elapsed, cpu, 100.0 * cpu / elapsed);
+    printf("line (us): n=%llu p50=%.1f p99=%.1f max=%.1f\n", (unsigned long long)b->line_ns.count,
+           hist_percentile(&b->line_ns, 50) / 1e3, hist_percentile(&b->line_ns, 99) / 1e3, b->line_ns.max / 1e3);
+    printf("keystroke (us): n=%llu p50=%.1f p99=%.1f max=%.1f\n", (unsigned long long)b->key_ns.count,
+           hist_percentile(&b->key_ns, 50) / 1e3, hist_percentile(&b->key_ns, 99) / 1e3, b->key_ns.max / 1e3);
+    free(b);
+}
+
 // initialise client
+// usage: chat_client [-r] [-T every:trace_file] [-F] [-b rate[:secs]]
+//   -r  retransmit until the server acks
+//   -T  record when traced messages arrive and are shown (see trace.h);
+//       give it the server's -T spec to get one trace of both sides
+//   -F  redraw the whole chat window for every new line
+//   -b  render benchmark: show rate synthetic lines a second (default
+//       10000) for secs seconds (default 10), without a server; then exit
 int main(int argc, char *argv[])
 {
+    int reliable = 0;
+    int full_redraws = 0;
+    int bench_rate = 0, bench_secs = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "rT:Fb:")) != -1) {
+        switch (opt) {
+        case 'r':
+            reliable = 1;
+            break;
+        case 'F':
+            full_redraws = 1;
+            break;
+        case 'b': {
+            char *colon;
+            bench_rate = (int)strtol(optarg, &colon, 10);
+            if (*colon == ':') bench_secs = atoi(colon + 1);
+            if (bench_rate <= 0 || bench_secs <= 0) {
+                fprintf(stderr, "Bad benchmark spec %s (want rate[:secs])\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'T':
+            if (trace_init(optarg, "chat_client") < 0) {
+                fprintf(stderr, "Bad trace spec %s (want every:file)\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r] [-T every:trace_file] [-F] [-b rate[:secs]]\n", argv[0]);
+            return 1;
+        }
+    }
+
     int sd = udp_socket_open(CLIENT_PORT);
     if (sd < 0) {
         perror("udp_socket_open");
         return 1;
     }
+    if (tracer.every) {
+        int one = 1;
+        setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    }
 
     struct sockaddr_in server_addr;
     int rc = set_socket_addr(&server_addr, "127.0.0.1", SERVER_PORT);
@@ -260,6 +817,7 @@ int main(int argc, char *argv[])
     client_context_t ctx;
     ctx.sd = sd;
     ctx.server_addr = server_addr;
+    pthread_mutex_init(&ctx.addr_lock, NULL);
     ctx.running = 1;
     ctx.chat_win = chat_win;
     ctx.input_win = input_win;
@@ -267,8 +825,37 @@ int main(int argc, char *argv[])
     ctx.hist_count = 0;
     ctx.hist_start = 0;
     ctx.scroll_offset = 0;
+    ctx.drawn_rows = 0;
+    ctx.drawn_cols = 0;
+    ctx.full_redraws = full_redraws;
+    ctx.reliable = reliable;
+    rel_init(&ctx.rel);
+    frag_table_init(&ctx.frags);
+    ctx.next_frag_id = 1;
+    ctx.last_msg_id = 0;
+    ctx.history_epoch = 0;
+    ctx.token = 0;
+    ctx.next_request_id = 1;
+    ctx.request_run = request_run_new();
+    ctx.conn_request[0] = '\0';
+    ctx.redirects = 0;
+    memset(&ctx.rx_kernel, 0, sizeof(ctx.rx_kernel));
+    ctx.rx_read_ns = 0;
+    pthread_mutex_init(&ctx.session_lock, NULL);
+    ctx.session_fd = -1;
+    ctx.session_name[0] = '\0';
+
+    if (bench_rate) {
+        render_bench(&ctx, bench_rate, bench_secs, chat_win, input_win);
+        close(sd);
+        pthread_mutex_destroy(&ctx.ui_lock);
+        pthread_mutex_destroy(&ctx.addr_lock);
+        rel_destroy(&ctx.rel);
+        frag_table_destroy(&ctx.frags);
+        return 0;
+    }
 
-    pthread_t listener_tid, sender_tid;
+    pthread_t listener_tid, sender_tid, rel_tid;
 
     rc = pthread_create(&listener_tid, NULL, listener_thread, &ctx);
     if (rc != 0) {
@@ -286,8 +873,19 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (ctx.reliable) {
+        rc = pthread_create(&rel_tid, NULL, rel_timer_thread, &ctx);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to create retransmit thread\n");
+            ctx.reliable = 0;
+        }
+    }
+
     pthread_join(sender_tid, NULL);
     ctx.running = 0;
+    if (ctx.reliable) {
+        pthread_join(rel_tid, NULL);
+    }
     close(sd);
     pthread_join(listener_tid, NULL);
 
@@ -296,6 +894,11 @@ int main(int argc, char *argv[])
     delwin(input_win);
     endwin();
     pthread_mutex_destroy(&ctx.ui_lock);
+    pthread_mutex_destroy(&ctx.addr_lock);
+    rel_destroy(&ctx.rel);
+    session_close(&ctx);
+    pthread_mutex_destroy(&ctx.session_lock);
+    frag_table_destroy(&ctx.frags);
 
     printf("Client exiting.\n");
     return 0;
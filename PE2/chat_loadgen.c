@@ -0,0 +1,636 @@
+#define _GNU_SOURCE     // sendmmsg(), recvmmsg()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "udp.h"
+#include "histogram.h"
+
+// Headless load generator: many chat clients in one process.
+//
+// The server tells clients apart by source address, so every simulated
+// client needs its own. Instead of one socket per client we give each a
+// loopback address of its own (127.1.x.y) and share a few sockets between
+// them: IP_PKTINFO picks the source address per datagram on the way out and
+// reports the destination on the way in. That lets one sendmmsg() carry
+// requests from many clients and one recvmmsg() collect their replies. The
+// server must therefore run on this host.
+//
+// Requests arrive open loop: a Poisson process at the offered rate decides
+// when the next one is due, whatever the server is doing, so a saturated
+// server shows up as growing latency and missing deliveries rather than as
+// a slower generator. say$ and sayto$ carry "@t=<send time in us>", and
+// every delivery of one is timed end to end. A client that logs in again
+// passes its last msg$ id; history sent on login (anything said before it)
+// is counted as replayed, not delivered.
+//
+// compile: gcc chat_loadgen.c -o chat_loadgen -lpthread -lm
+// usage:   chat_loadgen [-s server_ip] [-p port] [-n clients] [-k sockets]
+//                       [-r rate[:end_rate]] [-d seconds] [-m mix] [-b bytes] [-S seed]
+//   -n  simulated clients (default 1000)
+//   -k  sockets they are spread over (default 16)
+//   -r  requests per second; with :end_rate the rate ramps linearly over
+//       the run, and the per-second lines show where the server saturates
+//   -d  length of the run in seconds (default 10)
+//   -m  weights of conn,say,sayto,mute,rename,disconn (default
+//       "say=80,sayto=10,mute=4,rename=3,disconn=2,conn=1")
+//   -b  size of say$/sayto$ text (default 32)
+//   -S  seed for the choice of clients and requests (default 1)
+
+#define LG_BATCH 64
+#define LG_RCVBUF (4 * 1024 * 1024)
+#define LG_CONNECT_RATE 20000     // conn$ per second while logging everyone in
+#define LG_SETTLE_MS 1000         // after the logins and after the run
+#define LG_NAME_LEN 32
+#define LG_STAMP "@t="
+
+enum { OP_CONN, OP_SAY, OP_SAYTO, OP_MUTE, OP_RENAME, OP_DISCONN, OP_COUNT };
+static const char *op_names[OP_COUNT] = { "conn", "say", "sayto", "mute", "rename", "disconn" };
+
+typedef struct {
+    int sock;                   // index into lg.socks
+    struct in_addr ip;          // our own loopback source address
+    char name[LG_NAME_LEN];
+    char muted[LG_NAME_LEN];    // "" or the one name this client has muted
+    int connected;
+    int renames;
+    // newest msg$ id seen and the history epoch it belongs to, and when the
+    // client last logged in (stats_lock): a reconnect asks only for newer
+    // history, and history is not timed as a delivery
+    uint64_t last_msg_id;
+    uint32_t history_epoch;
+    long long login_us;
+} lg_client_t;
+
+typedef struct {
+    struct mmsghdr msgs[LG_BATCH];
+    struct iovec iov[LG_BATCH];
+    char data[LG_BATCH][BUFFER_SIZE];
+    char control[LG_BATCH][CMSG_SPACE(sizeof(struct in_pktinfo))];
+    int count;
+} lg_batch_t;
+
+static struct {
+    struct sockaddr_in server;
+    int nclients, nsocks;
+    lg_client_t *clients;
+    int *socks;
+    lg_batch_t *batches;        // one per socket, sender thread only
+    int msg_bytes;
+    int weights[OP_COUNT];
+    int weight_total;
+    uint64_t rng;
+    volatile int running;
+
+    unsigned long sent[OP_COUNT];
+    unsigned long send_errors;
+
+    // receiver thread
+    pthread_mutex_t stats_lock;
+    hist_t interval, total;     // delivery latency in us
+    unsigned long delivered, replayed, other, pings, unknown;
+} lg;
+
+static char lg_pad[BUFFER_SIZE];    // message text after the stamp
+
+static uint64_t lg_random(void)
+{
+    // xorshift64*: the same seed replays the same choices
+    lg.rng ^= lg.rng >> 12;
+    lg.rng ^= lg.rng << 25;
+    lg.rng ^= lg.rng >> 27;
+    return lg.rng * 2685821657736338717ULL;
+}
+
+static double lg_uniform(void)
+{
+    return (double)((lg_random() >> 11) + 1) / 9007199254740993.0;   // (0, 1]
+}
+
+static int lg_parse_mix(const char *spec)
+{
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    memset(lg.weights, 0, sizeof(lg.weights));
+    lg.weight_total = 0;
+
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int op = -1;
+        for (int i = 0; i < OP_COUNT; i++) {
+            if (strcmp(item, op_names[i]) == 0) op = i;
+        }
+        int w = atoi(eq + 1);
+        if (op < 0 || w < 0) return -1;
+        lg.weights[op] = w;
+        lg.weight_total += w;
+    }
+    return lg.weight_total > 0 ? 0 : -1;
+}
+
+static int lg_pick_op(void)
+{
+    int r = (int)(lg_random() % (uint64_t)lg.weight_total);
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (r < lg.weights[i]) return i;
+        r -= lg.weights[i];
+    }
+    return OP_SAY;
+}
+
+static void lg_flush(int sock)
+{
+    lg_batch_t *b = &lg.batches[sock];
+    int sent = 0;
+    while (sent < b->count) {
+        int rc = sendmmsg(lg.socks[sock], b->msgs + sent, b->count - sent, 0);
+        if (rc <= 0) {
+            lg.send_errors += b->count - sent;   // socket buffer full: the server is behind
+            break;
+        }
+        sent += rc;
+    }
+    b->count = 0;
+}
+
+static void lg_flush_all(void)
+{
+    for (int s = 0; s < lg.nsocks; s++) {
+        if (lg.batches[s].count > 0) lg_flush(s);
+    }
+}
+
+// queue one request from client c (sender thread)
+static void lg_queue(lg_client_t *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void lg_queue(lg_client_t *c, const char *fmt, ...)
+{
+    lg_batch_t *b = &lg.batches[c->sock];
+    int i = b->count;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(b->data[i], BUFFER_SIZE, fmt, ap);
+    va_end(ap);
+    if (n >= BUFFER_SIZE) n = BUFFER_SIZE - 1;
+
+    b->iov[i].iov_base = b->data[i];
+    b->iov[i].iov_len = n + 1;
+
+    struct msghdr *h = &b->msgs[i].msg_hdr;
+    memset(h, 0, sizeof(*h));
+    h->msg_name = &lg.server;
+    h->msg_namelen = sizeof(lg.server);
+    h->msg_iov = &b->iov[i];
+    h->msg_iovlen = 1;
+    h->msg_control = b->control[i];
+    h->msg_controllen = sizeof(b->control[i]);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+    cm->cmsg_level = IPPROTO_IP;
+    cm->cmsg_type = IP_PKTINFO;
+    cm->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    struct in_pktinfo *pi = (struct in_pktinfo *)CMSG_DATA(cm);
+    memset(pi, 0, sizeof(*pi));
+    pi->ipi_spec_dst = c->ip;
+
+    if (++b->count == LG_BATCH) {
+        lg_flush(c->sock);
+    }
+}
+
+static lg_client_t *lg_random_connected(void)
+{
+    for (int tries = 0; tries < 8; tries++) {
+        lg_client_t *c = &lg.clients[lg_random() % (uint64_t)lg.nclients];
+        if (c->connected) return c;
+    }
+    return NULL;
+}
+
+static void lg_request(lg_client_t *c, int op)
+{
+    if (!c->connected) {
+        op = OP_CONN;   // whatever was drawn, a logged-out client logs in first
+    }
+    long long now = udp_now_us();
+    lg_client_t *other;
+
+    switch (op) {
+    case OP_CONN:
+        pthread_mutex_lock(&lg.stats_lock);
+        uint64_t last_id = c->last_msg_id;
+        uint32_t epoch = c->history_epoch;
+        if (!c->connected) c->login_us = now;
+        pthread_mutex_unlock(&lg.stats_lock);
+        if (last_id > 0) {
+            lg_queue(c, "conn$%s$%llu$%x", c->name, (unsigned long long)last_id, epoch);
+        }
+        else {
+            lg_queue(c, "conn$%s", c->name);
+        }
+        c->connected = 1;
+        break;
+    case OP_SAY:
+        lg_queue(c, "say$" LG_STAMP "%lld %.*s", now, lg.msg_bytes, lg_pad);
+        break;
+    case OP_SAYTO:
+        other = lg_random_connected();
+        if (!other) return;
+        lg_queue(c, "sayto$%s " LG_STAMP "%lld %.*s", other->name, now, lg.msg_bytes, lg_pad);
+        break;
+    case OP_MUTE:
+        // alternate, so nobody ends up deaf to the whole room
+        if (c->muted[0]) {
+            lg_queue(c, "unmute$%s", c->muted);
+            c->muted[0] = '\0';
+        }
+        else if ((other = lg_random_connected()) != NULL && other != c) {
+            lg_queue(c, "mute$%s", other->name);
+            snprintf(c->muted, sizeof(c->muted), "%s", other->name);
+        }
+        else {
+            return;
+        }
+        break;
+    case OP_RENAME:
+        snprintf(c->name, sizeof(c->name), "lg%d_%d", (int)(c - lg.clients), ++c->renames);
+        lg_queue(c, "rename$%s", c->name);
+        break;
+    case OP_DISCONN:
+        lg_queue(c, "disconn$");
+        c->connected = 0;
+        c->muted[0] = '\0';   // the server forgets it too
+        break;
+    }
+    lg.sent[op]++;
+}
+
+static void lg_send_ping_reply(int sock, struct in_addr ip)
+{
+    char reply[] = "ret-ping$";
+    struct iovec iov = { reply, sizeof(reply) };
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct msghdr h;
+    memset(&h, 0, sizeof(h));
+    h.msg_name = &lg.server;
+    h.msg_namelen = sizeof(lg.server);
+    h.msg_iov = &iov;
+    h.msg_iovlen = 1;
+    h.msg_control = control;
+    h.msg_controllen = sizeof(control);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&h);
+    cm->cmsg_level = IPPROTO_IP;
+    cm->cmsg_type = IP_PKTINFO;
+    cm->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    struct in_pktinfo *pi = (struct in_pktinfo *)CMSG_DATA(cm);
+    memset(pi, 0, sizeof(*pi));
+    pi->ipi_spec_dst = ip;
+    sendmsg(lg.socks[sock], &h, 0);
+}
+
+// client whose loopback address a reply went to, or NULL
+static lg_client_t *lg_client_at(int sock, struct in_addr to)
+{
+    uint32_t slot = ntohl(to.s_addr) - 0x7f010001u;
+    if (slot >= (uint32_t)lg.nclients) return NULL;
+    long i = (long)slot * lg.nsocks + sock;
+    return i < lg.nclients ? &lg.clients[i] : NULL;
+}
+
+// one server line for client c; times it if it carries our stamp and is
+// not history the client has already seen (stats_lock held)
+static void lg_account(lg_client_t *c, const char *line, long long now)
+{
+    if (c && strncmp(line, TOKEN_TAG, TOKEN_TAG_LEN) == 0) {
+        const char *sep = strchr(line + TOKEN_TAG_LEN, '$');
+        uint32_t epoch = sep ? (uint32_t)strtoul(sep + 1, NULL, 16) : 0;
+        if (epoch != c->history_epoch) {
+            c->last_msg_id = 0;   // a new id space
+            c->history_epoch = epoch;
+        }
+    }
+    else if (c && strncmp(line, MSG_TAG, MSG_TAG_LEN) == 0) {
+        uint64_t id = strtoull(line + MSG_TAG_LEN, NULL, 10);
+        const char *stamp = strstr(line, LG_STAMP);
+        int replayed = id <= c->last_msg_id ||
+                       (stamp && strtoll(stamp + strlen(LG_STAMP), NULL, 10) < c->login_us);
+        if (id > c->last_msg_id) c->last_msg_id = id;
+        if (replayed) {
+            lg.replayed++;   // said before this login: history, not a delivery
+            return;
+        }
+    }
+
+    const char *stamp = strstr(line, LG_STAMP);
+    if (stamp) {
+        long long sent_us = strtoll(stamp + strlen(LG_STAMP), NULL, 10);
+        long long latency = now - sent_us;
+        if (latency < 0) latency = 0;
+        hist_record(&lg.interval, (uint64_t)latency);
+        lg.delivered++;
+    }
+    else {
+        lg.other++;
+    }
+}
+
+void *lg_receiver_thread(void *arg)
+{
+    (void)arg;
+    int ep = epoll_create1(0);
+    for (int s = 0; s < lg.nsocks; s++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)s };
+        epoll_ctl(ep, EPOLL_CTL_ADD, lg.socks[s], &ev);
+    }
+
+    static struct mmsghdr msgs[LG_BATCH];
+    static struct iovec iov[LG_BATCH];
+    static char data[LG_BATCH][UDP_MTU + 1];
+    static char control[LG_BATCH][CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct epoll_event events[64];
+
+    while (lg.running) {
+        int ready = epoll_wait(ep, events, 64, 50);
+        for (int e = 0; e < ready; e++) {
+            int s = (int)events[e].data.u32;
+            for (;;) {
+                for (int i = 0; i < LG_BATCH; i++) {
+                    iov[i].iov_base = data[i];
+                    iov[i].iov_len = UDP_MTU;
+                    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                    msgs[i].msg_hdr.msg_iov = &iov[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                    msgs[i].msg_hdr.msg_control = control[i];
+                    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+                }
+                int n = recvmmsg(lg.socks[s], msgs, LG_BATCH, MSG_DONTWAIT, NULL);
+                if (n <= 0) break;
+
+                long long now = udp_now_us();
+                pthread_mutex_lock(&lg.stats_lock);
+                for (int i = 0; i < n; i++) {
+                    char *buf = data[i];
+                    int len = (int)msgs[i].msg_len;
+                    buf[len] = '\0';
+
+                    struct in_addr to = { 0 };
+                    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+                        if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_PKTINFO) {
+                            to = ((struct in_pktinfo *)CMSG_DATA(cm))->ipi_addr;
+                        }
+                    }
+
+                    if (strncmp(buf, "ping$", 5) == 0) {
+                        lg.pings++;
+                        lg_send_ping_reply(s, to);
+                    }
+                    else if (strncmp(buf, BATCH_TAG, BATCH_TAG_LEN) == 0) {
+                        // coalesced lines, each NUL terminated
+                        lg_client_t *c = lg_client_at(s, to);
+                        for (char *p = buf + BATCH_TAG_LEN; p < buf + len && *p; p += strlen(p) + 1) {
+                            lg_account(c, p, now);
+                        }
+                    }
+                    else if (to.s_addr == 0) {
+                        lg.unknown++;
+                    }
+                    else {
+                        lg_account(lg_client_at(s, to), buf, now);
+                    }
+                }
+                pthread_mutex_unlock(&lg.stats_lock);
+            }
+        }
+    }
+    close(ep);
+    return NULL;
+}
+
+static int lg_open_sockets(void)
+{
+    // one fd per socket only, but raise the limit anyway for large -k
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    for (int s = 0; s < lg.nsocks; s++) {
+        int sd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sd < 0) return -1;
+        int on = 1, rcvbuf = LG_RCVBUF;
+        setsockopt(sd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+        setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &rcvbuf, sizeof(rcvbuf));
+
+        // bound to any address so replies to all of our 127.1.x.y arrive here
+        struct sockaddr_in addr;
+        set_socket_addr(&addr, NULL, 0);
+        if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return -1;
+        lg.socks[s] = sd;
+    }
+    return 0;
+}
+
+static void lg_report_line(double t, double rate, unsigned long sent, unsigned long delivered, const hist_t *h)
+{
+    printf("%6.1f  %9.0f  %9lu  %10lu  %8llu  %8llu  %8llu  %9llu\n",
+           t, rate, sent, delivered,
+           (unsigned long long)hist_percentile(h, 50),
+           (unsigned long long)hist_percentile(h, 99),
+           (unsigned long long)hist_percentile(h, 99.9),
+           (unsigned long long)h->max);
+}
+
+static unsigned long lg_total_sent(void)
+{
+    unsigned long total = 0;
+    for (int i = 0; i < OP_COUNT; i++) total += lg.sent[i];
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server_ip = "127.0.0.1";
+    int port = SERVER_PORT;
+    double rate = 1000, end_rate = -1;
+    double duration = 10;
+    const char *mix = "say=80,sayto=10,mute=4,rename=3,disconn=2,conn=1";
+    unsigned long long seed = 1;
+
+    lg.nclients = 1000;
+    lg.nsocks = 16;
+    lg.msg_bytes = 32;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:n:k:r:d:m:b:S:")) != -1) {
+        switch (opt) {
+            case 's': server_ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': lg.nclients = atoi(optarg); break;
+            case 'k': lg.nsocks = atoi(optarg); break;
+            case 'r': {
+                char *colon;
+                rate = strtod(optarg, &colon);
+                if (*colon == ':') end_rate = strtod(colon + 1, NULL);
+                break;
+            }
+            case 'd': duration = strtod(optarg, NULL); break;
+            case 'm': mix = optarg; break;
+            case 'b': lg.msg_bytes = atoi(optarg); break;
+            case 'S': seed = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-s server_ip] [-p port] [-n clients] [-k sockets] "
+                                "[-r rate[:end_rate]] [-d seconds] [-m mix] [-b bytes] [-S seed]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (end_rate < 0) end_rate = rate;
+    if (lg.nclients < 1 || lg.nsocks < 1 || rate <= 0 || end_rate <= 0 || duration <= 0) {
+        fprintf(stderr, "clients, sockets, rates and duration must be positive\n");
+        return 1;
+    }
+    if (lg.nclients / lg.nsocks >= 65535) {
+        fprintf(stderr, "at most 65534 clients per socket\n");
+        return 1;
+    }
+    if (lg.msg_bytes < 0 || lg.msg_bytes > BUFFER_SIZE - 64) {
+        fprintf(stderr, "bytes must be 0..%d\n", BUFFER_SIZE - 64);
+        return 1;
+    }
+    if (lg_parse_mix(mix) < 0) {
+        fprintf(stderr, "bad mix \"%s\": expected op=weight,... with ops conn,say,sayto,mute,rename,disconn\n", mix);
+        return 1;
+    }
+    if (set_socket_addr(&lg.server, server_ip, port) < 0) {
+        fprintf(stderr, "bad server address %s\n", server_ip);
+        return 1;
+    }
+    lg.rng = seed ? seed : 1;
+    memset(lg_pad, 'x', sizeof(lg_pad) - 1);
+
+    lg.clients = calloc(lg.nclients, sizeof(lg_client_t));
+    lg.socks = calloc(lg.nsocks, sizeof(int));
+    lg.batches = calloc(lg.nsocks, sizeof(lg_batch_t));
+    assert(lg.clients && lg.socks && lg.batches);
+    if (lg_open_sockets() < 0) {
+        perror("socket");
+        return 1;
+    }
+    for (int i = 0; i < lg.nclients; i++) {
+        lg_client_t *c = &lg.clients[i];
+        c->sock = i % lg.nsocks;
+        c->ip.s_addr = htonl(0x7f010000u + (uint32_t)(i / lg.nsocks) + 1);   // 127.1.x.y
+        snprintf(c->name, sizeof(c->name), "lg%d", i);
+    }
+
+    pthread_mutex_init(&lg.stats_lock, NULL);
+    lg.running = 1;
+    pthread_t rx;
+    pthread_create(&rx, NULL, lg_receiver_thread, NULL);
+
+    // log everyone in at a steady pace, then let the history replays drain
+    long long start = udp_now_us();
+    for (int i = 0; i < lg.nclients; i++) {
+        lg_request(&lg.clients[i], OP_CONN);
+        long long due = start + (long long)i * 1000000LL / LG_CONNECT_RATE;
+        long long now = udp_now_us();
+        if (due > now) {
+            lg_flush_all();
+            usleep(due - now);
+        }
+    }
+    lg_flush_all();
+    usleep(LG_SETTLE_MS * 1000);
+    pthread_mutex_lock(&lg.stats_lock);
+    hist_reset(&lg.interval);
+    lg.delivered = lg.replayed = lg.other = 0;
+    pthread_mutex_unlock(&lg.stats_lock);
+    memset(lg.sent, 0, sizeof(lg.sent));
+
+    printf("%d clients on %d sockets, %.0f -> %.0f requests/s for %.0f s, mix %s\n",
+           lg.nclients, lg.nsocks, rate, end_rate, duration, mix);
+    printf("     t    offered       sent   delivered   p50_us    p99_us  p999_us     max_us\n");
+
+    start = udp_now_us();
+    long long end = start + (long long)(duration * 1e6);
+    long long next = start;
+    long long next_report = start + 1000000;
+    unsigned long sent_before = 0, delivered_before = 0;
+
+    while (1) {
+        long long now = udp_now_us();
+        if (now >= end) break;
+        double offered = rate + (end_rate - rate) * (double)(now - start) / (double)(end - start);
+
+        // open loop: everything that came due, however late we are
+        while (next <= now) {
+            lg_client_t *c = &lg.clients[lg_random() % (uint64_t)lg.nclients];
+            lg_request(c, lg_pick_op());
+            next += (long long)(-log(lg_uniform()) / offered * 1e6);
+        }
+        lg_flush_all();
+
+        if (now >= next_report) {
+            pthread_mutex_lock(&lg.stats_lock);
+            hist_t h = lg.interval;
+            hist_merge(&lg.total, &lg.interval);
+            hist_reset(&lg.interval);
+            unsigned long delivered = lg.delivered;
+            pthread_mutex_unlock(&lg.stats_lock);
+
+            unsigned long sent = lg_total_sent();
+            lg_report_line((now - start) / 1e6, offered, sent - sent_before, delivered - delivered_before, &h);
+            fflush(stdout);
+            sent_before = sent;
+            delivered_before = delivered;
+            next_report += 1000000;
+        }
+
+        long long wait = next - udp_now_us();
+        if (wait > 1000) wait = 1000;
+        if (wait > 0) usleep(wait);
+    }
+    long long elapsed = udp_now_us() - start;
+    unsigned long sent = lg_total_sent();   // the closing logouts are not part of the run
+
+    // late deliveries still count, then everyone logs out
+    usleep(LG_SETTLE_MS * 1000);
+    for (int i = 0; i < lg.nclients; i++) {
+        if (lg.clients[i].connected) lg_request(&lg.clients[i], OP_DISCONN);
+    }
+    lg_flush_all();
+    usleep(100 * 1000);
+    lg.running = 0;
+    pthread_join(rx, NULL);
+
+    hist_merge(&lg.total, &lg.interval);
+    double secs = elapsed / 1e6;
+
+    printf("\nrequests:");
+    for (int i = 0; i < OP_COUNT; i++) printf(" %s=%lu", op_names[i], lg.sent[i]);
+    printf("\nsend errors: %lu, pings answered: %lu, history replayed: %lu, other lines: %lu\n",
+           lg.send_errors, lg.pings, lg.replayed, lg.other);
+    printf("throughput: %.0f requests/s sent, %.0f deliveries/s received\n", sent / secs, lg.delivered / secs);
+    printf("delivery latency (us): n=%llu mean=%.0f p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu\n",
+           (unsigned long long)lg.total.count, hist_mean(&lg.total),
+           (unsigned long long)hist_percentile(&lg.total, 50),
+           (unsigned long long)hist_percentile(&lg.total, 90),
+           (unsigned long long)hist_percentile(&lg.total, 99),
+           (unsigned long long)hist_percentile(&lg.total, 99.9),
+           (unsigned long long)lg.total.max);
+
+    for (int s = 0; s < lg.nsocks; s++) close(lg.socks[s]);
+    free(lg.clients);
+    free(lg.socks);
+    free(lg.batches);
+    return 0;
+}
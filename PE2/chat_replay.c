@@ -0,0 +1,180 @@
+#define CHAT_SERVER_NO_MAIN
+#include "chat_server.c"
+
+// Replays a capture taken with chat_server -C through the server's own
+// request path, offline: no clients and no network needed.
+//
+// chat_server.c is compiled in whole (without its main), and each captured
+// datagram goes to serve_datagram exactly as the listener would hand it
+// over, from the address it was captured from. The outbound and search
+// threads run as they do in the server; the ping monitor does not, so that
+// how fast a capture is replayed never decides who gets evicted.
+//
+// Datagrams are handed over at the captured pace (-x 1), a multiple of it,
+// or back to back (-x 0). The report gives throughput, how long each
+// datagram took to serve, how far behind schedule the replay fell, and the
+// usual request stages. The server's log goes to stdout as it would from
+// chat_server; the report goes to stderr.
+//
+// Replies are dropped just before they would be sent (as with UDP_LOSS=100),
+// so a replay never talks to anyone. With -w they really are sent, to the
+// captured addresses: only do that with a capture taken on this host.
+//
+// compile: gcc -O2 chat_replay.c -o chat_replay -lpthread
+// usage:   chat_replay [-x speed] [-w] [-c coalesce_ms] [-L level] [-R n] capture_file
+//   -x  1 replays at the captured pace (default), 10 ten times faster,
+//       0 as fast as possible
+//   -w  send replies for real, through a socket on an ephemeral port
+//   -c  as chat_server -c
+//   -L  as chat_server -L (default info)
+//   -R  as chat_server -R (default 1)
+
+#define REPLAY_SPIN_US 200      // closer to a due time than this we spin, not sleep
+#define REPLAY_SETTLE_MS 50     // lets coalesced lines go out before the report
+
+static void replay_hist_line(const char *name, hist_t *h, double us_per_unit)
+{
+    fprintf(stderr, "%s: n=%llu p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+            name, (unsigned long long)h->count,
+            hist_percentile(h, 50) * us_per_unit, hist_percentile(h, 90) * us_per_unit,
+            hist_percentile(h, 99) * us_per_unit, hist_percentile(h, 99.9) * us_per_unit,
+            h->max * us_per_unit);
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1.0;
+    int send_replies = 0;
+    int coalesce_ms = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:wc:L:R:")) != -1) {
+        switch (opt) {
+            case 'x': speed = atof(optarg); break;
+            case 'w': send_replies = 1; break;
+            case 'c': coalesce_ms = atoi(optarg); break;
+            case 'L':
+                alog.level = alog_parse_level(optarg);
+                if (alog.level < 0) {
+                    fprintf(stderr, "Unknown log level %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R': alog.sample_every = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-x speed] [-w] [-c coalesce_ms] [-L level] [-R n] capture_file\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-x speed] [-w] [-c coalesce_ms] [-L level] [-R n] capture_file\n", argv[0]);
+        return 1;
+    }
+
+    dgcap_reader_t cap;
+    if (dgcap_open(&cap, argv[optind]) < 0) {
+        fprintf(stderr, "%s is not a readable capture\n", argv[optind]);
+        return 1;
+    }
+
+    if (!send_replies) {
+        udp_loss_rate = 1.0;
+    }
+    // tokens, the history epoch and rel$ session ids are the randomness on
+    // the request path; seeded, every replay hands out the same ones (not
+    // the captured ones, so a captured tok$ resumes nothing)
+    udp_random_seed = 1;
+
+    if (alog_start() != 0) {
+        fprintf(stderr, "Failed to create log writer thread\n");
+        return 1;
+    }
+
+    int sd = udp_socket_open(0);
+    assert(sd > -1);
+    server_context_t ctx;
+    server_context_init(&ctx, sd, coalesce_ms);
+
+    stats_register("replay");
+    stats_calibrate();
+    double us_per_tick = stats_ns_per_tick / 1000.0;
+
+    pthread_t outbound_tid, search_tid;
+    if (pthread_create(&outbound_tid, NULL, outbound_thread, &ctx) != 0 ||
+        pthread_create(&search_tid, NULL, search_thread, &ctx) != 0) {
+        fprintf(stderr, "Failed to create server threads\n");
+        return 1;
+    }
+
+    hist_t *service = calloc(1, sizeof(hist_t));   // ticks per datagram
+    hist_t *lag = calloc(1, sizeof(hist_t));       // us behind schedule
+    assert(service != NULL && lag != NULL);
+
+    char request[UDP_MTU + 1];
+    dgcap_record_t rec;
+    unsigned long datagrams = 0, skipped = 0;
+    unsigned long long bytes = 0;
+    long long captured_us = 0;
+    long long start = udp_now_us();
+
+    while (dgcap_next(&cap, &rec)) {
+        if (rec.len > UDP_MTU) {
+            skipped++;      // the listener never reads more than this
+            continue;
+        }
+        captured_us = rec.at_us;
+
+        if (speed > 0) {
+            long long due = start + (long long)(rec.at_us / speed);
+            long long now = udp_now_us();
+            if (due - now > REPLAY_SPIN_US) {
+                usleep((useconds_t)(due - now - REPLAY_SPIN_US / 2));
+            }
+            while ((now = udp_now_us()) < due) {
+            }
+            hist_record(lag, (uint64_t)(now - due));
+        }
+
+        memcpy(request, rec.data, (size_t)rec.len);
+        uint64_t t0 = stats_now();
+        serve_datagram(&ctx, &rec.addr, request, rec.len);
+        hist_record(service, stats_now() - t0);
+        datagrams++;
+        bytes += (unsigned long long)rec.len;
+    }
+
+    long long elapsed = udp_now_us() - start;
+    usleep(REPLAY_SETTLE_MS * 1000);
+    ctx.running = 0;
+    pthread_join(outbound_tid, NULL);
+    pthread_join(search_tid, NULL);
+
+    double secs = elapsed > 0 ? elapsed / 1e6 : 1e-6;
+    fprintf(stderr, "capture: %lu datagrams, %llu bytes over %.3f s",
+            datagrams, bytes, captured_us / 1e6);
+    if (skipped) fprintf(stderr, " (%lu oversized skipped)", skipped);
+    fprintf(stderr, "\n");
+    if (speed > 0) fprintf(stderr, "replay: %gx the captured pace in %.3f s\n", speed, secs);
+    else fprintf(stderr, "replay: as fast as possible in %.3f s\n", secs);
+    fprintf(stderr, "throughput: %.0f datagrams/s, %.2f MB/s\n", datagrams / secs, bytes / secs / 1e6);
+
+    fprintf(stderr, "latencies in us\n");
+    replay_hist_line("service", service, us_per_tick);
+    if (speed > 0) replay_hist_line("behind schedule", lag, 1.0);
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        replay_hist_line(stage_names[s], &thread_stats->stages[s], us_per_tick);
+    }
+
+    fprintf(stderr, "commands:");
+    for (int c = 0; c <= STAT_COMMANDS; c++) {
+        if (thread_stats->commands[c] == 0) continue;
+        fprintf(stderr, " %s=%lu", c < STAT_COMMANDS ? stat_commands[c] : "other", thread_stats->commands[c]);
+    }
+    fprintf(stderr, "\n");
+
+    free(service);
+    free(lag);
+    dgcap_close_reader(&cap);
+    close(sd);
+    alog_stop();
+    return 0;
+}
@@ -1,17 +1,80 @@
+#define _GNU_SOURCE     // sendmmsg()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <time.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
 #include "udp.h"
+#include "msglog.h"
+#include "search_index.h"
+#include "histogram.h"
+#include "lockprof.h"
+#include "asynclog.h"
+#include "dgcap.h"
+#include "trace.h"
 
 #define MAX_NAME_LEN 64
 #define MAX_MUTED 16
 #define INACTIVE_THRESHOLD 120
 #define PING_TIMEOUT 10
+#define OUTBOUND_IDLE_MS 100     // the outbound thread checks ctx->running this often when idle
+#define MAX_ROOMS_PER_CLIENT 16
+#define ROOM_BUCKETS 4096
+#define ROOM_HISTORY_SIZE 15
+#define MAX_PEERS 16
+#define FED_HELLO_MS 1000
+#define FED_PEER_TIMEOUT_MS 5000
+#define FED_ROSTER_CHUNK 8192
+#define REMOTE_BUCKETS 1024
+#define RING_VNODES 128
+#define MAX_SUBS_PER_CLIENT 32
+#define MAX_TOPIC_LEN 128
+#define FANOUT_BATCH 64
+#define PRESENCE_INTERVAL_MS 200
+#define PRESENCE_BUCKETS 1024
+#define MAILBOX_BUCKETS 1024
+#define MAILBOX_MAX_MESSAGES 50          // per recipient
+#define MAILBOX_MAX_BYTES (16 * 1024)    // per recipient
+#define MAILBOX_TOTAL_BYTES (8 * 1024 * 1024)
+#define MAILBOX_TTL_S (24 * 60 * 60)
+#define SEARCH_QUEUE_SIZE 4096          // power of two
+#define SEARCH_TOP_K 10
+#define SEARCH_IDLE_MS 5
+#define SEARCH_BACKFILL_CHUNK 256
+#define SEARCH_PRUNE_STEP 1024          // ids indexed between prune checks
+#define HISTORY_SYNC_MAX 1000
+#define DEFAULT_SYNC_MS 100
+#define DEFAULT_SNAPSHOT_S 5
+#define HANDOVER_POLL_MS 50
+#define SERVER_RCVBUF (8 * 1024 * 1024)
+#define DUP_WINDOW_BITS 256
+#define DUP_CACHE_ENTRIES 8
+#define DUP_CACHE_BYTES 2048
+#define METRICS_POLL_MS 100
+
+// sliding window over request ids: bit (id % DUP_WINDOW_BITS) is set once
+// that id has been handled; ids more than a window behind count as seen
+typedef struct {
+    uint64_t highest;   // 0 = nothing seen yet
+    uint64_t bits[DUP_WINDOW_BITS / 64];
+} dup_window_t;
+
+// responses sent while handling one request, kept to answer a repeat of it
+typedef struct {
+    uint64_t id;
+    int len;
+    char data[DUP_CACHE_BYTES];   // NUL-terminated lines back to back
+} dup_response_t;
 
 struct Node {
     char client_name[MAX_NAME_LEN];
@@ -23,8 +86,348 @@ struct Node {
     int heap_index;
     int awaiting_ping_reply;
     time_t ping_sent_time;
+    uint64_t token;   // lets the session follow the client to a new address
+
+    // duplicate suppression for id$-tagged requests, all under dup_lock
+    pthread_mutex_t dup_lock;
+    uint64_t request_run;        // sender run the window belongs to (id$<n>:<run>$)
+    dup_window_t seen_ids;
+    dup_response_t *responses;   // DUP_CACHE_ENTRIES, allocated on first use
+
+    // rooms joined; each entry holds a reference on the room
+    struct Room *rooms[MAX_ROOMS_PER_CLIENT];
+    int room_count;
+
+    // pub/sub topics subscribed to; prefix[i] marks a "<topic>/*" subscription
+    struct Topic *subs[MAX_SUBS_PER_CLIENT];
+    char sub_prefix[MAX_SUBS_PER_CLIENT];
+    int sub_count;
+    uint64_t pub_generation;     // last pub$ this node was matched by
+
+    // pending coalesced datagram for this client (see queue_to_client)
+    pthread_mutex_t out_lock;
+    char out_buf[UDP_PAYLOAD_MAX];
+    int out_len;
+    long long out_flush_at;
+
+    // set once the client sends us a rel$ datagram; from then on
+    // everything we send it goes through rel
+    int reliable;
+    rel_session_t rel;
+
+    // receives presence deltas (presence$on)
+    int presence_sub;
+};
+
+// A room has its own member set and history, guarded by its own lock, so
+// room traffic never touches clients_lock. Rooms live in a hash table of
+// ROOM_BUCKETS chains with one mutex per chain; a room is freed when the
+// last reference (membership or in-flight lookup) goes away.
+struct Room {
+    char name[MAX_NAME_LEN];
+    struct Room *next;      // bucket chain
+    int refs;               // protected by the bucket lock
+
+    pthread_rwlock_t lock;
+    struct Node **members;
+    int member_count;
+    int member_cap;
+
+    char *history[ROOM_HISTORY_SIZE];
+    int history_count;
+    int history_start;
+};
+
+struct RoomBucket {
+    pthread_mutex_t lock;
+    struct Room *head;
+};
+
+// Federation: several chat_server processes peer over UDP (-f host:port).
+// Each serves its own clients and relays say$, room posts and presence to
+// the others as "fed$<kind>$..." over rel$, so relays survive loss. sayto$
+// for a user on another node is forwarded to that node. Relayed traffic is
+// never relayed again (full mesh), and fed$ is only accepted from peers.
+#define FED_TAG "fed$"
+#define FED_TAG_LEN 4
+
+struct Peer {
+    char name[32];              // "ip:port" as given on the command line
+    struct sockaddr_in addr;
+    rel_session_t rel;
+    long long last_heard_us;    // stored by the listener, read by fed_thread
+    int alive;                  // flipped by fed_thread only; others __atomic_load
+};
+
+// a user connected to another node
+struct RemoteUser {
+    char name[MAX_NAME_LEN];
+    int peer;
+    struct RemoteUser *next;
+};
+
+// Consistent-hash ring over this node and its live peers. Every node puts
+// RING_VNODES points on the ring; a name belongs to the node owning the
+// first point at or after its hash, so a node joining or leaving only moves
+// the names that fall on its own arcs (about 1/N of them).
+struct RingPoint {
+    uint32_t hash;
+    int node;                   // peer index, or -1 for this node
+};
+
+struct Federation {
+    char self[32];
+    int peer_count;
+    struct Peer peers[MAX_PEERS];
+
+    pthread_rwlock_t ring_lock;
+    int ring_size;
+    struct RingPoint ring[(MAX_PEERS + 1) * RING_VNODES];
+
+    pthread_mutex_t remote_lock;
+    struct RemoteUser *remote[REMOTE_BUCKETS];
+};
+
+void fed_presence(server_context_t *ctx, char change, const char *name);
+void fed_relay(server_context_t *ctx, const char *kind, const char *a, const char *b, const char *msg);
+int fed_forward_sayto(server_context_t *ctx, const char *sender_name, const char *recipient_name, const char *msg);
+int fed_redirect(server_context_t *ctx, const char *name, struct sockaddr_in *client_addr);
+
+// Pub/sub topics are '/'-separated paths kept in a trie, one trie node per
+// level. Each trie node lists the clients subscribed to exactly that topic
+// and those subscribed to everything below it ("news/*"; "*" alone matches
+// every topic). Matching a pub$ walks one path from the root, so its cost
+// depends on the topic depth and the number of matches, not on how many
+// clients are connected.
+struct NodeSet {
+    struct Node **nodes;
+    int count, cap;
+};
+
+struct Topic {
+    char *segment;
+    struct Topic *parent;
+    struct Topic **children;    // sorted by segment
+    int child_count, child_cap;
+    struct NodeSet exact;
+    struct NodeSet prefix;
+};
+
+struct TopicTree {
+    pthread_rwlock_t lock;
+    struct Topic root;
+    uint64_t generation;        // bumped per pub$, to match each client once
+    struct NodeSet matched;     // scratch list for the listener thread
+};
+
+// Offline mailboxes: one per recipient name, in a hash table under a single
+// mutex. Each holds at most MAILBOX_MAX_MESSAGES / MAILBOX_MAX_BYTES, all
+// of them together at most MAILBOX_TOTAL_BYTES, and messages older than
+// MAILBOX_TTL_S are dropped by the ping monitor's sweep.
+struct MailItem {
+    struct MailItem *next;
+    time_t queued_at;
+    char line[];
+};
+
+struct Mailbox {
+    char name[MAX_NAME_LEN];
+    struct Mailbox *next;
+    struct MailItem *head, *tail;
+    int count;
+    size_t bytes;
+};
+
+struct Mailboxes {
+    pthread_mutex_t lock;
+    struct Mailbox *buckets[MAILBOX_BUCKETS];
+    size_t bytes;
+    unsigned long queued, delivered, expired, refused;
+};
+
+// Presence keeps its own roster of online names, separate from the client
+// list, so who$ never takes clients_lock. The text who$ returns is cached
+// as a snapshot tagged with the roster version and rebuilt only after a
+// change. The roster also maps each client's address to its node, which
+// is how who$ finds the requester. Joins, leaves and renames are coalesced
+// for PRESENCE_INTERVAL_MS and pushed as one "Presence v<n>: +a -b ~c>d"
+// line to clients that sent presence$on. Evictions and kicks are announced
+// to everyone in a single digest line per interval instead of one broadcast
+// per departure.
+struct PresenceName {
+    char name[MAX_NAME_LEN];
+    int count;                  // several clients may share a name
+    struct PresenceName *next;
+};
+
+// address -> node, kept in step with the client list under the presence lock
+struct PresenceMember {
+    struct sockaddr_in addr;
+    struct Node *node;
+    struct PresenceMember *next;
+};
+
+struct PresenceSnapshot {
+    int refs;
+    uint64_t version;
+    char text[];
+};
+
+struct PresenceDelta {
+    char op;                    // '+', '-', or '~' (renamed from old)
+    char name[MAX_NAME_LEN];
+    char old[MAX_NAME_LEN];
+};
+
+struct NameList {
+    char *data;
+    size_t len, cap;
+    int count;
+};
+
+struct Presence {
+    pthread_mutex_t lock;
+    uint64_t version;
+    int online;
+    struct PresenceName *names[PRESENCE_BUCKETS];
+    struct PresenceMember *members[PRESENCE_BUCKETS];
+    struct PresenceSnapshot *snapshot;  // NULL when stale
+
+    struct PresenceDelta *deltas;
+    int delta_count, delta_cap;
+    struct NameList evicted, kicked;
+    long long next_flush_us;
+};
+
+void presence_join(server_context_t *ctx, struct Node *node);
+void presence_leave(server_context_t *ctx, struct Node *node);
+void presence_moved(server_context_t *ctx, struct Node *node, const struct sockaddr_in *old_addr);
+void presence_rename(server_context_t *ctx, const char *old_name, const char *new_name);
+void presence_departed(server_context_t *ctx, const char *name, int kicked);
+
+// search$ index (search_index.h). publish_global only copies the line into
+// a single-producer ring for the indexer thread, which owns all writes to
+// the index; search$ reads it under the rwlock. If the ring is ever full
+// the line is dropped there and the indexer fetches it back from the log
+// (without -l it stays unindexed, counted in missed). The indexer also
+// prunes ids that neither the log nor the history ring holds any more.
+struct SearchItem {
+    uint64_t id;
+    char *line;
+};
+
+struct Search {
+    pthread_rwlock_t lock;
+    search_index_t index;
+    uint64_t indexed_id;        // newest id in the index (indexer thread only)
+    uint64_t prune_checked;     // indexed_id at the last prune check
+
+    struct SearchItem queue[SEARCH_QUEUE_SIZE];
+    uint64_t head;              // written by the listener
+    uint64_t tail;              // written by the indexer
+    unsigned long queued, dropped, missed, queries;
+};
+
+void search_enqueue(server_context_t *ctx, uint64_t id, const char *line);
+
+// Request stats for stats$. Every thread that handles requests owns a
+// ThreadStats and is its only writer, so recording is a timestamp and a
+// histogram increment with no atomics; stats$ merges all of them, reading
+// while they are written (a count may be one sample behind). Times are kept
+// in raw stats_now() ticks and converted to microseconds when reported.
+//   receive  recvfrom returned -> handle_request (rel$/frag$/tok$ layers)
+//   parse    parse_request
+//   lock     waiting for clients_lock in handle_request
+//   handler  the command's handler
+//   fanout   recvfrom returned -> last send of a broadcast (with -c the
+//            lines are queued by then, not yet sent)
+//   total    recvfrom returned -> handler done
+enum { STAGE_RECEIVE, STAGE_PARSE, STAGE_LOCK, STAGE_HANDLER, STAGE_FANOUT, STAGE_TOTAL, STAGE_COUNT };
+static const char *stage_names[STAGE_COUNT] = { "receive", "parse", "lock", "handler", "fanout", "total" };
+
+static const char *stat_commands[] = {
+    "conn", "say", "join", "leave", "sayto", "disconn", "rename", "mute", "unmute", "kick",
+    "sub", "unsub", "pub", "who", "presence", "where", "search", "stats", "locks", "trace", "ret-ping",
+};
+#define STAT_COMMANDS (int)(sizeof(stat_commands) / sizeof(stat_commands[0]))
+
+struct ThreadStats {
+    struct ThreadStats *next;
+    char name[16];
+    hist_t stages[STAGE_COUNT];
+    unsigned long commands[STAT_COMMANDS + 1];  // last slot: anything else
+    uint64_t request_start;     // stats_now() when the current request arrived, 0 if none
+    unsigned long packets_in;
+    unsigned long long bytes_in;
+    udp_counters_t udp;         // what this thread sent, see udp_socket_write
 };
 
+static struct ThreadStats *all_stats;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct ThreadStats *thread_stats;
+static double stats_ns_per_tick = 1.0;
+
+// a cycle counter where there is one: a few ns, where clock_gettime is ~20
+static inline uint64_t stats_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// a TSC read on another core can be a little behind since; skip those
+static inline void stats_record(int stage, uint64_t since)
+{
+    uint64_t now = stats_now();
+    if (thread_stats && now >= since) hist_record(&thread_stats->stages[stage], now - since);
+}
+
+// Tracing (-T, see trace.h). Whether a say$ is traced is only known once
+// publish_global has given it an id, so handle_request notes where each
+// request has got to, in the stats_now() ticks it reads anyway, and the
+// spans before that point are written from these marks afterwards.
+static __thread struct {
+    struct timespec kernel;             // kernel arrival (CLOCK_REALTIME), 0 if not stamped
+    uint64_t parse, lock, handler;      // when each stage began, in ticks
+    uint64_t anchor_ticks, anchor_ns;   // one instant on both clocks
+    uint64_t id;                        // message traced by this request, 0 if none
+    uint64_t sending;                   // message broadcast_message is sending, 0 if none
+} trace_req;
+
+static uint64_t trace_ticks_ns(uint64_t t)
+{
+    double ns = (double)(int64_t)(t - trace_req.anchor_ticks) * stats_ns_per_tick;
+    return trace_req.anchor_ns + (uint64_t)(int64_t)ns;
+}
+
+static void trace_tick_span(uint64_t id, const char *name, uint64_t from, uint64_t to, const char *detail)
+{
+    trace_span(id, name, trace_ticks_ns(from), trace_ticks_ns(to), detail);
+}
+
+// message id is to be traced: write the spans of the request so far
+static void trace_begin(uint64_t id)
+{
+    trace_req.anchor_ticks = stats_now();
+    trace_req.anchor_ns = trace_now_ns();
+    trace_req.id = id;
+
+    uint64_t received = thread_stats ? thread_stats->request_start : 0;
+    if (received == 0 || trace_req.parse < received) {
+        return;     // not published by a request the listener is handling
+    }
+    if (trace_req.kernel.tv_sec != 0) {
+        trace_span(id, "kernel queue", trace_from_realtime(&trace_req.kernel), trace_ticks_ns(received), NULL);
+    }
+    trace_tick_span(id, "receive", received, trace_req.parse, NULL);
+    trace_tick_span(id, "parse", trace_req.parse, trace_req.lock, NULL);
+    trace_tick_span(id, "clients_lock", trace_req.lock, trace_req.handler, NULL);
+}
+
 struct Node* create_node(const char *client_name, struct sockaddr_in *addr)
 {
     struct Node* new_node = malloc(sizeof(struct Node));
@@ -41,6 +444,23 @@ struct Node* create_node(const char *client_name, struct sockaddr_in *addr)
     new_node->heap_index = -1;
     new_node->awaiting_ping_reply = 0;
     new_node->ping_sent_time = 0;
+    pthread_mutex_init(&new_node->dup_lock, NULL);
+    new_node->request_run = 0;
+    memset(&new_node->seen_ids, 0, sizeof(new_node->seen_ids));
+    new_node->responses = NULL;
+    new_node->room_count = 0;
+    new_node->sub_count = 0;
+    new_node->pub_generation = 0;
+    new_node->token = 0;
+    while (new_node->token == 0) {
+        new_node->token = udp_random64();
+    }
+    pthread_mutex_init(&new_node->out_lock, NULL);
+    new_node->out_len = 0;
+    new_node->out_flush_at = 0;
+    new_node->reliable = 0;
+    rel_init(&new_node->rel);
+    new_node->presence_sub = 0;
     return new_node;
 }
 
@@ -81,25 +501,36 @@ struct Node *find_client_by_addr_nolock(server_context_t *ctx, struct sockaddr_i
     return cur;
 }
 
+struct Node *find_client_by_token_nolock(server_context_t *ctx, uint64_t token)
+{
+    struct Node *cur;
+    for (cur = ctx->clients_head; cur != NULL; cur = cur->next) {
+        if (cur->token == token) {
+            break;
+        }
+    }
+    return cur;
+}
+
 struct Node *find_client_by_addr(server_context_t *ctx, struct sockaddr_in *addr)
 {
     struct Node *cur;
-    pthread_rwlock_rdlock(&ctx->clients_lock);
+    PROFILED_RDLOCK(&ctx->clients_lock);
     cur = find_client_by_addr_nolock(ctx, addr);
-    pthread_rwlock_unlock(&ctx->clients_lock);
+    PROFILED_UNLOCK(&ctx->clients_lock);
     return cur;
 }
 
 struct Node *find_client_by_name(server_context_t *ctx, const char *name)
 {
     struct Node *cur;
-    pthread_rwlock_rdlock(&ctx->clients_lock);
+    PROFILED_RDLOCK(&ctx->clients_lock);
     for (cur = ctx->clients_head; cur != NULL; cur = cur->next) {
         if (strcmp(cur->client_name, name) == 0) {
             break;
         }
     }
-    pthread_rwlock_unlock(&ctx->clients_lock);
+    PROFILED_UNLOCK(&ctx->clients_lock);
     return cur;
 }
 
@@ -141,532 +572,4492 @@ void remove_mute(struct Node *client, const char *name)
     }
 }
 
-void send_to_client(server_context_t *ctx, struct Node *client, const char *msg)
+// the outbound thread has something to do at due_us (udp_now_us time)
+static void outbound_kick(server_context_t *ctx, long long due_us)
 {
-    udp_socket_write(ctx->sd, &client->addr, (char *)msg, BUFFER_SIZE);
+    if (due_us >= __atomic_load_n(&ctx->outbound_due, __ATOMIC_RELAXED)) {
+        return;     // it is waking up by then anyway
+    }
+    pthread_mutex_lock(&ctx->outbound_lock);
+    if (due_us < ctx->outbound_due) {
+        ctx->outbound_due = due_us;
+        pthread_cond_signal(&ctx->outbound_cond);
+    }
+    pthread_mutex_unlock(&ctx->outbound_lock);
 }
 
-// broadcast a message
-void broadcast_message(server_context_t *ctx, struct Node *sender, const char *msg)
+// rel_send, and make sure the outbound thread is awake for its retransmit timer
+static int rel_send_timed(server_context_t *ctx, rel_session_t *rel, struct sockaddr_in *addr, const char *buffer, int n)
 {
-    pthread_rwlock_rdlock(&ctx->clients_lock);
-    struct Node *cur = ctx->clients_head;
-    while (cur != NULL) {
-        if (sender == NULL || !is_muted(cur, sender->client_name)) {
-            udp_socket_write(ctx->sd, &cur->addr, (char *)msg, BUFFER_SIZE);
-        }
-        cur = cur->next;
-    }
-    pthread_rwlock_unlock(&ctx->clients_lock);
+    int rc = rel_send(rel, ctx->sd, addr, buffer, n);
+    outbound_kick(ctx, udp_now_us() + rel->rto_us);
+    return rc;
 }
 
-void *listener_thread(void *arg)
+// put one datagram on the wire, reliably if the client asked for it
+static int write_to_client(server_context_t *ctx, struct Node *client, const char *buffer, int n)
 {
-    server_context_t *ctx = (server_context_t *)arg;
+    if (client->reliable) {
+        return rel_send_timed(ctx, &client->rel, &client->addr, buffer, n);
+    }
+    return udp_socket_write(ctx->sd, &client->addr, (char *)buffer, n);
+}
 
-    char client_request[BUFFER_SIZE];
-    struct sockaddr_in client_addr;
+struct client_write_arg {
+    server_context_t *ctx;
+    struct Node *client;
+};
 
-    while (ctx->running) {
-        int rc = udp_socket_read(ctx->sd, &client_addr, client_request, BUFFER_SIZE);
+static int client_write_cb(void *arg, const char *buffer, int n)
+{
+    struct client_write_arg *a = (struct client_write_arg *)arg;
+    return write_to_client(a->ctx, a->client, buffer, n);
+}
 
-        if (rc > 0) {
-            if (rc < BUFFER_SIZE) client_request[rc] = '\0';
+// send a message longer than one datagram as frag$ pieces
+static void fragment_to_client(server_context_t *ctx, struct Node *client, const char *msg, int n)
+{
+    struct client_write_arg a = { ctx, client };
+    uint32_t msg_id = __atomic_fetch_add(&ctx->next_frag_id, 1, __ATOMIC_RELAXED);
+    frag_send(msg_id, msg, n, client_write_cb, &a);
+}
 
-            else client_request[BUFFER_SIZE - 1] = '\0';
+// send whatever is pending for this client (assumes you hold client->out_lock)
+static void flush_client_locked(server_context_t *ctx, struct Node *client)
+{
+    if (client->out_len > BATCH_TAG_LEN) {
+        write_to_client(ctx, client, client->out_buf, client->out_len);
+    }
+    client->out_len = 0;
+}
 
-            printf("Received request: %s\n", client_request);
+// pack a line into the client's pending datagram, flushing first if it would overflow
+static void queue_to_client(server_context_t *ctx, struct Node *client, const char *msg)
+{
+    int n = (int)strlen(msg) + 1;
 
-            handle_request(ctx, &client_addr, client_request, rc);
-        } 
-        else if (rc < 0) {
-            perror("udp_socket_read");
-            break;
+    if (BATCH_TAG_LEN + n > UDP_PAYLOAD_MAX) {
+        // too big to share a datagram: keep ordering and send it on its own
+        pthread_mutex_lock(&client->out_lock);
+        flush_client_locked(ctx, client);
+        if (n > UDP_PAYLOAD_MAX) {
+            fragment_to_client(ctx, client, msg, n);
+        }
+        else {
+            write_to_client(ctx, client, msg, n);
         }
+        pthread_mutex_unlock(&client->out_lock);
+        return;
     }
 
-    printf("Listener thread exiting.\n");
-    return NULL;
+    pthread_mutex_lock(&client->out_lock);
+    if (client->out_len + n > UDP_PAYLOAD_MAX) {
+        flush_client_locked(ctx, client);
+    }
+    if (client->out_len == 0) {
+        memcpy(client->out_buf, BATCH_TAG, BATCH_TAG_LEN);
+        client->out_len = BATCH_TAG_LEN;
+        client->out_flush_at = udp_now_us() + (long long)ctx->coalesce_ms * 1000;
+        outbound_kick(ctx, client->out_flush_at);
+    }
+    memcpy(client->out_buf + client->out_len, msg, n);
+    client->out_len += n;
+    pthread_mutex_unlock(&client->out_lock);
 }
 
-// tokenise requests
-void parse_request(char *buffer, char **command, char **content) {
-    size_t len = strlen(buffer);
-    if (len > 0 && buffer[len - 1] == '\n') {
-        buffer[len - 1] = '\0';
+// while the listener runs a handler for an id$ request, responses to the
+// requesting client are also copied into this cache entry
+static __thread struct Node *capture_node;
+static __thread dup_response_t *capture_entry;
+// the id$ of a request from a sender that has no node yet (a first conn$)
+static __thread uint64_t pending_id, pending_run;
+
+static void capture_response(dup_response_t *entry, const char *msg)
+{
+    int n = (int)strlen(msg) + 1;
+    pthread_mutex_lock(&capture_node->dup_lock);
+    if (entry->len + n <= DUP_CACHE_BYTES) {   // else a repeat gets what fitted
+        memcpy(entry->data + entry->len, msg, n);
+        entry->len += n;
     }
+    pthread_mutex_unlock(&capture_node->dup_lock);
+}
 
-    *command = strtok(buffer, "$");
-    *content = strtok(NULL, "\0");
+void send_to_client(server_context_t *ctx, struct Node *client, const char *msg)
+{
+    if (client == capture_node) {
+        capture_response(capture_entry, msg);
+    }
 
-    if (*content == NULL) {
-        *content = "";
+    if (ctx->coalesce_ms > 0) {
+        queue_to_client(ctx, client, msg);
+        return;
     }
 
-    while (**content == ' ') (*content)++;
+    int n = (int)strlen(msg) + 1;
+    if (n > UDP_PAYLOAD_MAX) {
+        fragment_to_client(ctx, client, msg, n);
+        return;
+    }
+    write_to_client(ctx, client, msg, n);
 }
 
-// min heap functions (assumes you hold client_lock)
-static void heap_swap(server_context_t *ctx, int i, int j)
+static uint32_t hash_name(const char *name)
 {
-    struct Node *a = ctx->activity_heap[i];
-    struct Node *b = ctx->activity_heap[j];
-    ctx->activity_heap[i] = b;
-    ctx->activity_heap[j] = a;
-    if (a) a->heap_index = j;
-    if (b) b->heap_index = i;
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
 }
 
-static void heap_sift_up(server_context_t *ctx, int idx)
+// look a room up (creating it if asked) and take a reference on it
+struct Room *room_acquire(server_context_t *ctx, const char *name, int create)
 {
-    while (idx > 0) {
-        int parent = (idx - 1) / 2;
-        if (ctx->activity_heap[parent]->last_active <= ctx->activity_heap[idx]->last_active) break;
-        heap_swap(ctx, parent, idx);
-        idx = parent;
+    struct RoomBucket *bucket = &ctx->rooms[hash_name(name) % ROOM_BUCKETS];
+
+    pthread_mutex_lock(&bucket->lock);
+    struct Room *room;
+    for (room = bucket->head; room != NULL; room = room->next) {
+        if (strcmp(room->name, name) == 0) {
+            break;
+        }
+    }
+    if (room == NULL && create) {
+        room = calloc(1, sizeof(struct Room));
+        if (room) {
+            strncpy(room->name, name, MAX_NAME_LEN - 1);
+            pthread_rwlock_init(&room->lock, NULL);
+            room->next = bucket->head;
+            bucket->head = room;
+        }
+    }
+    if (room) {
+        room->refs++;
     }
+    pthread_mutex_unlock(&bucket->lock);
+    return room;
 }
 
-static void heap_sift_down(server_context_t *ctx, int idx)
+// drop a reference; the last one unlinks and frees the room
+void room_release(server_context_t *ctx, struct Room *room)
 {
-    int n = ctx->heap_size;
-    while (1) {
-        int left = 2 * idx + 1;
-        int right = 2 * idx + 2;
-        int smallest = idx;
+    struct RoomBucket *bucket = &ctx->rooms[hash_name(room->name) % ROOM_BUCKETS];
 
-        if (left < n && ctx->activity_heap[left]->last_active < ctx->activity_heap[smallest]->last_active) {
-            smallest = left;
+    pthread_mutex_lock(&bucket->lock);
+    int last = --room->refs == 0;
+    if (last) {
+        struct Room **link = &bucket->head;
+        while (*link != room) {
+            link = &(*link)->next;
         }
-        if (right < n && ctx->activity_heap[right]->last_active < ctx->activity_heap[smallest]->last_active) {
-            smallest = right;
+        *link = room->next;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+
+    if (last) {
+        for (int i = 0; i < room->history_count; i++) {
+            free(room->history[(room->history_start + i) % ROOM_HISTORY_SIZE]);
         }
-        if (smallest == idx) break;
-        heap_swap(ctx, idx, smallest);
-        idx = smallest;
+        free(room->members);
+        pthread_rwlock_destroy(&room->lock);
+        free(room);
     }
 }
 
-static void heap_insert(server_context_t *ctx, struct Node *node)
+static int room_add_member(struct Room *room, struct Node *node)
 {
-    if (ctx->heap_size >= MAX_CLIENTS) return;
-    int idx = ctx->heap_size++;
-    ctx->activity_heap[idx] = node;
-    node->heap_index = idx;
-    heap_sift_up(ctx, idx);
+    int ok = 1;
+    pthread_rwlock_wrlock(&room->lock);
+    if (room->member_count == room->member_cap) {
+        int cap = room->member_cap ? room->member_cap * 2 : 4;
+        struct Node **members = realloc(room->members, cap * sizeof(struct Node *));
+        if (members) {
+            room->members = members;
+            room->member_cap = cap;
+        }
+        else {
+            ok = 0;
+        }
+    }
+    if (ok) {
+        room->members[room->member_count++] = node;
+    }
+    pthread_rwlock_unlock(&room->lock);
+    return ok;
 }
 
-static void heap_remove(server_context_t *ctx, struct Node *node)
+static void room_remove_member(struct Room *room, struct Node *node)
 {
-    int idx = node->heap_index;
-    if (idx < 0 || idx >= ctx->heap_size) return;
-
-    int last = ctx->heap_size - 1;
-    if (idx != last) {
-        heap_swap(ctx, idx, last);
+    pthread_rwlock_wrlock(&room->lock);
+    for (int i = 0; i < room->member_count; i++) {
+        if (room->members[i] == node) {
+            room->members[i] = room->members[--room->member_count];
+            break;
+        }
     }
-    ctx->heap_size--;
-    ctx->activity_heap[ctx->heap_size] = NULL;
-    node->heap_index = -1;
-
-    if (idx < ctx->heap_size) {
-        heap_sift_down(ctx, idx);
-        heap_sift_up(ctx, idx);
+    if (room->member_count == 0 && room->member_cap > 4) {
+        // give the memory back once a busy room empties out
+        free(room->members);
+        room->members = NULL;
+        room->member_cap = 0;
     }
+    pthread_rwlock_unlock(&room->lock);
 }
 
-static void heap_update(server_context_t *ctx, struct Node *node)
+// index of room in node->rooms, or -1
+static int node_room_index(struct Node *node, const char *name)
 {
-    int idx = node->heap_index;
-    if (idx < 0 || idx >= ctx->heap_size) return;
-    heap_sift_down(ctx, idx);
-    heap_sift_up(ctx, idx);
+    for (int i = 0; i < node->room_count; i++) {
+        if (strcmp(node->rooms[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-void *ping_monitor_thread(void *arg)
+// take node out of room node->rooms[idx] and drop its reference
+static void node_leave_room(server_context_t *ctx, struct Node *node, int idx)
 {
-    server_context_t *ctx = (server_context_t *)arg;
-
-    while (ctx->running) {
-        pthread_rwlock_wrlock(&ctx->clients_lock);
+    struct Room *room = node->rooms[idx];
+    node->rooms[idx] = node->rooms[--node->room_count];
+    room_remove_member(room, node);
+    room_release(ctx, room);
+}
 
-        if (ctx->heap_size > 0) {
-            struct Node *least = ctx->activity_heap[0];
-            time_t now = time(NULL);
+// ---------------------------------------------------------------------------
+// pub/sub topics
+// ---------------------------------------------------------------------------
 
-            if (!least->awaiting_ping_reply) {
+static int node_set_add(struct NodeSet *set, struct Node *node)
+{
+    if (set->count == set->cap) {
+        int cap = set->cap ? set->cap * 2 : 4;
+        struct Node **nodes = realloc(set->nodes, cap * sizeof(struct Node *));
+        if (!nodes) return 0;
+        set->nodes = nodes;
+        set->cap = cap;
+    }
+    set->nodes[set->count++] = node;
+    return 1;
+}
 
-                if (now - least->last_active >= INACTIVE_THRESHOLD) {
-                    const char *ping_msg = "ping$";
-                    udp_socket_write(ctx->sd, &least->addr, (char *)ping_msg, strlen(ping_msg));
-                    least->awaiting_ping_reply = 1;
-                    least->ping_sent_time = now;
-                }
-            }
-            else {
-                if (now - least->ping_sent_time >= PING_TIMEOUT) {
+static void node_set_remove(struct NodeSet *set, struct Node *node)
+{
+    for (int i = 0; i < set->count; i++) {
+        if (set->nodes[i] == node) {
+            set->nodes[i] = set->nodes[--set->count];
+            break;
+        }
+    }
+    if (set->count == 0) {
+        free(set->nodes);
+        set->nodes = NULL;
+        set->cap = 0;
+    }
+}
 
-                    struct Node *prev = NULL;
-                    struct Node *cur = ctx->clients_head;
-                    char removed_name[MAX_NAME_LEN];
-                    int removed = 0;
+// position of segment among parent's children (or where it would go)
+static int topic_child_index(struct Topic *parent, const char *segment, size_t len, int *found)
+{
+    int lo = 0, hi = parent->child_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = strncmp(parent->children[mid]->segment, segment, len);
+        if (c == 0 && parent->children[mid]->segment[len] != '\0') c = 1;
+        if (c == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
 
-                    while (cur != NULL && cur != least) {
-                        prev = cur;
-                        cur = cur->next;
-                    }
+static struct Topic *topic_child(struct Topic *parent, const char *segment, size_t len, int create)
+{
+    int found;
+    int idx = topic_child_index(parent, segment, len, &found);
+    if (found) {
+        return parent->children[idx];
+    }
+    if (!create) {
+        return NULL;
+    }
 
-                    if (cur == least) {
-                        strncpy(removed_name, cur->client_name, MAX_NAME_LEN - 1);
-                        removed_name[MAX_NAME_LEN - 1] = '\0';
+    if (parent->child_count == parent->child_cap) {
+        int cap = parent->child_cap ? parent->child_cap * 2 : 4;
+        struct Topic **children = realloc(parent->children, cap * sizeof(struct Topic *));
+        if (!children) return NULL;
+        parent->children = children;
+        parent->child_cap = cap;
+    }
+    struct Topic *topic = calloc(1, sizeof(struct Topic));
+    if (!topic || !(topic->segment = strndup(segment, len))) {
+        free(topic);
+        return NULL;
+    }
+    topic->parent = parent;
+    memmove(&parent->children[idx + 1], &parent->children[idx], (parent->child_count - idx) * sizeof(struct Topic *));
+    parent->children[idx] = topic;
+    parent->child_count++;
+    return topic;
+}
 
-                        if (prev == NULL) ctx->clients_head = cur->next;
-                        else prev->next = cur->next;
+// free trie nodes that no longer lead to any subscription
+static void topic_prune(struct Topic *topic)
+{
+    while (topic->parent != NULL && topic->child_count == 0 &&
+           topic->exact.count == 0 && topic->prefix.count == 0) {
+        struct Topic *parent = topic->parent;
+        int found;
+        int idx = topic_child_index(parent, topic->segment, strlen(topic->segment), &found);
+        if (found) {
+            memmove(&parent->children[idx], &parent->children[idx + 1], (parent->child_count - idx - 1) * sizeof(struct Topic *));
+            parent->child_count--;
+        }
+        free(topic->children);
+        free(topic->segment);
+        free(topic);
+        topic = parent;
+    }
+}
 
-                        heap_remove(ctx, cur);
-                        free(cur);
+// check a topic or subscription pattern; sets *prefix for a trailing "*"
+static int topic_valid(const char *topic, int *prefix)
+{
+    size_t len = strlen(topic);
+    *prefix = 0;
+    if (len == 0 || len >= MAX_TOPIC_LEN || strpbrk(topic, " $")) {
+        return 0;
+    }
+    if (strcmp(topic, "*") == 0 || (len > 2 && strcmp(topic + len - 2, "/*") == 0)) {
+        *prefix = 1;
+        len -= len == 1 ? 1 : 2;
+    }
+    // no empty levels, no '*' anywhere else
+    if (topic[0] == '/' || (len > 0 && topic[len - 1] == '/')) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (topic[i] == '*' || (topic[i] == '/' && topic[i + 1] == '/')) return 0;
+    }
+    return 1;
+}
 
-                        removed = 1;
-                    }
+// walk (and with create, build) the trie path for the first len chars of topic
+static struct Topic *topic_lookup(struct TopicTree *tree, const char *topic, size_t len, int create)
+{
+    struct Topic *cur = &tree->root;
+    const char *p = topic, *end = topic + len;
+    while (cur != NULL && p < end) {
+        const char *slash = memchr(p, '/', end - p);
+        size_t seg_len = slash ? (size_t)(slash - p) : (size_t)(end - p);
+        cur = topic_child(cur, p, seg_len, create);
+        p += seg_len + (slash ? 1 : 0);
+    }
+    return cur;
+}
 
-                    pthread_rwlock_unlock(&ctx->clients_lock);
+// drop subscription i of node (caller holds the tree write lock)
+static void node_unsubscribe_locked(struct Node *node, int i)
+{
+    struct Topic *topic = node->subs[i];
+    node_set_remove(node->sub_prefix[i] ? &topic->prefix : &topic->exact, node);
+    node->subs[i] = node->subs[node->sub_count - 1];
+    node->sub_prefix[i] = node->sub_prefix[node->sub_count - 1];
+    node->sub_count--;
+    topic_prune(topic);
+}
 
-                    if (removed) {
-                        char msg_bcast[BUFFER_SIZE];
-                        snprintf(msg_bcast, sizeof(msg_bcast), "%s has been removed due to inactivity", removed_name); 
-                        broadcast_message(ctx, NULL, msg_bcast);
-                    }
+static void node_unsubscribe_all(server_context_t *ctx, struct Node *node)
+{
+    if (node->sub_count == 0) {
+        return;
+    }
+    pthread_rwlock_wrlock(&ctx->topics->lock);
+    while (node->sub_count > 0) {
+        node_unsubscribe_locked(node, node->sub_count - 1);
+    }
+    pthread_rwlock_unlock(&ctx->topics->lock);
+}
 
-                    continue; // (to avoid double unlocking)
+// collect the subscribers matching topic into tree->matched, each once
+static void topic_match_locked(struct TopicTree *tree, const char *topic)
+{
+    uint64_t gen = ++tree->generation;
+    tree->matched.count = 0;
+
+    struct Topic *cur = &tree->root;
+    const char *p = topic;
+    while (cur != NULL) {
+        // "<cur>/*" matches anything strictly below cur; at the end of the
+        // path the exact subscribers match
+        struct NodeSet *set = *p != '\0' ? &cur->prefix : &cur->exact;
+        for (int i = 0; i < set->count; i++) {
+            struct Node *node = set->nodes[i];
+            if (node->pub_generation != gen) {
+                node->pub_generation = gen;
+                node_set_add(&tree->matched, node);
+            }
+        }
+        if (*p == '\0') {
+            break;
+        }
+        const char *slash = strchr(p, '/');
+        size_t seg_len = slash ? (size_t)(slash - p) : strlen(p);
+        cur = topic_child(cur, p, seg_len, 0);
+        p += seg_len + (slash ? 1 : 0);
+    }
+}
+
+// one datagram per recipient, handed to the kernel FANOUT_BATCH at a time
+static void fanout_message(server_context_t *ctx, struct Node **nodes, int count, const char *msg)
+{
+    struct mmsghdr batch[FANOUT_BATCH];
+    struct iovec iov[FANOUT_BATCH];
+    int queued = 0;
+    int n = (int)strlen(msg) + 1;
+
+    for (int i = 0; i <= count; i++) {
+        if (i < count) {
+            struct Node *node = nodes[i];
+            // anything that needs per-client state takes the usual path
+            if (ctx->coalesce_ms > 0 || node->reliable || node == capture_node || n > UDP_PAYLOAD_MAX) {
+                send_to_client(ctx, node, msg);
+                continue;
+            }
+            if (udp_should_drop()) {
+                if (udp_counters) udp_counters->loss_dropped++;
+                continue;
+            }
+            iov[queued].iov_base = (void *)msg;
+            iov[queued].iov_len = n;
+            memset(&batch[queued].msg_hdr, 0, sizeof(batch[queued].msg_hdr));
+            batch[queued].msg_hdr.msg_name = &node->addr;
+            batch[queued].msg_hdr.msg_namelen = sizeof(node->addr);
+            batch[queued].msg_hdr.msg_iov = &iov[queued];
+            batch[queued].msg_hdr.msg_iovlen = 1;
+            queued++;
+        }
+
+        if (queued == FANOUT_BATCH || (i == count && queued > 0)) {
+            int sent = 0;
+            while (sent < queued) {
+                int rc = sendmmsg(ctx->sd, batch + sent, queued - sent, 0);
+                if (rc <= 0) {
+                    perror("sendmmsg");
+                    if (udp_counters) udp_counters->send_errors += queued - sent;
+                    break;
+                }
+                sent += rc;
+                if (udp_counters) {
+                    udp_counters->packets_out += rc;
+                    udp_counters->bytes_out += (unsigned long long)rc * n;
                 }
             }
+            queued = 0;
         }
+    }
+    if (thread_stats && thread_stats->request_start) {
+        stats_record(STAGE_FANOUT, thread_stats->request_start);
+    }
+}
 
-        pthread_rwlock_unlock(&ctx->clients_lock);
+// send "[topic] sender: msg" to every local subscriber of topic
+void publish_topic(server_context_t *ctx, const char *topic, const char *sender_name, const char *msg)
+{
+    size_t len = strlen(topic) + strlen(sender_name) + strlen(msg) + 6;
+    char *line = malloc(len);
+    if (!line) {
+        return;
+    }
+    snprintf(line, len, "[%s] %s: %s", topic, sender_name, msg);
 
-        sleep(1);
+    // subscribers stay valid while we hold clients_lock: free_node runs
+    // under the write lock
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct TopicTree *tree = ctx->topics;
+    pthread_rwlock_wrlock(&tree->lock);     // match marks nodes and fills tree->matched
+    topic_match_locked(tree, topic);
+    int kept = 0;
+    for (int i = 0; i < tree->matched.count; i++) {
+        if (!is_muted(tree->matched.nodes[i], sender_name)) {
+            tree->matched.nodes[kept++] = tree->matched.nodes[i];
+        }
     }
+    tree->matched.count = kept;
+    fanout_message(ctx, tree->matched.nodes, tree->matched.count, line);
+    pthread_rwlock_unlock(&tree->lock);
+    PROFILED_UNLOCK(&ctx->clients_lock);
 
-    return NULL;
+    free(line);
 }
 
-// connect client and also output last 15 global messages
-void handle_conn(server_context_t *ctx, struct sockaddr_in *client_addr, const char *name)
+// ---------------------------------------------------------------------------
+// request stats
+// ---------------------------------------------------------------------------
+
+// give the calling thread its own ThreadStats (once, at thread start)
+static void stats_register(const char *name)
 {
-    pthread_rwlock_wrlock(&ctx->clients_lock);
-    struct Node *existing = find_client_by_addr_nolock(ctx, client_addr);
-    if (existing == NULL) {
-        struct Node *new_node = create_node(name, client_addr);
-        new_node->next = ctx->clients_head;
-        ctx->clients_head = new_node;
-        existing = new_node;
-        existing->last_active = time(NULL);
-        heap_insert(ctx, existing);
-    } 
+    struct ThreadStats *ts = calloc(1, sizeof(*ts));
+    if (!ts) return;
+    snprintf(ts->name, sizeof(ts->name), "%s", name);
+    pthread_mutex_lock(&all_stats_lock);
+    ts->next = all_stats;
+    all_stats = ts;
+    pthread_mutex_unlock(&all_stats_lock);
+    thread_stats = ts;
+    udp_counters = &ts->udp;
+}
+
+// measure how long a stats_now() tick is
+void stats_calibrate(void)
+{
+    long long us0 = udp_now_us();
+    uint64_t t0 = stats_now();
+    usleep(20000);
+    long long us = udp_now_us() - us0;
+    uint64_t ticks = stats_now() - t0;
+    if (ticks > 0 && us > 0) {
+        stats_ns_per_tick = (double)us * 1000.0 / (double)ticks;
+    }
+}
+
+static void stats_count_command(const char *command)
+{
+    if (!thread_stats) return;
+    int i = 0;
+    while (i < STAT_COMMANDS && strcmp(stat_commands[i], command) != 0) i++;
+    thread_stats->commands[i]++;
+}
+
+// stats$: merged stage percentiles, requests per command and the client
+// count; for the admin only, like kick$
+void handle_stats(server_context_t *ctx, struct sockaddr_in *client_addr)
+{
+    char line[BUFFER_SIZE];
+    if (client_addr->sin_port != htons(6666)) {
+        snprintf(line, sizeof(line), "You are not authorized to view server stats.");
+        udp_socket_write(ctx->sd, client_addr, line, BUFFER_SIZE);
+        return;
+    }
+
+    hist_t *merged = calloc(STAGE_COUNT, sizeof(hist_t));
+    unsigned long commands[STAT_COMMANDS + 1] = { 0 };
+    if (!merged) return;
+    pthread_mutex_lock(&all_stats_lock);
+    int threads = 0;
+    for (struct ThreadStats *ts = all_stats; ts != NULL; ts = ts->next) {
+        for (int s = 0; s < STAGE_COUNT; s++) hist_merge(&merged[s], &ts->stages[s]);
+        for (int c = 0; c <= STAT_COMMANDS; c++) commands[c] += ts->commands[c];
+        if (ts->stages[STAGE_TOTAL].count > 0) threads++;
+    }
+    pthread_mutex_unlock(&all_stats_lock);
+
+    int clients = 0;
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    for (struct Node *cur = ctx->clients_head; cur != NULL; cur = cur->next) clients++;
+    PROFILED_UNLOCK(&ctx->clients_lock);
+
+    snprintf(line, sizeof(line), "Stats: %d clients, %d thread%s recording, latencies in us",
+             clients, threads, threads == 1 ? "" : "s");
+    udp_socket_write(ctx->sd, client_addr, line, BUFFER_SIZE);
+
+    double us = stats_ns_per_tick / 1000.0;
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        hist_t *h = &merged[s];
+        snprintf(line, sizeof(line), "%s: n=%llu p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f",
+                 stage_names[s], (unsigned long long)h->count,
+                 hist_percentile(h, 50) * us, hist_percentile(h, 90) * us,
+                 hist_percentile(h, 99) * us, hist_percentile(h, 99.9) * us, h->max * us);
+        udp_socket_write(ctx->sd, client_addr, line, BUFFER_SIZE);
+    }
+
+    int len = snprintf(line, sizeof(line), "commands:");
+    for (int c = 0; c <= STAT_COMMANDS && len < (int)sizeof(line); c++) {
+        if (commands[c] == 0) continue;
+        len += snprintf(line + len, sizeof(line) - len, " %s=%lu",
+                        c < STAT_COMMANDS ? stat_commands[c] : "other", commands[c]);
+    }
+    udp_socket_write(ctx->sd, client_addr, line, BUFFER_SIZE);
+    free(merged);
+}
+
+#ifdef LOCK_PROFILE
+struct lock_dump_arg {
+    server_context_t *ctx;
+    struct sockaddr_in *to;
+    int lines;
+};
+
+static void send_lock_line(void *arg, const char *line)
+{
+    struct lock_dump_arg *a = (struct lock_dump_arg *)arg;
+    udp_socket_write(a->ctx->sd, a->to, (char *)line, strlen(line) + 1);
+    a->lines++;
+}
+#endif
+
+// locks$: per call site contention of clients_lock (built with
+// -DLOCK_PROFILE); locks$reset starts over. Admin only, like kick$.
+void handle_locks(server_context_t *ctx, struct sockaddr_in *client_addr, const char *content)
+{
+    char line[BUFFER_SIZE];
+    if (client_addr->sin_port != htons(6666)) {
+        snprintf(line, sizeof(line), "You are not authorized to view lock stats.");
+        udp_socket_write(ctx->sd, client_addr, line, BUFFER_SIZE);
+        return;
+    }
+#ifdef LOCK_PROFILE
+    if (strcmp(content, "reset") == 0) {
+        lockprof_reset();
+        snprintf(line, sizeof(line), "Lock stats reset");
+        udp_socket_write(ctx->sd, client_addr, line, BUFFER_SIZE);
+        return;
+    }
+    struct lock_dump_arg arg = { ctx, client_addr, 0 };
+    lockprof_dump(send_lock_line, &arg);
+    if (arg.lines == 0) {
+        snprintf(line, sizeof(line), "No locks taken yet");
+        udp_socket_write(ctx->sd, client_addr, line, BUFFER_SIZE);
+    }
+#else
+    (void)content;
+    snprintf(line, sizeof(line), "Lock profiling is not built in (compile with -DLOCK_PROFILE)");
+    udp_socket_write(ctx->sd, client_addr, line, BUFFER_SIZE);
+#endif
+}
+
+// trace$: append the spans traced since the last trace$ to the -T file.
+// Admin only, like kick$.
+void handle_trace(server_context_t *ctx, struct sockaddr_in *client_addr)
+{
+    char line[BUFFER_SIZE];
+    if (client_addr->sin_port != htons(6666)) {
+        snprintf(line, sizeof(line), "You are not authorized to export traces.");
+    }
+    else if (tracer.every == 0) {
+        snprintf(line, sizeof(line), "Tracing is off (start the server with -T every:file)");
+    }
     else {
-        strncpy(existing->client_name, name, MAX_NAME_LEN - 1);
-        existing->client_name[MAX_NAME_LEN - 1] = '\0';
-        existing->last_active = time(NULL);
-        if (existing->heap_index >= 0) {
-            heap_update(ctx, existing);
-        } 
-        else {
-            heap_insert(ctx, existing);
+        int n = trace_export();
+        if (n < 0) snprintf(line, sizeof(line), "Cannot write the trace to %s", tracer.path);
+        else snprintf(line, sizeof(line), "Trace: %d spans appended to %s", n, tracer.path);
+    }
+    udp_socket_write(ctx->sd, client_addr, line, BUFFER_SIZE);
+}
+
+// ---------------------------------------------------------------------------
+// offline mailboxes
+// ---------------------------------------------------------------------------
+
+static struct Mailbox **mailbox_link(struct Mailboxes *m, const char *name)
+{
+    struct Mailbox **link = &m->buckets[hash_name(name) % MAILBOX_BUCKETS];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void mail_item_free(struct Mailboxes *m, struct Mailbox *box, struct MailItem *item)
+{
+    size_t n = strlen(item->line) + 1;
+    box->bytes -= n;
+    m->bytes -= n;
+    box->count--;
+    free(item);
+}
+
+// queue "sender: msg" (or msg as it is, with no sender) for recipient;
+// returns 0, or -1 if over quota
+static int mailbox_store(server_context_t *ctx, const char *recipient, const char *sender_name,
+                         const char *msg, time_t queued_at)
+{
+    struct Mailboxes *m = ctx->mailboxes;
+    size_t n = sender_name ? strlen(sender_name) + strlen(msg) + 3 : strlen(msg) + 1;
+    if (strlen(recipient) >= MAX_NAME_LEN) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    struct Mailbox **link = mailbox_link(m, recipient);
+    struct Mailbox *box = *link;
+    if ((box && (box->count >= MAILBOX_MAX_MESSAGES || box->bytes + n > MAILBOX_MAX_BYTES)) ||
+        n > MAILBOX_MAX_BYTES || m->bytes + n > MAILBOX_TOTAL_BYTES) {
+        m->refused++;
+        pthread_mutex_unlock(&m->lock);
+        return -1;
+    }
+
+    struct MailItem *item = malloc(sizeof(*item) + n);
+    if (!item) {
+        pthread_mutex_unlock(&m->lock);
+        return -1;
+    }
+    if (box == NULL) {
+        box = calloc(1, sizeof(*box));
+        if (!box) {
+            free(item);
+            pthread_mutex_unlock(&m->lock);
+            return -1;
         }
+        strcpy(box->name, recipient);
+        *link = box;
     }
-    pthread_rwlock_unlock(&ctx->clients_lock);
+    item->next = NULL;
+    item->queued_at = queued_at;
+    if (sender_name) snprintf(item->line, n, "%s: %s", sender_name, msg);
+    else memcpy(item->line, msg, n);
+    if (box->tail) box->tail->next = item;
+    else box->head = item;
+    box->tail = item;
+    box->count++;
+    box->bytes += n;
+    m->bytes += n;
+    m->queued++;
+    pthread_mutex_unlock(&m->lock);
+    return 0;
+}
 
-    char response[BUFFER_SIZE];
-    snprintf(response, sizeof(response), "Hi %s, you have successfully connected to the chat", existing->client_name);
-    send_to_client(ctx, existing, response);
+static int mailbox_put(server_context_t *ctx, const char *recipient, const char *sender_name, const char *msg)
+{
+    return mailbox_store(ctx, recipient, sender_name, msg, time(NULL));
+}
+
+// hand everything waiting for client->client_name over in one burst of
+// batch$ datagrams
+static void mailbox_deliver(server_context_t *ctx, struct Node *client)
+{
+    struct Mailboxes *m = ctx->mailboxes;
+
+    pthread_mutex_lock(&m->lock);
+    struct Mailbox **link = mailbox_link(m, client->client_name);
+    struct Mailbox *box = *link;
+    if (box) {
+        *link = box->next;
+        m->bytes -= box->bytes;
+        m->delivered += box->count;
+    }
+    pthread_mutex_unlock(&m->lock);
+    if (box == NULL) {
+        return;
+    }
+
+    char header[64];
+    snprintf(header, sizeof(header), "%d message%s arrived while you were away:", box->count, box->count == 1 ? "" : "s");
+    if (client == capture_node) capture_response(capture_entry, header);
+    queue_to_client(ctx, client, header);
+
+    struct MailItem *item = box->head;
+    while (item) {
+        struct MailItem *next = item->next;
+        if (client == capture_node) capture_response(capture_entry, item->line);
+        queue_to_client(ctx, client, item->line);
+        free(item);
+        item = next;
+    }
+    free(box);
+
+    pthread_mutex_lock(&client->out_lock);
+    flush_client_locked(ctx, client);
+    pthread_mutex_unlock(&client->out_lock);
+}
+
+// drop messages older than MAILBOX_TTL_S (called from the ping monitor)
+static void mailbox_expire(server_context_t *ctx)
+{
+    struct Mailboxes *m = ctx->mailboxes;
+    time_t cutoff = time(NULL) - MAILBOX_TTL_S;
+
+    pthread_mutex_lock(&m->lock);
+    if (m->bytes == 0) {
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+    for (int b = 0; b < MAILBOX_BUCKETS; b++) {
+        struct Mailbox **link = &m->buckets[b];
+        while (*link != NULL) {
+            struct Mailbox *box = *link;
+            // items are in arrival order, so expired ones are at the front
+            while (box->head && box->head->queued_at < cutoff) {
+                struct MailItem *item = box->head;
+                box->head = item->next;
+                mail_item_free(m, box, item);
+                m->expired++;
+            }
+            if (box->head == NULL) {
+                *link = box->next;
+                free(box);
+            }
+            else {
+                link = &box->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+// ---------------------------------------------------------------------------
+// search$
+// ---------------------------------------------------------------------------
+
+// called by publish_global on the listener: a copy and two atomics, no lock
+void search_enqueue(server_context_t *ctx, uint64_t id, const char *line)
+{
+    struct Search *s = ctx->search;
+    if (s == NULL) {
+        return;
+    }
+    uint64_t head = s->head;
+    if (head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) >= SEARCH_QUEUE_SIZE) {
+        s->dropped++;  // the indexer refills the gap from the log
+        return;
+    }
+    char *copy = strdup(line);
+    if (!copy) {
+        s->dropped++;
+        return;
+    }
+    s->queue[head & (SEARCH_QUEUE_SIZE - 1)].id = id;
+    s->queue[head & (SEARCH_QUEUE_SIZE - 1)].line = copy;
+    __atomic_store_n(&s->head, head + 1, __ATOMIC_RELEASE);
+    s->queued++;
+}
+
+struct search_chunk {
+    struct SearchItem items[SEARCH_BACKFILL_CHUNK];
+    int count;
+};
+
+static void search_copy_logged(void *arg, uint64_t id, const char *line)
+{
+    struct search_chunk *chunk = (struct search_chunk *)arg;
+    char *copy = strdup(line);
+    if (copy) {
+        chunk->items[chunk->count].id = id;
+        chunk->items[chunk->count].line = copy;
+        chunk->count++;
+    }
+}
+
+// index messages indexed_id+1..upto from the log, a chunk at a time so the
+// log lock (and with it msglog_append) is only held while lines are copied
+static void search_backfill(server_context_t *ctx, uint64_t upto)
+{
+    struct Search *s = ctx->search;
+    static struct search_chunk chunk;   // indexer thread only
+
+    while (ctx->log && s->indexed_id < upto) {
+        uint64_t want = upto - s->indexed_id;
+        chunk.count = 0;
+        msglog_read_from(ctx->log, s->indexed_id + 1,
+                         want < SEARCH_BACKFILL_CHUNK ? (int)want : SEARCH_BACKFILL_CHUNK,
+                         search_copy_logged, &chunk);
+        if (chunk.count == 0) {
+            break;
+        }
+        pthread_rwlock_wrlock(&s->lock);
+        for (int i = 0; i < chunk.count; i++) {
+            if (chunk.items[i].id <= upto) {
+                search_index_add(&s->index, chunk.items[i].id, chunk.items[i].line);
+                s->indexed_id = chunk.items[i].id;
+            }
+            free(chunk.items[i].line);
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+    if (s->indexed_id < upto) {
+        s->missed += upto - s->indexed_id;  // not in the log (or no log at all)
+        s->indexed_id = upto;
+    }
+}
+
+// index whatever history survived the restart: the whole log, or without
+// one the lines a snapshot put back in the ring
+static void search_index_existing(server_context_t *ctx)
+{
+    struct Search *s = ctx->search;
+    if (ctx->log) {
+        uint64_t oldest, newest;
+        msglog_bounds(ctx->log, &oldest, &newest);
+        if (oldest > 1) {
+            s->indexed_id = oldest - 1;
+        }
+        search_backfill(ctx, newest);
+        return;
+    }
 
+    pthread_mutex_lock(&ctx->history_lock);
+    pthread_rwlock_wrlock(&s->lock);
     for (int i = 0; i < ctx->global_count; i++) {
         int idx = (ctx->global_start + i) % GLOBAL_BUFFER_SIZE;
-        send_to_client(ctx, existing, ctx->global_buffer[idx]);
+        const char *line = strchr(ctx->global_buffer[idx] + MSG_TAG_LEN, '$');
+        if (line) {
+            search_index_add(&s->index, ctx->global_ids[idx], line + 1);
+            s->indexed_id = ctx->global_ids[idx];
+        }
     }
+    pthread_rwlock_unlock(&s->lock);
+    pthread_mutex_unlock(&ctx->history_lock);
 }
 
-// send a message to all clients and store message in global buffer
-void handle_say(server_context_t *ctx, struct sockaddr_in *client_addr, const char *msg)
+// oldest message search$ can still fetch: the log's oldest, or without a
+// log the oldest line in the history ring (0 if there is none)
+static uint64_t search_oldest_kept(server_context_t *ctx)
 {
-    struct Node *sender = find_client_by_addr(ctx, client_addr);
-    const char *name = sender ? sender->client_name : "Unknown";
+    uint64_t oldest = 0, newest;
+    if (ctx->log) {
+        msglog_bounds(ctx->log, &oldest, &newest);
+        return oldest;
+    }
+    pthread_mutex_lock(&ctx->history_lock);
+    if (ctx->global_count > 0) {
+        oldest = ctx->global_ids[ctx->global_start];
+    }
+    pthread_mutex_unlock(&ctx->history_lock);
+    return oldest;
+}
 
-    char buffer[BUFFER_SIZE];
-    snprintf(buffer, sizeof(buffer), "%s: %s", name, msg);
+// every SEARCH_PRUNE_STEP ids, drop what can no longer be fetched
+static void search_prune(server_context_t *ctx)
+{
+    struct Search *s = ctx->search;
+    if (s->indexed_id - s->prune_checked < SEARCH_PRUNE_STEP) {
+        return;
+    }
+    s->prune_checked = s->indexed_id;
 
-    if (ctx->global_count < GLOBAL_BUFFER_SIZE) {
-        int idx = (ctx->global_start + ctx->global_count) % GLOBAL_BUFFER_SIZE;
-        strncpy(ctx->global_buffer[idx], buffer, BUFFER_SIZE - 1);
-        ctx->global_buffer[idx][BUFFER_SIZE - 1] = '\0';
-        ctx->global_count++;
-    } 
-    else {
-        int idx = ctx->global_start;
-        strncpy(ctx->global_buffer[idx], buffer, BUFFER_SIZE - 1);
-        ctx->global_buffer[idx][BUFFER_SIZE - 1] = '\0';
-        ctx->global_start = (ctx->global_start + 1) % GLOBAL_BUFFER_SIZE;
+    uint64_t oldest = search_oldest_kept(ctx);
+    if (oldest > s->index.min_id) {
+        pthread_rwlock_wrlock(&s->lock);
+        search_index_prune(&s->index, oldest);
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+void *search_thread(void *arg)
+{
+    server_context_t *ctx = (server_context_t *)arg;
+    struct Search *s = ctx->search;
+
+    search_index_existing(ctx);
+
+    while (ctx->running) {
+        uint64_t tail = s->tail;
+        uint64_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+        if (tail == head) {
+            usleep(SEARCH_IDLE_MS * 1000);
+            continue;
+        }
+
+        // a jump in ids means the queue overflowed: take those from the log
+        uint64_t first = s->queue[tail & (SEARCH_QUEUE_SIZE - 1)].id;
+        if (first > s->indexed_id + 1) {
+            search_backfill(ctx, first - 1);
+        }
+
+        pthread_rwlock_wrlock(&s->lock);
+        for (; tail != head; tail++) {
+            struct SearchItem *item = &s->queue[tail & (SEARCH_QUEUE_SIZE - 1)];
+            if (item->id > s->indexed_id + 1) {
+                break;  // another gap, handled on the next pass
+            }
+            if (item->id > s->indexed_id) {
+                search_index_add(&s->index, item->id, item->line);
+                s->indexed_id = item->id;
+            }
+            free(item->line);
+        }
+        pthread_rwlock_unlock(&s->lock);
+        __atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+
+        search_prune(ctx);
+    }
+
+    return NULL;
+}
+
+struct search_text_arg {
+    uint64_t id;
+    char *line;
+};
+
+static void search_copy_text(void *arg, uint64_t id, const char *line)
+{
+    struct search_text_arg *a = (struct search_text_arg *)arg;
+    if (id == a->id) {
+        a->line = strdup(line);
+    }
+}
+
+// "<name>: <msg>" for message id from the history ring or the log; caller frees
+static char *search_fetch(server_context_t *ctx, uint64_t id)
+{
+    char *line = NULL;
+    pthread_mutex_lock(&ctx->history_lock);
+    for (int i = 0; i < ctx->global_count; i++) {
+        int idx = (ctx->global_start + i) % GLOBAL_BUFFER_SIZE;
+        if (ctx->global_ids[idx] == id) {
+            const char *sep = strchr(ctx->global_buffer[idx] + MSG_TAG_LEN, '$');
+            if (sep) line = strdup(sep + 1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctx->history_lock);
+
+    if (line == NULL && ctx->log) {
+        struct search_text_arg arg = { id, NULL };
+        msglog_read_from(ctx->log, id, 1, search_copy_text, &arg);
+        line = arg.line;
+    }
+    return line;
+}
+
+// search$<words>: the SEARCH_TOP_K newest global messages containing all of
+// the words, newest first, as "#<id> <name>: <msg>"
+void handle_search(server_context_t *ctx, struct sockaddr_in *client_addr, const char *query)
+{
+    struct Node *client = find_client_by_addr(ctx, client_addr);
+    if (client == NULL) {
+        return;
+    }
+    struct Search *s = ctx->search;
+
+    uint64_t ids[SEARCH_TOP_K];
+    pthread_rwlock_rdlock(&s->lock);
+    int found = search_index_query(&s->index, query, ids, SEARCH_TOP_K);
+    s->queries++;
+    pthread_rwlock_unlock(&s->lock);
+
+    if (found < 0) {
+        send_to_client(ctx, client, "Search for at least one word");
+        return;
     }
 
-    broadcast_message(ctx, sender, buffer);
+    char header[BUFFER_SIZE];
+    snprintf(header, sizeof(header), "Search \"%s\": %s%d result%s", query,
+             found == SEARCH_TOP_K ? "newest " : "", found, found == 1 ? "" : "s");
+    if (client == capture_node) capture_response(capture_entry, header);
+    queue_to_client(ctx, client, header);
+
+    int gone = 0;
+    for (int i = 0; i < found; i++) {
+        char *line = search_fetch(ctx, ids[i]);
+        if (line == NULL) {
+            gone++;
+            continue;
+        }
+        size_t len = strlen(line) + 24;
+        char *result = malloc(len);
+        if (result) {
+            snprintf(result, len, "#%llu %s", (unsigned long long)ids[i], line);
+            if (client == capture_node) capture_response(capture_entry, result);
+            queue_to_client(ctx, client, result);
+            free(result);
+        }
+        free(line);
+    }
+    if (gone > 0) {
+        snprintf(header, sizeof(header), "%d older match%s no longer kept", gone, gone == 1 ? " is" : "es are");
+        if (client == capture_node) capture_response(capture_entry, header);
+        queue_to_client(ctx, client, header);
+    }
+
+    pthread_mutex_lock(&client->out_lock);
+    flush_client_locked(ctx, client);
+    pthread_mutex_unlock(&client->out_lock);
+}
+
+// release a node that has already been unlinked (assumes you hold client_lock)
+void free_node(server_context_t *ctx, struct Node *node)
+{
+    ctx->client_count--;
+    presence_leave(ctx, node);
+
+    while (node->room_count > 0) {
+        node_leave_room(ctx, node, node->room_count - 1);
+    }
+    node_unsubscribe_all(ctx, node);
+
+    pthread_mutex_lock(&node->out_lock);
+    flush_client_locked(ctx, node);
+    pthread_mutex_unlock(&node->out_lock);
+    pthread_mutex_destroy(&node->out_lock);
+    rel_destroy(&node->rel);
+    pthread_mutex_destroy(&node->dup_lock);
+    free(node->responses);
+    free(node);
+}
+
+// broadcast a message (sender_name == NULL for server notices)
+void broadcast_message(server_context_t *ctx, const char *sender_name, const char *msg)
+{
+    uint64_t traced = trace_req.sending;
+    uint64_t t = traced ? stats_now() : 0;
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct Node *cur = ctx->clients_head;
+    while (cur != NULL) {
+        if (sender_name == NULL || !is_muted(cur, sender_name)) {
+            if (traced) {
+                uint64_t sent = stats_now();
+                send_to_client(ctx, cur, msg);
+                trace_tick_span(traced, "send", sent, stats_now(), cur->client_name);
+            }
+            else {
+                send_to_client(ctx, cur, msg);
+            }
+        }
+        cur = cur->next;
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+    if (traced) {
+        trace_tick_span(traced, "broadcast", t, stats_now(), NULL);
+    }
+    if (thread_stats && thread_stats->request_start) {
+        stats_record(STAGE_FANOUT, thread_stats->request_start);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// presence
+// ---------------------------------------------------------------------------
+
+static void name_list_add(struct NameList *list, const char *name)
+{
+    size_t need = list->len + strlen(name) + 3;
+    if (need > list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        while (cap < need) cap *= 2;
+        char *data = realloc(list->data, cap);
+        if (!data) return;
+        list->data = data;
+        list->cap = cap;
+    }
+    list->len += sprintf(list->data + list->len, "%s%s", list->count ? ", " : "", name);
+    list->count++;
+}
+
+static void presence_snapshot_release(struct PresenceSnapshot *snap)
+{
+    if (snap && __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(snap);
+    }
+}
+
+// roster changed: bump the version and drop the cached who$ text (hold lock)
+static void presence_changed_locked(struct Presence *p)
+{
+    p->version++;
+    presence_snapshot_release(p->snapshot);
+    p->snapshot = NULL;
+}
+
+static void presence_count_locked(struct Presence *p, const char *name, int delta)
+{
+    struct PresenceName **link = &p->names[hash_name(name) % PRESENCE_BUCKETS];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+
+    if (*link == NULL) {
+        if (delta < 0) return;
+        struct PresenceName *entry = calloc(1, sizeof(*entry));
+        if (!entry) return;
+        strncpy(entry->name, name, MAX_NAME_LEN - 1);
+        *link = entry;
+    }
+
+    (*link)->count += delta;
+    p->online += delta;
+    if ((*link)->count <= 0) {
+        struct PresenceName *entry = *link;
+        *link = entry->next;
+        free(entry);
+    }
+}
+
+// queue a delta, cancelling it against a pending opposite one for the same name
+static void presence_queue_locked(struct Presence *p, char op, const char *name, const char *old)
+{
+    for (int i = p->delta_count - 1; i >= 0; i--) {
+        struct PresenceDelta *d = &p->deltas[i];
+        if (op == '-' && d->op == '+' && strcmp(d->name, name) == 0) {
+            p->deltas[i] = p->deltas[--p->delta_count];   // came and went
+            return;
+        }
+        if (op == '+' && d->op == '-' && strcmp(d->name, name) == 0) {
+            p->deltas[i] = p->deltas[--p->delta_count];   // went and came back
+            return;
+        }
+        if (op == '~' && d->op == '+' && strcmp(d->name, old) == 0) {
+            strncpy(d->name, name, MAX_NAME_LEN - 1);     // joined, then renamed
+            return;
+        }
+    }
+
+    if (p->delta_count == p->delta_cap) {
+        int cap = p->delta_cap ? p->delta_cap * 2 : 32;
+        struct PresenceDelta *deltas = realloc(p->deltas, cap * sizeof(*deltas));
+        if (!deltas) return;
+        p->deltas = deltas;
+        p->delta_cap = cap;
+    }
+    struct PresenceDelta *d = &p->deltas[p->delta_count++];
+    d->op = op;
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    snprintf(d->old, sizeof(d->old), "%s", old ? old : "");
+}
+
+static struct PresenceMember **presence_member_link(struct Presence *p, const struct sockaddr_in *addr)
+{
+    uint32_t h = (uint32_t)addr->sin_addr.s_addr * 2654435761u ^ addr->sin_port;
+    struct PresenceMember **link = &p->members[h % PRESENCE_BUCKETS];
+    while (*link != NULL && ((*link)->addr.sin_addr.s_addr != addr->sin_addr.s_addr ||
+                             (*link)->addr.sin_port != addr->sin_port)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void presence_member_add_locked(struct Presence *p, struct Node *node)
+{
+    struct PresenceMember **link = presence_member_link(p, &node->addr);
+    if (*link == NULL) {
+        *link = calloc(1, sizeof(**link));
+        if (*link == NULL) return;
+        (*link)->addr = node->addr;
+    }
+    (*link)->node = node;
+}
+
+static void presence_member_remove_locked(struct Presence *p, struct Node *node, const struct sockaddr_in *addr)
+{
+    struct PresenceMember **link = presence_member_link(p, addr);
+    if (*link != NULL && (*link)->node == node) {
+        struct PresenceMember *member = *link;
+        *link = member->next;
+        free(member);
+    }
+}
+
+// the registered client at addr, or NULL
+static struct Node *presence_find(server_context_t *ctx, const struct sockaddr_in *addr)
+{
+    struct Presence *p = ctx->presence;
+    pthread_mutex_lock(&p->lock);
+    struct PresenceMember *member = *presence_member_link(p, addr);
+    struct Node *node = member ? member->node : NULL;
+    pthread_mutex_unlock(&p->lock);
+    return node;
+}
+
+void presence_join(server_context_t *ctx, struct Node *node)
+{
+    const char *name = node->client_name;
+    struct Presence *p = ctx->presence;
+    pthread_mutex_lock(&p->lock);
+    presence_member_add_locked(p, node);
+    presence_count_locked(p, name, 1);
+    presence_changed_locked(p);
+    presence_queue_locked(p, '+', name, NULL);
+    long long due = p->next_flush_us;
+    pthread_mutex_unlock(&p->lock);
+    outbound_kick(ctx, due);
+
+    fed_presence(ctx, '+', name);
+}
+
+void presence_leave(server_context_t *ctx, struct Node *node)
+{
+    const char *name = node->client_name;
+    struct Presence *p = ctx->presence;
+    pthread_mutex_lock(&p->lock);
+    presence_member_remove_locked(p, node, &node->addr);
+    presence_count_locked(p, name, -1);
+    presence_changed_locked(p);
+    presence_queue_locked(p, '-', name, NULL);
+    long long due = p->next_flush_us;
+    pthread_mutex_unlock(&p->lock);
+    outbound_kick(ctx, due);
+
+    fed_presence(ctx, '-', name);
+}
+
+// a resumed session now answers at a new address; the roster is unchanged
+void presence_moved(server_context_t *ctx, struct Node *node, const struct sockaddr_in *old_addr)
+{
+    struct Presence *p = ctx->presence;
+    pthread_mutex_lock(&p->lock);
+    presence_member_remove_locked(p, node, old_addr);
+    presence_member_add_locked(p, node);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void presence_rename(server_context_t *ctx, const char *old_name, const char *new_name)
+{
+    struct Presence *p = ctx->presence;
+    pthread_mutex_lock(&p->lock);
+    presence_count_locked(p, old_name, -1);
+    presence_count_locked(p, new_name, 1);
+    presence_changed_locked(p);
+    presence_queue_locked(p, '~', new_name, old_name);
+    long long due = p->next_flush_us;
+    pthread_mutex_unlock(&p->lock);
+    outbound_kick(ctx, due);
+
+    fed_presence(ctx, '-', old_name);
+    fed_presence(ctx, '+', new_name);
+}
+
+// an eviction (kicked == 0) or kick, for the next digest
+void presence_departed(server_context_t *ctx, const char *name, int kicked)
+{
+    struct Presence *p = ctx->presence;
+    pthread_mutex_lock(&p->lock);
+    name_list_add(kicked ? &p->kicked : &p->evicted, name);
+    long long due = p->next_flush_us;
+    pthread_mutex_unlock(&p->lock);
+    outbound_kick(ctx, due);
+}
+
+// current roster text, rebuilt only if it changed since the last call
+static struct PresenceSnapshot *presence_snapshot(struct Presence *p)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->snapshot == NULL) {
+        size_t len = 64;
+        for (int b = 0; b < PRESENCE_BUCKETS; b++) {
+            for (struct PresenceName *e = p->names[b]; e != NULL; e = e->next) {
+                len += strlen(e->name) + 2;
+            }
+        }
+
+        struct PresenceSnapshot *snap = malloc(sizeof(*snap) + len);
+        if (snap) {
+            snap->refs = 1;
+            snap->version = p->version;
+            size_t n = snprintf(snap->text, len, "Online v%llu (%d):", (unsigned long long)p->version, p->online);
+            const char *sep = " ";
+            for (int b = 0; b < PRESENCE_BUCKETS; b++) {
+                for (struct PresenceName *e = p->names[b]; e != NULL; e = e->next) {
+                    n += snprintf(snap->text + n, len - n, "%s%s", sep, e->name);
+                    sep = ", ";
+                }
+            }
+            p->snapshot = snap;
+        }
+    }
+
+    struct PresenceSnapshot *snap = p->snapshot;
+    if (snap) {
+        __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return snap;
+}
+
+// who$ or who$<version>: the roster, or a short note if it has not changed
+void handle_who(server_context_t *ctx, struct sockaddr_in *client_addr, const char *content)
+{
+    struct Node *client = presence_find(ctx, client_addr);
+    if (client == NULL) {
+        return;
+    }
+
+    struct PresenceSnapshot *snap = presence_snapshot(ctx->presence);
+    if (snap == NULL) {
+        return;
+    }
+    if (*content != '\0' && strtoull(content, NULL, 10) == snap->version) {
+        char response[64];
+        snprintf(response, sizeof(response), "Roster unchanged (v%llu)", (unsigned long long)snap->version);
+        send_to_client(ctx, client, response);
+    }
+    else {
+        send_to_client(ctx, client, snap->text);
+    }
+    presence_snapshot_release(snap);
+}
+
+// presence$on / presence$off: subscribe to join/leave/rename deltas
+void handle_presence(server_context_t *ctx, struct sockaddr_in *client_addr, const char *content)
+{
+    PROFILED_WRLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client) {
+        client->presence_sub = strcmp(content, "off") != 0;
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+// send the deltas and departure digest gathered over the last interval.
+// Returns when to call again: LLONG_MAX once nothing is left, as a change
+// queued later kicks the outbound thread itself.
+static long long presence_flush(server_context_t *ctx)
+{
+    struct Presence *p = ctx->presence;
+    long long now = udp_now_us();
+
+    pthread_mutex_lock(&p->lock);
+    int pending = p->delta_count > 0 || p->evicted.count > 0 || p->kicked.count > 0;
+    if (now < p->next_flush_us || !pending) {
+        long long next = pending ? p->next_flush_us : LLONG_MAX;
+        pthread_mutex_unlock(&p->lock);
+        return next;
+    }
+    p->next_flush_us = now + PRESENCE_INTERVAL_MS * 1000LL;
+
+    char *delta_line = NULL;
+    if (p->delta_count > 0) {
+        size_t len = 32 + (size_t)p->delta_count * (2 * MAX_NAME_LEN + 3);
+        delta_line = malloc(len);
+        if (delta_line) {
+            size_t n = snprintf(delta_line, len, "Presence v%llu:", (unsigned long long)p->version);
+            for (int i = 0; i < p->delta_count; i++) {
+                struct PresenceDelta *d = &p->deltas[i];
+                if (d->op == '~') n += snprintf(delta_line + n, len - n, " ~%s>%s", d->old, d->name);
+                else n += snprintf(delta_line + n, len - n, " %c%s", d->op, d->name);
+            }
+        }
+        p->delta_count = 0;
+    }
+
+    struct NameList evicted = p->evicted, kicked = p->kicked;
+    memset(&p->evicted, 0, sizeof(p->evicted));
+    memset(&p->kicked, 0, sizeof(p->kicked));
+    pthread_mutex_unlock(&p->lock);
+
+    if (delta_line) {
+        PROFILED_RDLOCK(&ctx->clients_lock);
+        for (struct Node *cur = ctx->clients_head; cur != NULL; cur = cur->next) {
+            if (cur->presence_sub) {
+                send_to_client(ctx, cur, delta_line);
+            }
+        }
+        PROFILED_UNLOCK(&ctx->clients_lock);
+        free(delta_line);
+    }
+
+    // one digest line however many clients left in this interval
+    struct { struct NameList *list; const char *what; } digests[] = {
+        { &evicted, "removed due to inactivity" },
+        { &kicked, "removed from the chat" },
+    };
+    for (size_t i = 0; i < sizeof(digests) / sizeof(digests[0]); i++) {
+        struct NameList *list = digests[i].list;
+        if (list->count == 0 || list->data == NULL) {
+            free(list->data);
+            continue;
+        }
+        size_t len = list->len + 64;
+        char *msg = malloc(len);
+        if (msg) {
+            snprintf(msg, len, "%s %s been %s", list->data, list->count == 1 ? "has" : "have", digests[i].what);
+            broadcast_message(ctx, NULL, msg);
+            free(msg);
+        }
+        free(list->data);
+    }
+    return LLONG_MAX;
+}
+
+// sleep until ctx->outbound_due, or OUTBOUND_IDLE_MS to notice shutdown
+static void outbound_wait(server_context_t *ctx)
+{
+    pthread_mutex_lock(&ctx->outbound_lock);
+    long long now = udp_now_us();
+    while (ctx->running && now < ctx->outbound_due) {
+        long long until = ctx->outbound_due;
+        if (until - now > OUTBOUND_IDLE_MS * 1000LL) until = now + OUTBOUND_IDLE_MS * 1000LL;
+        struct timespec ts = { until / 1000000, (until % 1000000) * 1000 };
+        pthread_cond_timedwait(&ctx->outbound_cond, &ctx->outbound_lock, &ts);
+        now = udp_now_us();
+    }
+    ctx->outbound_due = LLONG_MAX;   // the pass that follows works out the next one
+    pthread_mutex_unlock(&ctx->outbound_lock);
+}
+
+// flush coalesced datagrams whose deadline has passed, run rel retransmit
+// timers and push presence updates. Idle, it sleeps: queue_to_client,
+// rel_send_timed and the presence changes wake it when they give it work.
+void *outbound_thread(void *arg)
+{
+    server_context_t *ctx = (server_context_t *)arg;
+
+    stats_register("outbound");
+
+    while (ctx->running) {
+        outbound_wait(ctx);
+        if (!ctx->running) break;
+
+        long long now = udp_now_us();
+        long long next = LLONG_MAX;
+
+        PROFILED_RDLOCK(&ctx->clients_lock);
+        for (struct Node *cur = ctx->clients_head; cur != NULL; cur = cur->next) {
+            pthread_mutex_lock(&cur->out_lock);
+            if (cur->out_len > 0) {
+                if (now >= cur->out_flush_at) flush_client_locked(ctx, cur);
+                else if (cur->out_flush_at < next) next = cur->out_flush_at;
+            }
+            pthread_mutex_unlock(&cur->out_lock);
+
+            if (cur->reliable) {
+                long long due = rel_poll(&cur->rel, ctx->sd, &cur->addr);
+                if (due < next) next = due;
+            }
+        }
+        PROFILED_UNLOCK(&ctx->clients_lock);
+
+        if (ctx->fed) {
+            for (int i = 0; i < ctx->fed->peer_count; i++) {
+                long long due = rel_poll(&ctx->fed->peers[i].rel, ctx->sd, &ctx->fed->peers[i].addr);
+                if (due < next) next = due;
+            }
+        }
+
+        long long due = presence_flush(ctx);
+        if (due < next) next = due;
+
+        outbound_kick(ctx, next);
+    }
+
+    return NULL;
+}
+
+// Strip a "tok$<token>$" wrapper. If the token belongs to a session we know
+// under another address, move that session (name, mutes, history position)
+// to this address. Returns the unwrapped request.
+static char *resume_session(server_context_t *ctx, struct sockaddr_in *client_addr, char *request, int *len)
+{
+    if (*len < TOK_TAG_LEN || strncmp(request, TOK_TAG, TOK_TAG_LEN) != 0) {
+        return request;
+    }
+
+    char *end;
+    uint64_t token = strtoull(request + TOK_TAG_LEN, &end, 16);
+    if (*end != '$') {
+        return request;
+    }
+    *len -= (int)(end + 1 - request);
+    request = end + 1;
+
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    PROFILED_UNLOCK(&ctx->clients_lock);
+    if (client != NULL || token == 0) {
+        return request;
+    }
+
+    PROFILED_WRLOCK(&ctx->clients_lock);
+    struct Node *owner = NULL;
+    if (find_client_by_addr_nolock(ctx, client_addr) == NULL) {
+        owner = find_client_by_token_nolock(ctx, token);
+        if (owner) {
+            struct sockaddr_in old_addr = owner->addr;
+            owner->addr = *client_addr;
+            presence_moved(ctx, owner, &old_addr);
+            // the id window stays: a restarted client says so with a new run
+        }
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+
+    if (owner) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr->sin_addr, ip, sizeof(ip));
+        alog_info("Session resumed from %s:%d\n", ip, ntohs(client_addr->sin_port));
+    }
+    return request;
+}
+
+// returns 1 if id has been seen already, otherwise records it; O(1) amortised
+static int dup_window_test_and_set(dup_window_t *w, uint64_t id)
+{
+    if (id > w->highest) {
+        if (id - w->highest >= DUP_WINDOW_BITS) {
+            memset(w->bits, 0, sizeof(w->bits));
+        }
+        else {
+            // forget the ids that slide out of the window
+            for (uint64_t i = w->highest + 1; i < id; i++) {
+                w->bits[(i % DUP_WINDOW_BITS) / 64] &= ~(1ULL << (i % 64));
+            }
+        }
+        w->bits[(id % DUP_WINDOW_BITS) / 64] &= ~(1ULL << (id % 64));
+        w->highest = id;
+    }
+    else if (w->highest - id >= DUP_WINDOW_BITS) {
+        return 1;
+    }
+
+    uint64_t *word = &w->bits[(id % DUP_WINDOW_BITS) / 64];
+    uint64_t bit = 1ULL << (id % 64);
+    if (*word & bit) {
+        return 1;
+    }
+    *word |= bit;
+    return 0;
+}
+
+// a new run of the sender numbers its requests from scratch (hold dup_lock)
+static void dup_window_restart_locked(struct Node *client, uint64_t run)
+{
+    if (client->request_run == run) {
+        return;
+    }
+    client->request_run = run;
+    memset(&client->seen_ids, 0, sizeof(client->seen_ids));
+    if (client->responses) {
+        memset(client->responses, 0, DUP_CACHE_ENTRIES * sizeof(dup_response_t));
+    }
+}
+
+// a conn$ that created its node starts the window with its own id, and
+// the welcome it is about to send is cached for a retried conn$
+static void dup_window_register(struct Node *client)
+{
+    if (pending_id == 0) {
+        return;
+    }
+    pthread_mutex_lock(&client->dup_lock);
+    dup_window_restart_locked(client, pending_run);
+    dup_window_test_and_set(&client->seen_ids, pending_id);
+    client->responses = calloc(DUP_CACHE_ENTRIES, sizeof(dup_response_t));
+    if (client->responses) {
+        capture_node = client;
+        capture_entry = &client->responses[pending_id % DUP_CACHE_ENTRIES];
+        capture_entry->id = pending_id;
+    }
+    pthread_mutex_unlock(&client->dup_lock);
+    pending_id = 0;
+}
+
+// Strip an "id$<n>:<run>$" wrapper (or "id$<n>$", run 0) and check it
+// against the sender's window; every request, conn$ included, goes through
+// it. The run is a nonce the client picks at start, so a restarted client
+// gets a fresh window while retries from the same run are still caught.
+// A repeat is answered from the response cache and 1 is returned; a new id
+// arms response capture for the handler that is about to run.
+static int suppress_duplicate(server_context_t *ctx, struct sockaddr_in *client_addr, char **request, int *len,
+                              uint64_t *id, uint64_t *run)
+{
+    if (*len < ID_TAG_LEN || strncmp(*request, ID_TAG, ID_TAG_LEN) != 0) {
+        return 0;
+    }
+
+    char *end;
+    *id = strtoull(*request + ID_TAG_LEN, &end, 10);
+    *run = 0;
+    if (*end == ':') {
+        *run = strtoull(end + 1, &end, 16);
+    }
+    if (*end != '$' || *id == 0) {
+        *id = 0;
+        return 0;
+    }
+    *len -= (int)(end + 1 - *request);
+    *request = end + 1;
+
+    int duplicate = 0;
+    dup_response_t replay;
+    replay.len = 0;
+
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client) {
+        pthread_mutex_lock(&client->dup_lock);
+        dup_window_restart_locked(client, *run);
+
+        if (client->responses == NULL) {
+            client->responses = calloc(DUP_CACHE_ENTRIES, sizeof(dup_response_t));
+        }
+        dup_response_t *entry = client->responses ? &client->responses[*id % DUP_CACHE_ENTRIES] : NULL;
+
+        if (dup_window_test_and_set(&client->seen_ids, *id)) {
+            duplicate = 1;
+            if (entry && entry->id == *id) {
+                replay = *entry;
+            }
+        }
+        else if (entry) {
+            entry->id = *id;
+            entry->len = 0;
+            capture_node = client;
+            capture_entry = entry;
+        }
+        pthread_mutex_unlock(&client->dup_lock);
+
+        for (int off = 0; off < replay.len; off += (int)strlen(replay.data + off) + 1) {
+            send_to_client(ctx, client, replay.data + off);
+        }
+    }
+    else {
+        pending_id = *id;
+        pending_run = *run;
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+
+    return duplicate;
+}
+
+// reassemble frag$ pieces; whole requests go on to handle_request
+static void deliver_request(server_context_t *ctx, struct sockaddr_in *client_addr, char *payload, int n)
+{
+    char *request;
+    int len = frag_receive(&ctx->frags, client_addr, payload, n, &request);
+    if (len <= 0) {
+        return;
+    }
+
+    request = resume_session(ctx, client_addr, request, &len);
+
+    uint64_t id = 0, run = 0;
+    if (suppress_duplicate(ctx, client_addr, &request, &len, &id, &run)) {
+        return;
+    }
+
+    handle_request(ctx, client_addr, request, len);
+
+    capture_node = NULL;
+    capture_entry = NULL;
+    pending_id = 0;
+}
+
+int fed_receive(server_context_t *ctx, struct sockaddr_in *from, char *buffer, int n);
+
+// strip the reliability layer (if the client uses it) and hand the request on
+static void receive_datagram(server_context_t *ctx, struct sockaddr_in *client_addr, char *buffer, int n)
+{
+    uint32_t sid, seq;
+    char *payload;
+    int payload_len;
+    struct Node *client;
+
+    if (ctx->fed && fed_receive(ctx, client_addr, buffer, n)) {
+        return;
+    }
+
+    if (n >= ACK_TAG_LEN && strncmp(buffer, ACK_TAG, ACK_TAG_LEN) == 0) {
+        PROFILED_RDLOCK(&ctx->clients_lock);
+        client = find_client_by_addr_nolock(ctx, client_addr);
+        if (client) {
+            rel_on_ack(&client->rel, ctx->sd, &client->addr, buffer + ACK_TAG_LEN);
+        }
+        PROFILED_UNLOCK(&ctx->clients_lock);
+        return;
+    }
+
+    if (!rel_parse(buffer, n, &sid, &seq, &payload, &payload_len)) {
+        deliver_request(ctx, client_addr, buffer, n);
+        return;
+    }
+
+    int fresh = 1;
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client) {
+        client->reliable = 1;
+        fresh = rel_on_data(&client->rel, ctx->sd, client_addr, sid, seq);
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+
+    if (fresh) {
+        ctx->rel_request = 1;
+        deliver_request(ctx, client_addr, payload, payload_len);
+        ctx->rel_request = 0;
+    }
+
+    if (client == NULL) {
+        // no session yet (typically this was its conn$): start tracking
+        // it now, or ack without state if the request did not register one
+        PROFILED_RDLOCK(&ctx->clients_lock);
+        client = find_client_by_addr_nolock(ctx, client_addr);
+        if (client) {
+            client->reliable = 1;
+            rel_on_data(&client->rel, ctx->sd, client_addr, sid, seq);
+        }
+        else {
+            char ack[64];
+            int len = snprintf(ack, sizeof(ack), ACK_TAG "%x$%u$0", sid, seq);
+            udp_socket_write(ctx->sd, client_addr, ack, len);
+        }
+        PROFILED_UNLOCK(&ctx->clients_lock);
+    }
+}
+
+int handover_serve(server_context_t *ctx);
+
+// everything the listener does with a datagram it has read (request has
+// room for one more byte); chat_replay calls this too
+static void serve_datagram(server_context_t *ctx, struct sockaddr_in *client_addr, char *request, int len)
+{
+    thread_stats->request_start = stats_now();
+    thread_stats->packets_in++;
+    thread_stats->bytes_in += (unsigned long long)len;
+    request[len] = '\0';
+    if (ctx->capture) {
+        dgcap_append(ctx->capture, udp_now_us(), client_addr, request, len);
+    }
+
+    alog_sampled(ALOG_INFO, "Received request: %s\n", request);
+
+    receive_datagram(ctx, client_addr, request, len);
+    thread_stats->request_start = 0;
+}
+
+void *listener_thread(void *arg)
+{
+    server_context_t *ctx = (server_context_t *)arg;
+
+    char client_request[UDP_MTU + 1];   // bigger requests arrive as frag$ pieces
+    struct sockaddr_in client_addr;
+
+    stats_register("listener");
+
+    while (ctx->running) {
+        if (ctx->handover_fd >= 0) {
+            // a new server process is taking over; it gets the socket with
+            // whatever is still queued on it. If it fails we keep serving
+            if (handover_serve(ctx) == 0) {
+                break;
+            }
+            continue;
+        }
+
+        int rc;
+        if (tracer.every) {
+            rc = udp_socket_read_stamped(ctx->sd, &client_addr, client_request, UDP_MTU, &trace_req.kernel);
+        }
+        else {
+            rc = udp_socket_read(ctx->sd, &client_addr, client_request, UDP_MTU);
+        }
+
+        if (rc > 0) {
+            serve_datagram(ctx, &client_addr, client_request, rc);
+        } 
+        else if (rc < 0 && ctx->handover_path == NULL) {
+            perror("udp_socket_read");
+            break;
+        }
+        // with -H the socket has a receive timeout, so we notice a handover
+    }
+
+    alog_info("Listener thread exiting.\n");
+    return NULL;
+}
+
+// tokenise requests
+void parse_request(char *buffer, char **command, char **content) {
+    size_t len = strlen(buffer);
+    if (len > 0 && buffer[len - 1] == '\n') {
+        buffer[len - 1] = '\0';
+    }
+
+    *command = strtok(buffer, "$");
+    *content = strtok(NULL, "\0");
+
+    if (*content == NULL) {
+        *content = "";
+    }
+
+    while (**content == ' ') (*content)++;
+}
+
+// min heap functions (assumes you hold client_lock)
+static void heap_swap(server_context_t *ctx, int i, int j)
+{
+    struct Node *a = ctx->activity_heap[i];
+    struct Node *b = ctx->activity_heap[j];
+    ctx->activity_heap[i] = b;
+    ctx->activity_heap[j] = a;
+    if (a) a->heap_index = j;
+    if (b) b->heap_index = i;
+}
+
+static void heap_sift_up(server_context_t *ctx, int idx)
+{
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (ctx->activity_heap[parent]->last_active <= ctx->activity_heap[idx]->last_active) break;
+        heap_swap(ctx, parent, idx);
+        idx = parent;
+    }
+}
+
+static void heap_sift_down(server_context_t *ctx, int idx)
+{
+    int n = ctx->heap_size;
+    while (1) {
+        int left = 2 * idx + 1;
+        int right = 2 * idx + 2;
+        int smallest = idx;
+
+        if (left < n && ctx->activity_heap[left]->last_active < ctx->activity_heap[smallest]->last_active) {
+            smallest = left;
+        }
+        if (right < n && ctx->activity_heap[right]->last_active < ctx->activity_heap[smallest]->last_active) {
+            smallest = right;
+        }
+        if (smallest == idx) break;
+        heap_swap(ctx, idx, smallest);
+        idx = smallest;
+    }
+}
+
+static void heap_insert(server_context_t *ctx, struct Node *node)
+{
+    if (ctx->heap_size == ctx->heap_cap) {
+        int cap = ctx->heap_cap ? ctx->heap_cap * 2 : MAX_CLIENTS;
+        struct Node **grown = realloc(ctx->activity_heap, cap * sizeof(struct Node *));
+        if (!grown) return;   // not tracked: never evicted for inactivity
+        ctx->activity_heap = grown;
+        ctx->heap_cap = cap;
+    }
+    int idx = ctx->heap_size++;
+    ctx->activity_heap[idx] = node;
+    node->heap_index = idx;
+    heap_sift_up(ctx, idx);
+}
+
+static void heap_remove(server_context_t *ctx, struct Node *node)
+{
+    int idx = node->heap_index;
+    if (idx < 0 || idx >= ctx->heap_size) return;
+
+    int last = ctx->heap_size - 1;
+    if (idx != last) {
+        heap_swap(ctx, idx, last);
+    }
+    ctx->heap_size--;
+    ctx->activity_heap[ctx->heap_size] = NULL;
+    node->heap_index = -1;
+
+    if (idx < ctx->heap_size) {
+        heap_sift_down(ctx, idx);
+        heap_sift_up(ctx, idx);
+    }
+}
+
+static void heap_update(server_context_t *ctx, struct Node *node)
+{
+    int idx = node->heap_index;
+    if (idx < 0 || idx >= ctx->heap_size) return;
+    heap_sift_down(ctx, idx);
+    heap_sift_up(ctx, idx);
+}
+
+void *ping_monitor_thread(void *arg)
+{
+    server_context_t *ctx = (server_context_t *)arg;
+
+    stats_register("ping");
+
+    while (ctx->running) {
+        PROFILED_WRLOCK(&ctx->clients_lock);
+
+        if (ctx->heap_size > 0) {
+            struct Node *least = ctx->activity_heap[0];
+            time_t now = time(NULL);
+
+            if (!least->awaiting_ping_reply) {
+
+                if (now - least->last_active >= INACTIVE_THRESHOLD) {
+                    const char *ping_msg = "ping$";
+                    udp_socket_write(ctx->sd, &least->addr, (char *)ping_msg, strlen(ping_msg));
+                    least->awaiting_ping_reply = 1;
+                    least->ping_sent_time = now;
+                }
+            }
+            else {
+                if (now - least->ping_sent_time >= PING_TIMEOUT) {
+
+                    struct Node *prev = NULL;
+                    struct Node *cur = ctx->clients_head;
+
+                    while (cur != NULL && cur != least) {
+                        prev = cur;
+                        cur = cur->next;
+                    }
+
+                    if (cur == least) {
+                        if (prev == NULL) ctx->clients_head = cur->next;
+                        else prev->next = cur->next;
+
+                        // announced in the next presence digest
+                        presence_departed(ctx, cur->client_name, 0);
+                        heap_remove(ctx, cur);
+                        free_node(ctx, cur);
+                    }
+
+                    PROFILED_UNLOCK(&ctx->clients_lock);
+
+                    continue; // (to avoid double unlocking)
+                }
+            }
+        }
+
+        PROFILED_UNLOCK(&ctx->clients_lock);
+
+        mailbox_expire(ctx);
+        if (ctx->capture) {
+            dgcap_flush(ctx->capture);   // an idle capture is on disk within a second
+        }
+        sleep(1);
+    }
+
+    return NULL;
+}
+
+struct history_sync_arg {
+    server_context_t *ctx;
+    struct Node *client;
+};
+
+// resend one message read straight from a mapped log segment
+static void send_logged_message(void *arg, uint64_t id, const char *line)
+{
+    struct history_sync_arg *a = (struct history_sync_arg *)arg;
+    size_t len = MSG_TAG_LEN + 22 + strlen(line);
+    char *buffer = malloc(len);
+    if (!buffer) {
+        return;
+    }
+    snprintf(buffer, len, MSG_TAG "%llu$%s", (unsigned long long)id, line);
+    send_to_client(a->ctx, a->client, buffer);
+    free(buffer);
+}
+
+// send the global messages newer than last_id (all of them if has_last_id
+// is 0). epoch is the one last_id belongs to, 0 if the client did not say.
+static void send_history_since(server_context_t *ctx, struct Node *client, int has_last_id, uint64_t last_id, uint32_t epoch)
+{
+    if (ctx->global_count == 0) {
+        return;
+    }
+
+    uint64_t oldest = ctx->global_ids[ctx->global_start];
+    uint64_t newest = ctx->global_ids[(ctx->global_start + ctx->global_count - 1) % GLOBAL_BUFFER_SIZE];
+
+    if (has_last_id && epoch != 0 && epoch != ctx->history_epoch) {
+        // last_id counts from another server run: none of ours follow from it
+        char gap[64];
+        snprintf(gap, sizeof(gap), GAP_TAG "%llu$%llu", (unsigned long long)last_id, (unsigned long long)oldest);
+        send_to_client(ctx, client, gap);
+        has_last_id = 0;
+    }
+
+    if (has_last_id && last_id == newest) {
+        return; // already up to date
+    }
+
+    if (has_last_id && last_id + 1 < oldest && last_id < newest && ctx->log) {
+        // older than the ring: stream the rest from the on-disk log
+        uint64_t log_oldest, log_newest;
+        msglog_bounds(ctx->log, &log_oldest, &log_newest);
+        uint64_t from = last_id + 1;
+        if (newest - last_id > HISTORY_SYNC_MAX) {
+            from = newest - HISTORY_SYNC_MAX + 1;
+        }
+        if (from < log_oldest) {
+            from = log_oldest;
+        }
+        if (from > last_id + 1) {
+            char gap[64];
+            snprintf(gap, sizeof(gap), GAP_TAG "%llu$%llu", (unsigned long long)last_id, (unsigned long long)from);
+            send_to_client(ctx, client, gap);
+        }
+        struct history_sync_arg arg = { ctx, client };
+        msglog_read_from(ctx->log, from, (int)(newest - from + 1), send_logged_message, &arg);
+        return;
+    }
+
+    if (has_last_id && (last_id + 1 < oldest || last_id > newest)) {
+        // missed more than we keep (or, from a client that sent no epoch,
+        // an id from another server run that is ahead of ours)
+        char gap[64];
+        snprintf(gap, sizeof(gap), GAP_TAG "%llu$%llu", (unsigned long long)last_id, (unsigned long long)oldest);
+        send_to_client(ctx, client, gap);
+        has_last_id = 0;
+    }
+
+    for (int i = 0; i < ctx->global_count; i++) {
+        int idx = (ctx->global_start + i) % GLOBAL_BUFFER_SIZE;
+        if (!has_last_id || ctx->global_ids[idx] > last_id) {
+            send_to_client(ctx, client, ctx->global_buffer[idx]);
+        }
+    }
+}
+
+// connect client and also output the global messages it has not seen
+// content is "<name>", "<name>$<last message id seen>" or
+// "<name>$<last message id seen>$<its epoch>"
+void handle_conn(server_context_t *ctx, struct sockaddr_in *client_addr, char *content)
+{
+    const char *name = content;
+    int has_last_id = 0;
+    uint64_t last_id = 0;
+    uint32_t epoch = 0;
+
+    char *sep = strchr(content, '$');
+    if (sep) {
+        *sep = '\0';
+        has_last_id = 1;
+        char *end;
+        last_id = strtoull(sep + 1, &end, 10);
+        if (*end == '$') {
+            epoch = (uint32_t)strtoul(end + 1, NULL, 16);
+        }
+    }
+
+    PROFILED_WRLOCK(&ctx->clients_lock);
+    struct Node *existing = find_client_by_addr_nolock(ctx, client_addr);
+    if (existing == NULL && fed_redirect(ctx, name, client_addr)) {
+        PROFILED_UNLOCK(&ctx->clients_lock);
+        return; // this user lives on another node
+    }
+    if (existing == NULL) {
+        struct Node *new_node = create_node(name, client_addr);
+        new_node->next = ctx->clients_head;
+        ctx->clients_head = new_node;
+        ctx->client_count++;
+        existing = new_node;
+        existing->last_active = time(NULL);
+        existing->reliable = ctx->rel_request;
+        heap_insert(ctx, existing);
+        presence_join(ctx, existing);
+        dup_window_register(existing);
+    } 
+    else {
+        if (strcmp(existing->client_name, name) != 0) {
+            presence_rename(ctx, existing->client_name, name);
+        }
+        strncpy(existing->client_name, name, MAX_NAME_LEN - 1);
+        existing->client_name[MAX_NAME_LEN - 1] = '\0';
+        existing->last_active = time(NULL);
+        if (existing->heap_index >= 0) {
+            heap_update(ctx, existing);
+        } 
+        else {
+            heap_insert(ctx, existing);
+        }
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+
+    char response[BUFFER_SIZE];
+    snprintf(response, sizeof(response), "Hi %s, you have successfully connected to the chat", existing->client_name);
+    send_to_client(ctx, existing, response);
+
+    snprintf(response, sizeof(response), TOKEN_TAG "%016llx$%08x", (unsigned long long)existing->token, ctx->history_epoch);
+    send_to_client(ctx, existing, response);
+
+    send_history_since(ctx, existing, has_last_id, last_id, epoch);
+    mailbox_deliver(ctx, existing);
+}
+
+void publish_global(server_context_t *ctx, const char *name, const char *msg);
+static void history_store(server_context_t *ctx, uint64_t id, char *buffer);
+
+// send a message to all clients and store message in global buffer
+void handle_say(server_context_t *ctx, struct sockaddr_in *client_addr, const char *msg)
+{
+    struct Node *sender = find_client_by_addr(ctx, client_addr);
+    const char *name = sender ? sender->client_name : "Unknown";
+
+    publish_global(ctx, name, msg);
+    fed_relay(ctx, "say", name, NULL, msg);
+}
+
+// store "<name>: <msg>" in the global history and send it to local clients
+void publish_global(server_context_t *ctx, const char *name, const char *msg)
+{
+    uint64_t id = ++ctx->next_msg_id;
+
+    // sized to fit: long pastes arrive reassembled and leave as frag$ pieces
+    size_t len = MSG_TAG_LEN + 21 + strlen(name) + strlen(msg) + 3;
+    char *buffer = malloc(len);
+    if (!buffer) {
+        perror("malloc");
+        return;
+    }
+    int prefix = snprintf(buffer, len, MSG_TAG "%llu$", (unsigned long long)id);
+    snprintf(buffer + prefix, len - prefix, "%s: %s", name, msg);
+
+    uint64_t stored = 0;
+    if (trace_sampled(id)) {
+        trace_begin(id);
+        stored = stats_now();
+    }
+
+    if (ctx->log) {
+        msglog_append(ctx->log, id, buffer + prefix);  // made durable by log_sync_thread
+    }
+    search_enqueue(ctx, id, buffer + prefix);
+
+    history_store(ctx, id, buffer);
+    if (stored) {
+        trace_tick_span(id, "history write", stored, stats_now(), NULL);
+        trace_req.sending = id;
+    }
+    broadcast_message(ctx, name, buffer);
+    trace_req.sending = 0;
+}
+
+// keep a "msg$<id>$<line>" string (taking ownership) in the global ring
+static void history_store(server_context_t *ctx, uint64_t id, char *buffer)
+{
+    pthread_mutex_lock(&ctx->history_lock);
+    int idx;
+    if (ctx->global_count < GLOBAL_BUFFER_SIZE) {
+        idx = (ctx->global_start + ctx->global_count) % GLOBAL_BUFFER_SIZE;
+        ctx->global_count++;
+    } 
+    else {
+        idx = ctx->global_start;
+        free(ctx->global_buffer[idx]);
+        ctx->global_start = (ctx->global_start + 1) % GLOBAL_BUFFER_SIZE;
+    }
+    ctx->global_buffer[idx] = buffer;
+    ctx->global_ids[idx] = id;
+    pthread_mutex_unlock(&ctx->history_lock);
+}
+
+int deliver_sayto(server_context_t *ctx, const char *sender_name, const char *recipient_name, const char *msg);
+
+// send a message to one person (don't store in global buffer)
+void handle_sayto(server_context_t *ctx, struct sockaddr_in *client_addr, char *content)
+{
+    struct Node *sender = find_client_by_addr(ctx, client_addr);
+    const char *sender_name = sender ? sender->client_name : "Unknown";
+
+    char *space = strchr(content, ' ');
+    if (!space) {
+        return;
+    }
+    *space = '\0';
+    char *recipient_name = content;
+    char *msg = space + 1;
+
+    if (deliver_sayto(ctx, sender_name, recipient_name, msg) ||
+        fed_forward_sayto(ctx, sender_name, recipient_name, msg)) {
+        return;
+    }
+
+    // nobody by that name is online: keep it for their next conn$
+    char response[BUFFER_SIZE];
+    if (mailbox_put(ctx, recipient_name, sender_name, msg) == 0) {
+        snprintf(response, sizeof(response), QUEUED_TAG "%s", recipient_name);
+    }
+    else {
+        snprintf(response, sizeof(response), "Mailbox of %s is full; message not delivered", recipient_name);
+    }
+    if (sender) {
+        send_to_client(ctx, sender, response);
+    }
+}
+
+// hand a private message to a local recipient; returns 0 if there is none
+int deliver_sayto(server_context_t *ctx, const char *sender_name, const char *recipient_name, const char *msg)
+{
+    struct Node *recipient = find_client_by_name(ctx, recipient_name);
+    if (!recipient) {
+        return 0;
+    }
+
+    if (is_muted(recipient, sender_name)) {
+        return 1;
+    }
+
+    size_t len = strlen(sender_name) + strlen(msg) + 3;
+    char *buffer = malloc(len);
+    if (!buffer) {
+        perror("malloc");
+        return 1;
+    }
+    snprintf(buffer, len, "%s: %s", sender_name, msg);
+    send_to_client(ctx, recipient, buffer);
+    free(buffer);
+    return 1;
+}
+
+// disconnect client (client will also do a local disconnect)
+void handle_disconn(server_context_t *ctx, struct sockaddr_in *client_addr)
+{
+    PROFILED_WRLOCK(&ctx->clients_lock);
+    struct Node *prev = NULL;
+    struct Node *cur = ctx->clients_head;
+
+    while (cur != NULL) {
+        if (cur->addr.sin_addr.s_addr == client_addr->sin_addr.s_addr &&
+            cur->addr.sin_port        == client_addr->sin_port) {
+
+            if (prev == NULL) ctx->clients_head = cur->next;
+
+            else prev->next = cur->next;
+                
+
+            char name[MAX_NAME_LEN];
+            strncpy(name, cur->client_name, MAX_NAME_LEN);
+            heap_remove(ctx, cur);
+            free_node(ctx, cur);
+            PROFILED_UNLOCK(&ctx->clients_lock);
+
+            char response[BUFFER_SIZE];
+            snprintf(response, sizeof(response), "Disconnected. Bye! (%s)", name);
+            udp_socket_write(ctx->sd, client_addr, response, BUFFER_SIZE);
+            return;
+        }
+        prev = cur;
+        cur = cur->next;
+    }
+
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+// change client name in linked list
+void handle_rename(server_context_t *ctx, struct sockaddr_in *client_addr, const char *new_name)
+{
+    PROFILED_WRLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client) {
+        presence_rename(ctx, client->client_name, new_name);
+        strncpy(client->client_name, new_name, MAX_NAME_LEN - 1);
+        client->client_name[MAX_NAME_LEN - 1] = '\0';
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+
+    if (client) {
+        char response[BUFFER_SIZE];
+        snprintf(response, sizeof(response), "You are now known as %s", client->client_name);
+        send_to_client(ctx, client, response);
+    }
+}
+
+// mute other clients
+void handle_mute(server_context_t *ctx, struct sockaddr_in *client_addr, const char *name)
+{
+    PROFILED_WRLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client) {
+        add_mute(client, name);
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+// unmute other clients
+void handle_unmute(server_context_t *ctx, struct sockaddr_in *client_addr, const char *name)
+{
+    PROFILED_WRLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client) {
+        remove_mute(client, name);
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+// join$<room>: become a member and get the room's recent history
+void handle_join(server_context_t *ctx, struct sockaddr_in *client_addr, const char *name)
+{
+    char response[BUFFER_SIZE];
+
+    if (*name == '#') name++;
+    if (*name == '\0' || strlen(name) >= MAX_NAME_LEN || strchr(name, ' ') || strchr(name, '$')) {
+        snprintf(response, sizeof(response), "Invalid room name");
+        udp_socket_write(ctx->sd, client_addr, response, (int)strlen(response) + 1);
+        return;
+    }
+
+    // the read lock keeps the node alive; only the listener changes node->rooms
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client == NULL) {
+        PROFILED_UNLOCK(&ctx->clients_lock);
+        return;
+    }
+
+    if (node_room_index(client, name) >= 0) {
+        snprintf(response, sizeof(response), "You are already in #%s", name);
+        send_to_client(ctx, client, response);
+        PROFILED_UNLOCK(&ctx->clients_lock);
+        return;
+    }
+    if (client->room_count >= MAX_ROOMS_PER_CLIENT) {
+        snprintf(response, sizeof(response), "You cannot join more than %d rooms", MAX_ROOMS_PER_CLIENT);
+        send_to_client(ctx, client, response);
+        PROFILED_UNLOCK(&ctx->clients_lock);
+        return;
+    }
+
+    struct Room *room = room_acquire(ctx, name, 1);
+    if (room == NULL || !room_add_member(room, client)) {
+        if (room) room_release(ctx, room);
+        PROFILED_UNLOCK(&ctx->clients_lock);
+        return;
+    }
+    client->rooms[client->room_count++] = room;
+
+    snprintf(response, sizeof(response), "You joined #%s", room->name);
+    send_to_client(ctx, client, response);
+
+    pthread_rwlock_rdlock(&room->lock);
+    for (int i = 0; i < room->history_count; i++) {
+        send_to_client(ctx, client, room->history[(room->history_start + i) % ROOM_HISTORY_SIZE]);
+    }
+    pthread_rwlock_unlock(&room->lock);
+
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+// leave$<room>
+void handle_leave(server_context_t *ctx, struct sockaddr_in *client_addr, const char *name)
+{
+    if (*name == '#') name++;
+
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client) {
+        char response[BUFFER_SIZE];
+        int idx = node_room_index(client, name);
+        if (idx >= 0) {
+            node_leave_room(ctx, client, idx);
+            snprintf(response, sizeof(response), "You left #%s", name);
+        }
+        else {
+            snprintf(response, sizeof(response), "You are not in #%s", name);
+        }
+        send_to_client(ctx, client, response);
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+void publish_room(server_context_t *ctx, const char *room_name, const char *sender_name, const char *msg);
+
+// say$#<room> <msg>: store in the room's history and fan out to its members only
+void handle_room_say(server_context_t *ctx, struct sockaddr_in *client_addr, char *content)
+{
+    char *room_name = content + 1;
+    char *space = strchr(room_name, ' ');
+    if (!space) {
+        return;
+    }
+    *space = '\0';
+    const char *msg = space + 1;
+
+    char sender_name[MAX_NAME_LEN];
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct Node *sender = find_client_by_addr_nolock(ctx, client_addr);
+    int member = sender && node_room_index(sender, room_name) >= 0;
+    if (sender) {
+        strcpy(sender_name, sender->client_name);
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+
+    if (!member) {
+        char response[BUFFER_SIZE];
+        snprintf(response, sizeof(response), "You are not in #%s", room_name);
+        udp_socket_write(ctx->sd, client_addr, response, (int)strlen(response) + 1);
+        return;
+    }
+
+    publish_room(ctx, room_name, sender_name, msg);
+    fed_relay(ctx, "room", room_name, sender_name, msg);
+}
+
+// store a post in a local room's history and send it to the room's members
+void publish_room(server_context_t *ctx, const char *room_name, const char *sender_name, const char *msg)
+{
+    struct Room *room = room_acquire(ctx, room_name, 0);
+    if (room == NULL) {
+        return; // nobody here is in that room
+    }
+
+    size_t len = strlen(room->name) + strlen(sender_name) + strlen(msg) + 5;
+    char *line = malloc(len);
+    if (!line) {
+        room_release(ctx, room);
+        return;
+    }
+    snprintf(line, len, "#%s %s: %s", room->name, sender_name, msg);
+
+    pthread_rwlock_wrlock(&room->lock);
+    int idx;
+    if (room->history_count < ROOM_HISTORY_SIZE) {
+        idx = (room->history_start + room->history_count) % ROOM_HISTORY_SIZE;
+        room->history_count++;
+    }
+    else {
+        idx = room->history_start;
+        free(room->history[idx]);
+        room->history_start = (room->history_start + 1) % ROOM_HISTORY_SIZE;
+    }
+    room->history[idx] = line;
+    pthread_rwlock_unlock(&room->lock);
+
+    // members cannot be freed while we hold the room lock: free_node
+    // removes them from their rooms first
+    pthread_rwlock_rdlock(&room->lock);
+    for (int i = 0; i < room->member_count; i++) {
+        struct Node *member_node = room->members[i];
+        if (!is_muted(member_node, sender_name)) {
+            send_to_client(ctx, member_node, line);
+        }
+    }
+    pthread_rwlock_unlock(&room->lock);
+
+    room_release(ctx, room);
+}
+
+// sub$<topic>, sub$<topic>/* or sub$*
+void handle_sub(server_context_t *ctx, struct sockaddr_in *client_addr, const char *topic)
+{
+    char response[BUFFER_SIZE];
+    int prefix;
+    if (!topic_valid(topic, &prefix)) {
+        snprintf(response, sizeof(response), "Invalid topic");
+        udp_socket_write(ctx->sd, client_addr, response, (int)strlen(response) + 1);
+        return;
+    }
+    size_t path_len = strlen(topic) - (prefix ? (strlen(topic) == 1 ? 1 : 2) : 0);
+
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client == NULL) {
+        PROFILED_UNLOCK(&ctx->clients_lock);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&ctx->topics->lock);
+    struct Topic *node_topic = topic_lookup(ctx->topics, topic, path_len, 1);
+    int already = 0;
+    for (int i = 0; i < client->sub_count; i++) {
+        if (client->subs[i] == node_topic && client->sub_prefix[i] == prefix) {
+            already = 1;
+        }
+    }
+
+    if (already) {
+        snprintf(response, sizeof(response), "Already subscribed to %s", topic);
+    }
+    else if (node_topic == NULL || client->sub_count >= MAX_SUBS_PER_CLIENT ||
+             !node_set_add(prefix ? &node_topic->prefix : &node_topic->exact, client)) {
+        if (node_topic) topic_prune(node_topic);
+        snprintf(response, sizeof(response), "Cannot subscribe to more than %d topics", MAX_SUBS_PER_CLIENT);
+    }
+    else {
+        client->subs[client->sub_count] = node_topic;
+        client->sub_prefix[client->sub_count] = (char)prefix;
+        client->sub_count++;
+        snprintf(response, sizeof(response), "Subscribed to %s", topic);
+    }
+    pthread_rwlock_unlock(&ctx->topics->lock);
+
+    send_to_client(ctx, client, response);
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+void handle_unsub(server_context_t *ctx, struct sockaddr_in *client_addr, const char *topic)
+{
+    int prefix;
+    if (!topic_valid(topic, &prefix)) {
+        return;
+    }
+    size_t path_len = strlen(topic) - (prefix ? (strlen(topic) == 1 ? 1 : 2) : 0);
+
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client == NULL) {
+        PROFILED_UNLOCK(&ctx->clients_lock);
+        return;
+    }
+
+    int removed = 0;
+    pthread_rwlock_wrlock(&ctx->topics->lock);
+    struct Topic *node_topic = topic_lookup(ctx->topics, topic, path_len, 0);
+    for (int i = 0; i < client->sub_count && node_topic; i++) {
+        if (client->subs[i] == node_topic && client->sub_prefix[i] == prefix) {
+            node_unsubscribe_locked(client, i);
+            removed = 1;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&ctx->topics->lock);
+
+    char response[BUFFER_SIZE];
+    snprintf(response, sizeof(response), removed ? "Unsubscribed from %s" : "Not subscribed to %s", topic);
+    send_to_client(ctx, client, response);
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+// pub$<topic> <msg>
+void handle_pub(server_context_t *ctx, struct sockaddr_in *client_addr, char *content)
+{
+    char *space = strchr(content, ' ');
+    if (!space) {
+        return;
+    }
+    *space = '\0';
+    const char *msg = space + 1;
+
+    int prefix;
+    if (!topic_valid(content, &prefix) || prefix) {
+        char response[BUFFER_SIZE];
+        snprintf(response, sizeof(response), "Invalid topic");
+        udp_socket_write(ctx->sd, client_addr, response, (int)strlen(response) + 1);
+        return;
+    }
+
+    char sender_name[MAX_NAME_LEN];
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    struct Node *sender = find_client_by_addr_nolock(ctx, client_addr);
+    if (sender) {
+        strcpy(sender_name, sender->client_name);
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+    if (!sender) {
+        return;
+    }
+
+    publish_topic(ctx, content, sender_name, msg);
+    fed_relay(ctx, "pub", content, sender_name, msg);
+}
+
+// if admin (server port = 6666), kick, otherwise don't
+void handle_kick(server_context_t *ctx, struct sockaddr_in *client_addr, const char *name)
+{
+    if (client_addr->sin_port != htons(6666)) {
+        char msg[BUFFER_SIZE];
+        snprintf(msg, sizeof(msg), "You are not authorized to kick users.");
+        udp_socket_write(ctx->sd, client_addr, msg, BUFFER_SIZE);
+        return;
+    }
+
+    PROFILED_WRLOCK(&ctx->clients_lock);
+    struct Node *prev = NULL;
+    struct Node *cur = ctx->clients_head;
+
+    while (cur != NULL) {
+        if (strcmp(cur->client_name, name) == 0) {
+
+            if (prev == NULL) ctx->clients_head = cur->next;
+
+            else prev->next = cur->next;
+
+            struct sockaddr_in kicked_addr = cur->addr;
+            presence_departed(ctx, cur->client_name, 1);
+            heap_remove(ctx, cur);
+            free_node(ctx, cur);
+            PROFILED_UNLOCK(&ctx->clients_lock);
+
+            char msg_kicked[BUFFER_SIZE];
+            snprintf(msg_kicked, sizeof(msg_kicked), "You have been removed from the chat");
+            udp_socket_write(ctx->sd, &kicked_addr, msg_kicked, BUFFER_SIZE);
+            return;
+        }
+        prev = cur;
+        cur = cur->next;
+    }
+
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+void handle_ret_ping(server_context_t *ctx, struct sockaddr_in *client_addr)
+{
+    PROFILED_WRLOCK(&ctx->clients_lock);
+
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    if (client) {
+        client->last_active = time(NULL);
+        client->awaiting_ping_reply = 0;
+        client->ping_sent_time = 0;
+
+        if (client->heap_index >= 0) {
+            heap_update(ctx, client);
+        }
+    }
+
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+// ---------------------------------------------------------------------------
+// federation
+// ---------------------------------------------------------------------------
+
+static int fed_write_cb(void *arg, const char *buffer, int n)
+{
+    struct Peer *peer = ((struct Peer **)arg)[0];
+    server_context_t *ctx = ((server_context_t **)arg)[1];
+    return rel_send_timed(ctx, &peer->rel, &peer->addr, buffer, n);
+}
+
+static void fed_send(server_context_t *ctx, struct Peer *peer, const char *msg, int n)
+{
+    if (n > UDP_PAYLOAD_MAX) {
+        void *arg[2] = { peer, ctx };
+        uint32_t msg_id = __atomic_fetch_add(&ctx->next_frag_id, 1, __ATOMIC_RELAXED);
+        frag_send(msg_id, msg, n, fed_write_cb, arg);
+        return;
+    }
+    rel_send_timed(ctx, &peer->rel, &peer->addr, msg, n);
+}
+
+static void fed_send_all(server_context_t *ctx, const char *msg, int n)
+{
+    for (int i = 0; i < ctx->fed->peer_count; i++) {
+        if (__atomic_load_n(&ctx->fed->peers[i].alive, __ATOMIC_ACQUIRE)) {
+            fed_send(ctx, &ctx->fed->peers[i], msg, n);
+        }
+    }
+}
+
+// relay local traffic: fed$<kind>$<a>[$<b>]$<msg>
+void fed_relay(server_context_t *ctx, const char *kind, const char *a, const char *b, const char *msg)
+{
+    if (ctx->fed == NULL) {
+        return;
+    }
+
+    size_t len = FED_TAG_LEN + strlen(kind) + strlen(a) + (b ? strlen(b) : 0) + strlen(msg) + 8;
+    char *buffer = malloc(len);
+    if (!buffer) {
+        return;
+    }
+    int n;
+    if (b) {
+        n = snprintf(buffer, len, FED_TAG "%s$%s$%s$%s", kind, a, b, msg);
+    }
+    else {
+        n = snprintf(buffer, len, FED_TAG "%s$%s$%s", kind, a, msg);
+    }
+    fed_send_all(ctx, buffer, n + 1);
+    free(buffer);
+}
+
+void fed_presence(server_context_t *ctx, char change, const char *name)
+{
+    if (ctx->fed == NULL) {
+        return;
+    }
+
+    char buffer[BUFFER_SIZE];
+    int n = snprintf(buffer, sizeof(buffer), FED_TAG "pres$%c$%s", change, name);
+    fed_send_all(ctx, buffer, n + 1);
+}
+
+static void remote_user_add(struct Federation *fed, const char *name, int peer)
+{
+    uint32_t b = hash_name(name) % REMOTE_BUCKETS;
+
+    pthread_mutex_lock(&fed->remote_lock);
+    struct RemoteUser *u;
+    for (u = fed->remote[b]; u != NULL; u = u->next) {
+        if (strcmp(u->name, name) == 0) {
+            break;
+        }
+    }
+    if (u == NULL && (u = calloc(1, sizeof(*u))) != NULL) {
+        strncpy(u->name, name, MAX_NAME_LEN - 1);
+        u->next = fed->remote[b];
+        fed->remote[b] = u;
+    }
+    if (u) {
+        u->peer = peer;
+    }
+    pthread_mutex_unlock(&fed->remote_lock);
+}
+
+static void remote_user_remove(struct Federation *fed, const char *name, int peer)
+{
+    uint32_t b = hash_name(name) % REMOTE_BUCKETS;
+
+    pthread_mutex_lock(&fed->remote_lock);
+    for (struct RemoteUser **link = &fed->remote[b]; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0 && (*link)->peer == peer) {
+            struct RemoteUser *u = *link;
+            *link = u->next;
+            free(u);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fed->remote_lock);
+}
+
+// forget everyone who was connected to a peer that went away
+static void remote_users_drop_peer(struct Federation *fed, int peer)
+{
+    pthread_mutex_lock(&fed->remote_lock);
+    for (int b = 0; b < REMOTE_BUCKETS; b++) {
+        struct RemoteUser **link = &fed->remote[b];
+        while (*link != NULL) {
+            if ((*link)->peer == peer) {
+                struct RemoteUser *u = *link;
+                *link = u->next;
+                free(u);
+            }
+            else {
+                link = &(*link)->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&fed->remote_lock);
+}
+
+// peer index that has this user connected, or -1
+static int remote_user_peer(struct Federation *fed, const char *name)
+{
+    uint32_t b = hash_name(name) % REMOTE_BUCKETS;
+    int peer = -1;
+
+    pthread_mutex_lock(&fed->remote_lock);
+    for (struct RemoteUser *u = fed->remote[b]; u != NULL; u = u->next) {
+        if (strcmp(u->name, name) == 0) {
+            peer = u->peer;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fed->remote_lock);
+    return peer;
+}
+
+int fed_forward_sayto(server_context_t *ctx, const char *sender_name, const char *recipient_name, const char *msg)
+{
+    if (ctx->fed == NULL) {
+        return 0;
+    }
+    int peer = remote_user_peer(ctx->fed, recipient_name);
+    if (peer < 0 || !__atomic_load_n(&ctx->fed->peers[peer].alive, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    size_t len = FED_TAG_LEN + strlen(recipient_name) + strlen(sender_name) + strlen(msg) + 16;
+    char *buffer = malloc(len);
+    if (!buffer) {
+        return 0;
+    }
+    int n = snprintf(buffer, len, FED_TAG "sayto$%s$%s$%s", recipient_name, sender_name, msg);
+    fed_send(ctx, &ctx->fed->peers[peer], buffer, n + 1);
+    free(buffer);
+    return 1;
+}
+
+// tell a peer that just came up who is connected here, a few names per message
+static void fed_send_roster(server_context_t *ctx, struct Peer *peer)
+{
+    char *buffer = malloc(FED_ROSTER_CHUNK);
+    if (!buffer) {
+        return;
+    }
+    int n = snprintf(buffer, FED_ROSTER_CHUNK, FED_TAG "roster$");
+    int header = n;
+
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    for (struct Node *cur = ctx->clients_head; cur != NULL; cur = cur->next) {
+        int name_len = (int)strlen(cur->client_name);
+        if (n + name_len + 2 > FED_ROSTER_CHUNK) {
+            fed_send(ctx, peer, buffer, n + 1);
+            n = header;
+        }
+        n += snprintf(buffer + n, FED_ROSTER_CHUNK - n, "%s\n", cur->client_name);
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+
+    if (n > header) {
+        fed_send(ctx, peer, buffer, n + 1);
+    }
+    free(buffer);
+}
+
+static uint32_t ring_hash(const char *key)
+{
+    // FNV-1a followed by a murmur3 finaliser, so that keys differing only
+    // in their last characters ("node#1", "node#2") spread over the ring
+    uint32_t h = hash_name(key);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int ring_point_cmp(const void *a, const void *b)
+{
+    uint32_t x = ((const struct RingPoint *)a)->hash;
+    uint32_t y = ((const struct RingPoint *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static void ring_add_node(struct Federation *fed, const char *name, int node)
+{
+    char key[48];
+    for (int v = 0; v < RING_VNODES; v++) {
+        snprintf(key, sizeof(key), "%s#%d", name, v);
+        fed->ring[fed->ring_size].hash = ring_hash(key);
+        fed->ring[fed->ring_size].node = node;
+        fed->ring_size++;
+    }
+}
+
+// rebuild the ring from this node and the peers currently alive. Only new
+// conn$ requests follow it: users already connected stay on the node they
+// are on until they reconnect, so after a peer joins a few may sit on a
+// node that no longer owns their name
+static void ring_rebuild(struct Federation *fed)
+{
+    pthread_rwlock_wrlock(&fed->ring_lock);
+    fed->ring_size = 0;
+    ring_add_node(fed, fed->self, -1);
+    for (int i = 0; i < fed->peer_count; i++) {
+        if (__atomic_load_n(&fed->peers[i].alive, __ATOMIC_ACQUIRE)) {
+            ring_add_node(fed, fed->peers[i].name, i);
+        }
+    }
+    qsort(fed->ring, fed->ring_size, sizeof(fed->ring[0]), ring_point_cmp);
+    pthread_rwlock_unlock(&fed->ring_lock);
+}
+
+// node owning a user or "#room" name: a peer index, or -1 for this node
+static int ring_owner(struct Federation *fed, const char *key)
+{
+    uint32_t h = ring_hash(key);
+
+    pthread_rwlock_rdlock(&fed->ring_lock);
+    int lo = 0, hi = fed->ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (fed->ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    int node = fed->ring[lo == fed->ring_size ? 0 : lo].node;
+    pthread_rwlock_unlock(&fed->ring_lock);
+    return node;
+}
+
+// point a new user at its owner node; returns 0 if it belongs here
+int fed_redirect(server_context_t *ctx, const char *name, struct sockaddr_in *client_addr)
+{
+    if (ctx->fed == NULL) {
+        return 0;
+    }
+    int owner = ring_owner(ctx->fed, name);
+    if (owner < 0) {
+        return 0;
+    }
+
+    char response[64];
+    int n = snprintf(response, sizeof(response), REDIRECT_TAG "%s", ctx->fed->peers[owner].name);
+    udp_socket_write(ctx->sd, client_addr, response, n + 1);
+    return 1;
+}
+
+// where$<name> or where$#<room>: which node a name is placed on
+void handle_where(server_context_t *ctx, struct sockaddr_in *client_addr, const char *key)
+{
+    struct Node *client = find_client_by_addr(ctx, client_addr);
+    if (client == NULL) {
+        return;
+    }
+
+    const char *node = "this server";
+    if (ctx->fed) {
+        int owner = ring_owner(ctx->fed, key);
+        node = owner < 0 ? ctx->fed->self : ctx->fed->peers[owner].name;
+    }
+
+    char response[BUFFER_SIZE];
+    snprintf(response, sizeof(response), "%s is placed on %s", key, node);
+    send_to_client(ctx, client, response);
+}
+
+static void fed_hello(server_context_t *ctx, struct Peer *peer)
+{
+    char buffer[64];
+    int n = snprintf(buffer, sizeof(buffer), FED_TAG "hello$%s", ctx->fed->self);
+    // heartbeats are sent bare: a lost one is simply replaced by the next
+    udp_socket_write(ctx->sd, &peer->addr, buffer, n + 1);
+}
+
+// fed_peer_up and fed_peer_down run on fed_thread only, so a transition
+// and the ring rebuild, roster send or remote-user drop that goes with it
+// are never interleaved with the opposite one
+static void fed_peer_up(server_context_t *ctx, struct Peer *peer)
+{
+    __atomic_store_n(&peer->alive, 1, __ATOMIC_RELEASE);
+    ring_rebuild(ctx->fed);
+    alog_info("Peer %s is up\n", peer->name);
+    fed_send_roster(ctx, peer);
+}
+
+static void fed_peer_down(server_context_t *ctx, struct Peer *peer)
+{
+    __atomic_store_n(&peer->alive, 0, __ATOMIC_RELEASE);
+    ring_rebuild(ctx->fed);
+    alog_info("Peer %s is down\n", peer->name);
+    remote_users_drop_peer(ctx->fed, (int)(peer - ctx->fed->peers));
+}
+
+// split off the next '$'-separated field of a fed$ message
+static char *fed_field(char **rest)
+{
+    char *field = *rest;
+    char *sep = field ? strchr(field, '$') : NULL;
+    if (!sep) {
+        *rest = NULL;
+        return NULL;
+    }
+    *sep = '\0';
+    *rest = sep + 1;
+    return field;
+}
+
+static void handle_peer_message(server_context_t *ctx, struct Peer *peer, char *msg)
+{
+    if (strncmp(msg, FED_TAG, FED_TAG_LEN) != 0) {
+        return;
+    }
+    char *rest = msg + FED_TAG_LEN;
+    char *kind = fed_field(&rest);
+    if (!kind) {
+        return;
+    }
+    int peer_idx = (int)(peer - ctx->fed->peers);
+
+    if (strcmp(kind, "say") == 0) {
+        char *sender = fed_field(&rest);
+        if (sender) publish_global(ctx, sender, rest);
+    }
+    else if (strcmp(kind, "room") == 0) {
+        char *room = fed_field(&rest);
+        char *sender = fed_field(&rest);
+        if (sender) publish_room(ctx, room, sender, rest);
+    }
+    else if (strcmp(kind, "pub") == 0) {
+        char *topic = fed_field(&rest);
+        char *sender = fed_field(&rest);
+        if (sender) publish_topic(ctx, topic, sender, rest);
+    }
+    else if (strcmp(kind, "sayto") == 0) {
+        char *recipient = fed_field(&rest);
+        char *sender = fed_field(&rest);
+        if (sender && !deliver_sayto(ctx, sender, recipient, rest)) {
+            mailbox_put(ctx, recipient, sender, rest);  // they left meanwhile
+        }
+    }
+    else if (strcmp(kind, "pres") == 0) {
+        char *change = fed_field(&rest);
+        if (!change || !rest) return;
+        if (change[0] == '+') remote_user_add(ctx->fed, rest, peer_idx);
+        else remote_user_remove(ctx->fed, rest, peer_idx);
+    }
+    else if (strcmp(kind, "roster") == 0) {
+        for (char *name = strtok(rest, "\n"); name != NULL; name = strtok(NULL, "\n")) {
+            remote_user_add(ctx->fed, name, peer_idx);
+        }
+    }
+}
+
+static void deliver_peer_message(void *arg, char *msg)
+{
+    void **a = (void **)arg;
+    handle_peer_message((server_context_t *)a[0], (struct Peer *)a[1], msg);
+}
+
+// handle a datagram if it came from a peer; returns 0 for client traffic
+int fed_receive(server_context_t *ctx, struct sockaddr_in *from, char *buffer, int n)
+{
+    struct Peer *peer = NULL;
+    for (int i = 0; i < ctx->fed->peer_count; i++) {
+        struct Peer *p = &ctx->fed->peers[i];
+        if (p->addr.sin_addr.s_addr == from->sin_addr.s_addr && p->addr.sin_port == from->sin_port) {
+            peer = p;
+            break;
+        }
+    }
+    if (peer == NULL) {
+        return 0;
+    }
+
+    __atomic_store_n(&peer->last_heard_us, udp_now_us(), __ATOMIC_RELAXED);
+
+    char *payload;
+    int len = rel_receive(&peer->rel, ctx->sd, from, buffer, n, &payload);
+    if (len <= 0) {
+        return 1;
+    }
+    char *msg;
+    len = frag_receive(&ctx->frags, from, payload, len, &msg);
+    if (len > 0) {
+        void *arg[2] = { ctx, peer };
+        udp_for_each_message(msg, len, deliver_peer_message, arg);
+    }
+    return 1;
+}
+
+// heartbeats and peer liveness
+void *fed_thread(void *arg)
+{
+    server_context_t *ctx = (server_context_t *)arg;
+
+    stats_register("fed");
+
+    while (ctx->running) {
+        long long now = udp_now_us();
+        for (int i = 0; i < ctx->fed->peer_count; i++) {
+            struct Peer *peer = &ctx->fed->peers[i];
+            fed_hello(ctx, peer);
+            long long heard = __atomic_load_n(&peer->last_heard_us, __ATOMIC_RELAXED);
+            int fresh = heard != 0 && now - heard <= FED_PEER_TIMEOUT_MS * 1000LL;
+            if (fresh && !peer->alive) {
+                fed_peer_up(ctx, peer);
+            }
+            else if (!fresh && peer->alive) {
+                fed_peer_down(ctx, peer);
+            }
+        }
+        usleep(FED_HELLO_MS * 1000);
+    }
+
+    return NULL;
+}
+
+// add a peer given as "ip:port"
+int fed_add_peer(server_context_t *ctx, const char *spec)
+{
+    struct Federation *fed = ctx->fed;
+    if (fed->peer_count >= MAX_PEERS) {
+        return -1;
+    }
+
+    char ip[32];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon - spec >= (long)sizeof(ip)) {
+        return -1;
+    }
+    memcpy(ip, spec, colon - spec);
+    ip[colon - spec] = '\0';
+
+    struct Peer *peer = &fed->peers[fed->peer_count];
+    memset(peer, 0, sizeof(*peer));
+    if (set_socket_addr(&peer->addr, ip, atoi(colon + 1)) < 0) {
+        return -1;
+    }
+    // canonical "a.b.c.d:port", so every node hashes the same ring
+    snprintf(peer->name, sizeof(peer->name), "%s:%d", inet_ntoa(peer->addr.sin_addr), ntohs(peer->addr.sin_port));
+    rel_init(&peer->rel);
+    fed->peer_count++;
+    return 0;
+}
+
+// tokenise request and use handle_... functions to handle the request
+void handle_request(server_context_t *ctx, struct sockaddr_in *client_addr, char *client_request, int length)
+{
+    char *command = NULL;
+    char *content = NULL;
+
+    uint64_t t = stats_now();
+    trace_req.parse = t;
+    trace_req.id = 0;
+    if (thread_stats && thread_stats->request_start) {
+        hist_record(&thread_stats->stages[STAGE_RECEIVE], t - thread_stats->request_start);
+    }
+    parse_request(client_request, &command, &content);
+    stats_record(STAGE_PARSE, t);
+
+    if (command == NULL) {
+        return;
+    }
+    stats_count_command(command);
+
+    t = stats_now();
+    trace_req.lock = t;
+    PROFILED_WRLOCK(&ctx->clients_lock);
+    stats_record(STAGE_LOCK, t);
+    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
+    time_t now = time(NULL);
+    if (client) {
+        client->last_active = now;
+        client->awaiting_ping_reply = 0;
+        client->ping_sent_time = 0;
+        if (client->heap_index >= 0) {
+            heap_update(ctx, client);
+        }
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+
+    t = stats_now();
+    trace_req.handler = t;
+    if (strcmp(command, "conn") == 0) {
+        handle_conn(ctx, client_addr, content);
+    } 
+    else if (strcmp(command, "say") == 0 && content[0] == '#') {
+        handle_room_say(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "say") == 0) {
+        handle_say(ctx, client_addr, content);
+    } 
+    else if (strcmp(command, "join") == 0) {
+        handle_join(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "leave") == 0) {
+        handle_leave(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "sayto") == 0) {
+        handle_sayto(ctx, client_addr, content);
+    } 
+    else if (strcmp(command, "disconn") == 0) {
+        handle_disconn(ctx, client_addr);
+    } 
+    else if (strcmp(command, "rename") == 0) {
+        handle_rename(ctx, client_addr, content);
+    } 
+    else if (strcmp(command, "mute") == 0) {
+        handle_mute(ctx, client_addr, content);
+    } 
+    else if (strcmp(command, "unmute") == 0) {
+        handle_unmute(ctx, client_addr, content);
+    } 
+    else if (strcmp(command, "kick") == 0) {
+        handle_kick(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "sub") == 0) {
+        handle_sub(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "unsub") == 0) {
+        handle_unsub(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "pub") == 0) {
+        handle_pub(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "who") == 0) {
+        handle_who(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "presence") == 0) {
+        handle_presence(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "where") == 0) {
+        handle_where(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "search") == 0) {
+        handle_search(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "stats") == 0) {
+        handle_stats(ctx, client_addr);
+    }
+    else if (strcmp(command, "locks") == 0) {
+        handle_locks(ctx, client_addr, content);
+    }
+    else if (strcmp(command, "trace") == 0) {
+        handle_trace(ctx, client_addr);
+    }
+    else if (strcmp(command, "ret-ping") == 0) {
+        handle_ret_ping(ctx, client_addr);
+    }
+    else {
+        char msg[BUFFER_SIZE];
+        snprintf(msg, sizeof(msg), "Invalid command: %s", command);
+        udp_socket_write(ctx->sd, client_addr, msg, BUFFER_SIZE);
+    }
+    stats_record(STAGE_HANDLER, t);
+    if (trace_req.id) {
+        trace_tick_span(trace_req.id, "handler", t, stats_now(), NULL);
+        trace_req.id = 0;
+    }
+    if (thread_stats && thread_stats->request_start) {
+        stats_record(STAGE_TOTAL, thread_stats->request_start);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// registry snapshots
+//
+// Every snapshot_interval_s the snapshot thread forks while holding the
+// clients read lock, the history lock and the mailboxes lock. The child owns
+// a copy-on-write image of the registry as it was at that instant; it
+// serialises it, writes "<path>.tmp", fsyncs and renames over <path>, while
+// the parent only waited for fork() itself. Listener requests are never blocked on disk I/O.
+// Another thread may have held the malloc lock at fork(), so the child
+// encodes into a buffer the parent allocated beforehand; if that turns out
+// too small the child gives up and the parent retries with twice the room.
+//
+// File layout (host byte order, the file is only read back on this host):
+//   snap_header_t
+//   per client: snap_client_t, muted names, room names (MAX_NAME_LEN each)
+//   per history line: uint64 id, uint32 len, len bytes (with NUL)
+//   uint32 mail count, then per queued offline message: recipient
+//   (MAX_NAME_LEN), int64 queued_at, uint32 len, len bytes (with NUL);
+//   older snapshots end before this and restore no mail
+// ---------------------------------------------------------------------------
+
+#define SNAP_MAGIC 0x50414e5354414843ULL   // "CHATSNAP"
+#define SNAP_VERSION 1
+#define SNAP_RESERVE_MIN (256 * 1024)
+#define SNAP_EXIT_FULL 2                    // child: the reserve was too small
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t client_count;
+    uint64_t next_msg_id;
+    uint32_t history_count;
+    uint32_t history_epoch;     // 0 in snapshots from before epochs
+} snap_header_t;
+
+typedef struct {
+    char name[MAX_NAME_LEN];
+    uint32_t ip;                // network order, as in sockaddr_in
+    uint16_t port;
+    uint8_t reliable;
+    uint8_t presence_sub;
+    uint64_t token;
+    int64_t last_active;
+    uint16_t muted_count;
+    uint16_t room_count;
+    uint32_t reserved;
+} snap_client_t;
+
+struct SnapBuf {
+    char *data;
+    size_t len, cap;
+    int fixed;          // never realloc, fail instead (in a forked child)
+};
+
+static int snap_put(struct SnapBuf *b, const void *data, size_t n)
+{
+    if (b->len + n > b->cap) {
+        if (b->fixed) return -1;
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + n) cap *= 2;
+        char *grown = realloc(b->data, cap);
+        if (!grown) return -1;
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+    return 0;
+}
+
+// serialise clients, history and mailboxes (hold clients_lock, history_lock
+// and the mailboxes lock)
+static int snapshot_encode(server_context_t *ctx, struct SnapBuf *b)
+{
+    snap_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAP_MAGIC;
+    header.version = SNAP_VERSION;
+    header.next_msg_id = ctx->next_msg_id;
+    header.history_epoch = ctx->history_epoch;
+    header.history_count = ctx->global_count;
+    for (struct Node *cur = ctx->clients_head; cur != NULL; cur = cur->next) {
+        header.client_count++;
+    }
+    if (snap_put(b, &header, sizeof(header)) < 0) return -1;
+
+    char name[MAX_NAME_LEN];
+    for (struct Node *cur = ctx->clients_head; cur != NULL; cur = cur->next) {
+        snap_client_t rec;
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.name, cur->client_name, MAX_NAME_LEN);
+        rec.ip = cur->addr.sin_addr.s_addr;
+        rec.port = cur->addr.sin_port;
+        rec.reliable = (uint8_t)cur->reliable;
+        rec.presence_sub = (uint8_t)cur->presence_sub;
+        rec.token = cur->token;
+        rec.last_active = cur->last_active;
+        rec.muted_count = (uint16_t)cur->muted_count;
+        rec.room_count = (uint16_t)cur->room_count;
+        if (snap_put(b, &rec, sizeof(rec)) < 0) return -1;
+        if (snap_put(b, cur->muted_names, (size_t)cur->muted_count * MAX_NAME_LEN) < 0) return -1;
+        for (int i = 0; i < cur->room_count; i++) {
+            memset(name, 0, sizeof(name));
+            memcpy(name, cur->rooms[i]->name, strnlen(cur->rooms[i]->name, MAX_NAME_LEN - 1));
+            if (snap_put(b, name, sizeof(name)) < 0) return -1;
+        }
+    }
+
+    for (int i = 0; i < ctx->global_count; i++) {
+        int idx = (ctx->global_start + i) % GLOBAL_BUFFER_SIZE;
+        uint64_t id = ctx->global_ids[idx];
+        uint32_t len = (uint32_t)strlen(ctx->global_buffer[idx]) + 1;
+        if (snap_put(b, &id, sizeof(id)) < 0 || snap_put(b, &len, sizeof(len)) < 0 ||
+            snap_put(b, ctx->global_buffer[idx], len) < 0) return -1;
+    }
+
+    struct Mailboxes *m = ctx->mailboxes;
+    uint32_t mail_count = 0;
+    for (int i = 0; i < MAILBOX_BUCKETS; i++) {
+        for (struct Mailbox *box = m->buckets[i]; box != NULL; box = box->next) {
+            mail_count += (uint32_t)box->count;
+        }
+    }
+    if (snap_put(b, &mail_count, sizeof(mail_count)) < 0) return -1;
+    for (int i = 0; i < MAILBOX_BUCKETS; i++) {
+        for (struct Mailbox *box = m->buckets[i]; box != NULL; box = box->next) {
+            for (struct MailItem *item = box->head; item != NULL; item = item->next) {
+                int64_t queued_at = item->queued_at;
+                uint32_t len = (uint32_t)strlen(item->line) + 1;
+                if (snap_put(b, box->name, MAX_NAME_LEN) < 0 || snap_put(b, &queued_at, sizeof(queued_at)) < 0 ||
+                    snap_put(b, &len, sizeof(len)) < 0 || snap_put(b, item->line, len) < 0) return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// rebuild clients and history from an encoded snapshot, before the
+// threads start; returns the number of clients restored or -1
+static int snapshot_decode(server_context_t *ctx, const char *data, size_t n)
+{
+    const char *p = data, *end = data + n;
+    snap_header_t header;
+    if (n < sizeof(header)) return -1;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    if (header.magic != SNAP_MAGIC || header.version != SNAP_VERSION) return -1;
+
+    int restored = 0;
+    for (uint32_t c = 0; c < header.client_count; c++) {
+        snap_client_t rec;
+        if ((size_t)(end - p) < sizeof(rec)) return -1;
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        size_t extra = ((size_t)rec.muted_count + rec.room_count) * MAX_NAME_LEN;
+        if (rec.muted_count > MAX_MUTED || rec.room_count > MAX_ROOMS_PER_CLIENT || (size_t)(end - p) < extra) return -1;
+        rec.name[MAX_NAME_LEN - 1] = '\0';
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = rec.ip;
+        addr.sin_port = rec.port;
+
+        struct Node *node = create_node(rec.name, &addr);
+        node->token = rec.token;
+        node->last_active = (time_t)rec.last_active;
+        node->reliable = rec.reliable;
+        node->presence_sub = rec.presence_sub;
+        memcpy(node->muted_names, p, (size_t)rec.muted_count * MAX_NAME_LEN);
+        node->muted_count = rec.muted_count;
+        p += (size_t)rec.muted_count * MAX_NAME_LEN;
+
+        node->next = ctx->clients_head;
+        ctx->clients_head = node;
+        ctx->client_count++;
+        heap_insert(ctx, node);
+        presence_join(ctx, node);
+
+        for (int i = 0; i < rec.room_count; i++) {
+            char room_name[MAX_NAME_LEN];
+            memcpy(room_name, p, MAX_NAME_LEN);
+            room_name[MAX_NAME_LEN - 1] = '\0';
+            p += MAX_NAME_LEN;
+            struct Room *room = room_acquire(ctx, room_name, 1);
+            if (room && room_add_member(room, node)) {
+                node->rooms[node->room_count++] = room;
+            }
+            else if (room) {
+                room_release(ctx, room);
+            }
+        }
+        restored++;
+    }
+
+    for (uint32_t h = 0; h < header.history_count; h++) {
+        uint64_t id;
+        uint32_t len;
+        if ((size_t)(end - p) < sizeof(id) + sizeof(len)) return -1;
+        memcpy(&id, p, sizeof(id));
+        memcpy(&len, p + sizeof(id), sizeof(len));
+        p += sizeof(id) + sizeof(len);
+        if (len == 0 || (size_t)(end - p) < len || p[len - 1] != '\0') return -1;
+        // with a log the history was already replayed from disk
+        if (ctx->log == NULL) {
+            char *line = strdup(p);
+            if (line) history_store(ctx, id, line);
+        }
+        p += len;
+    }
+
+    uint32_t mail_count = 0;
+    if ((size_t)(end - p) >= sizeof(mail_count)) {
+        memcpy(&mail_count, p, sizeof(mail_count));
+        p += sizeof(mail_count);
+    }
+    for (uint32_t i = 0; i < mail_count; i++) {
+        char recipient[MAX_NAME_LEN];
+        int64_t queued_at;
+        uint32_t len;
+        if ((size_t)(end - p) < MAX_NAME_LEN + sizeof(queued_at) + sizeof(len)) return -1;
+        memcpy(recipient, p, MAX_NAME_LEN);
+        recipient[MAX_NAME_LEN - 1] = '\0';
+        memcpy(&queued_at, p + MAX_NAME_LEN, sizeof(queued_at));
+        memcpy(&len, p + MAX_NAME_LEN + sizeof(queued_at), sizeof(len));
+        p += MAX_NAME_LEN + sizeof(queued_at) + sizeof(len);
+        if (len == 0 || (size_t)(end - p) < len || p[len - 1] != '\0') return -1;
+        mailbox_store(ctx, recipient, NULL, p, (time_t)queued_at);
+        p += len;
+    }
+
+    if (header.next_msg_id > ctx->next_msg_id) {
+        ctx->next_msg_id = header.next_msg_id;
+    }
+    if (ctx->log == NULL && header.history_epoch != 0) {
+        ctx->history_epoch = header.history_epoch;   // with a log, the log's epoch goes with its ids
+    }
+    return restored;
+}
+
+static int write_all(int fd, const char *data, size_t n)
+{
+    while (n > 0) {
+        ssize_t rc = write(fd, data, n);
+        if (rc < 0) return -1;
+        data += rc;
+        n -= (size_t)rc;
+    }
+    return 0;
+}
+
+// child side of a snapshot: runs on the forked copy and never returns.
+// b is the parent's reserve; nothing here may allocate
+static void snapshot_child(server_context_t *ctx, struct SnapBuf *b)
+{
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ctx->snapshot_path);
+
+    if (snapshot_encode(ctx, b) < 0) _exit(SNAP_EXIT_FULL);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) _exit(1);
+    if (write_all(fd, b->data, b->len) < 0 || fsync(fd) < 0) _exit(1);
+    close(fd);
+    if (rename(tmp, ctx->snapshot_path) < 0) _exit(1);
+    _exit(0);
+}
+
+void *snapshot_thread(void *arg)
+{
+    server_context_t *ctx = (server_context_t *)arg;
+    struct SnapBuf reserve = { NULL, 0, 0, 1 };
+    size_t want = SNAP_RESERVE_MIN;
+    int retry = 0;
+
+    while (ctx->running) {
+        for (int i = 0; i < ctx->snapshot_interval_s * 10 && ctx->running && !retry; i++) {
+            usleep(100000);
+        }
+        retry = 0;
+
+        if (reserve.cap < want) {
+            free(reserve.data);
+            reserve.data = malloc(want);
+            reserve.cap = reserve.data ? want : 0;
+            if (reserve.data == NULL) {
+                fprintf(stderr, "Snapshot buffer of %zu bytes unavailable\n", want);
+                continue;
+            }
+        }
+        reserve.len = 0;
+
+        // the locks are only held across fork(); the child keeps the
+        // copy-on-write image and does all the work
+        PROFILED_RDLOCK(&ctx->clients_lock);
+        pthread_mutex_lock(&ctx->history_lock);
+        pthread_mutex_lock(&ctx->mailboxes->lock);
+        pid_t pid = fork();
+        pthread_mutex_unlock(&ctx->mailboxes->lock);
+        pthread_mutex_unlock(&ctx->history_lock);
+        PROFILED_UNLOCK(&ctx->clients_lock);
+
+        if (pid == 0) {
+            snapshot_child(ctx, &reserve);
+        }
+        if (pid < 0) {
+            perror("snapshot fork");
+            continue;
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == SNAP_EXIT_FULL) {
+            want = reserve.cap * 2;
+            retry = 1;
+        }
+        else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Snapshot to %s failed\n", ctx->snapshot_path);
+        }
+    }
+
+    free(reserve.data);
+    return NULL;
+}
+
+// load the last snapshot, if any; runs before the threads start
+void snapshot_load(server_context_t *ctx)
+{
+    int fd = open(ctx->snapshot_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    long long start = udp_now_us();
+    struct SnapBuf b = { NULL, 0, 0, 0 };
+    char chunk[65536];
+    ssize_t rc;
+    while ((rc = read(fd, chunk, sizeof(chunk))) > 0) {
+        if (snap_put(&b, chunk, (size_t)rc) < 0) break;
+    }
+    close(fd);
+
+    int restored = snapshot_decode(ctx, b.data, b.len);
+    free(b.data);
+    if (restored < 0) {
+        fprintf(stderr, "Ignoring damaged snapshot %s\n", ctx->snapshot_path);
+        return;
+    }
+    alog_info("Restored %d sessions from %s in %.3f ms\n", restored, ctx->snapshot_path,
+           (udp_now_us() - start) / 1000.0);
+}
+
+// ---------------------------------------------------------------------------
+// hot restart
+//
+// With -H <path> a server accepts successors on a unix socket at <path>. A
+// new process started with the same -H first tries to connect there. If an
+// old server answers, the old listener stops reading, flushes what it has
+// queued for clients, and sends over the connection:
+//   handover_msg_t, with the bound UDP socket attached (SCM_RIGHTS)
+//   the encoded registry and history (snapshot_encode)
+// then exits. The new process serves the same socket, so datagrams that
+// arrive in between wait in the kernel queue instead of being lost.
+// ---------------------------------------------------------------------------
+
+#define HANDOVER_MAGIC 0x524556444e414843ULL   // "CHANDVER"
+
+typedef struct {
+    uint64_t magic;
+    uint64_t state_len;
+    uint64_t drops;             // kernel drop count on the socket at handover
+    int64_t started_us;         // CLOCK_MONOTONIC, same clock in both processes
+} handover_msg_t;
+
+// datagrams the kernel dropped on this socket because its queue was full
+static long long udp_socket_drops(int sd)
+{
+    struct stat st;
+    if (fstat(sd, &st) < 0) return -1;
+
+    FILE *f = fopen("/proc/net/udp", "r");
+    if (!f) return -1;
+    char line[512];
+    long long drops = -1;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long inode;
+        long long d;
+        // sl local rem st tx:rx tr:when retrnsmt uid timeout inode ref pointer drops
+        if (sscanf(line, " %*d: %*x:%*x %*x:%*x %*x %*x:%*x %*x:%*x %*x %*u %*d %lu %*d %*x %lld",
+                   &inode, &d) == 2 && inode == (unsigned long)st.st_ino) {
+            drops = d;
+            break;
+        }
+    }
+    fclose(f);
+    return drops;
+}
+
+static void handover_flush_clients(server_context_t *ctx)
+{
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    for (struct Node *cur = ctx->clients_head; cur != NULL; cur = cur->next) {
+        pthread_mutex_lock(&cur->out_lock);
+        flush_client_locked(ctx, cur);
+        pthread_mutex_unlock(&cur->out_lock);
+    }
+    PROFILED_UNLOCK(&ctx->clients_lock);
+}
+
+// send all of data on the handover connection; a successor that went away
+// is an error here, not a SIGPIPE
+static int handover_send_all(int fd, const char *data, size_t n)
+{
+    while (n > 0) {
+        ssize_t rc = send(fd, data, n, MSG_NOSIGNAL);
+        if (rc < 0) return -1;
+        data += rc;
+        n -= (size_t)rc;
+    }
+    return 0;
+}
+
+// a handover that went wrong: drop the connection and go on serving; the
+// handover thread accepts the next successor
+static int handover_abort(server_context_t *ctx, int fd, const char *why)
+{
+    fprintf(stderr, "Handover failed (%s), still serving\n", why);
+    close(fd);
+    ctx->handover_fd = -1;
+    return -1;
+}
+
+// old process: give the socket and our state to the successor (listener
+// thread). Returns 0 once the successor has confirmed, -1 if we go on
+int handover_serve(server_context_t *ctx)
+{
+    int fd = ctx->handover_fd;
+    long long started = udp_now_us();
+
+    handover_flush_clients(ctx);
+    if (ctx->log) {
+        msglog_commit(ctx->log);
+    }
+
+    struct SnapBuf state = { NULL, 0, 0, 0 };
+    PROFILED_RDLOCK(&ctx->clients_lock);
+    pthread_mutex_lock(&ctx->history_lock);
+    pthread_mutex_lock(&ctx->mailboxes->lock);
+    int rc = snapshot_encode(ctx, &state);
+    pthread_mutex_unlock(&ctx->mailboxes->lock);
+    pthread_mutex_unlock(&ctx->history_lock);
+    PROFILED_UNLOCK(&ctx->clients_lock);
+    if (rc < 0) {
+        free(state.data);
+        return handover_abort(ctx, fd, "out of memory");
+    }
+
+    handover_msg_t msg;
+    msg.magic = HANDOVER_MAGIC;
+    msg.state_len = state.len;
+    msg.drops = (uint64_t)udp_socket_drops(ctx->sd);
+    msg.started_us = started;
+
+    struct iovec iov = { &msg, sizeof(msg) };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &ctx->sd, sizeof(int));
+
+    if (sendmsg(fd, &mh, MSG_NOSIGNAL) != sizeof(msg) || handover_send_all(fd, state.data, state.len) < 0) {
+        const char *why = strerror(errno);
+        free(state.data);
+        return handover_abort(ctx, fd, why);
+    }
+    free(state.data);
+
+    // wait for the successor to confirm before we let go of anything
+    char ack;
+    if (read(fd, &ack, 1) != 1) {
+        return handover_abort(ctx, fd, "successor went away");
+    }
+    close(fd);
+    alog_info("Handed over to new server after %.3f ms\n", (udp_now_us() - started) / 1000.0);
+    ctx->running = 0;
+    return 0;
+}
+
+// new process: take the socket and state from a running server, or return
+// -1 if none is listening on path
+int handover_receive(const char *path, struct SnapBuf *state, handover_msg_t *msg, int *conn)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct iovec iov = { msg, sizeof(*msg) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &mh, MSG_WAITALL) != sizeof(*msg) || msg->magic != HANDOVER_MAGIC) {
+        close(fd);
+        return -1;
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    if (cm == NULL || cm->cmsg_type != SCM_RIGHTS) {
+        close(fd);
+        return -1;
+    }
+    int sd;
+    memcpy(&sd, CMSG_DATA(cm), sizeof(int));
+
+    state->len = 0;
+    while (state->len < msg->state_len) {
+        char chunk[65536];
+        size_t want = msg->state_len - state->len;
+        ssize_t rc = read(fd, chunk, want < sizeof(chunk) ? want : sizeof(chunk));
+        if (rc <= 0 || snap_put(state, chunk, (size_t)rc) < 0) {
+            close(fd);
+            close(sd);
+            return -1;
+        }
+    }
+    *conn = fd;
+    return sd;
+}
+
+// accept successors on ctx->handover_path, one at a time; the listener does
+// the handover
+void *handover_thread(void *arg)
+{
+    server_context_t *ctx = (server_context_t *)arg;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", ctx->handover_path);
+    unlink(ctx->handover_path);   // a predecessor's socket, or a stale one
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("handover socket");
+        return NULL;
+    }
+
+    while (ctx->running) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            perror("handover accept");
+            break;
+        }
+        ctx->handover_fd = conn;
+        // the listener either hands over (and we stop running) or gives up
+        // on this successor and sets handover_fd back to -1
+        while (ctx->running && ctx->handover_fd >= 0) {
+            usleep(100000);
+        }
+    }
+    close(fd);
+    return NULL;
 }
 
-// send a message to one person (don't store in global buffer)
-void handle_sayto(server_context_t *ctx, struct sockaddr_in *client_addr, char *content)
+// group commit: flush everything logged since the last pass in one msync
+void *log_sync_thread(void *arg)
 {
-    struct Node *sender = find_client_by_addr(ctx, client_addr);
-    const char *sender_name = sender ? sender->client_name : "Unknown";
+    server_context_t *ctx = (server_context_t *)arg;
 
-    char *space = strchr(content, ' ');
-    if (!space) {
-        return;
+    while (ctx->running) {
+        usleep(ctx->sync_ms * 1000);
+        msglog_commit(ctx->log);
     }
-    *space = '\0';
-    char *recipient_name = content;
-    char *msg = space + 1;
 
-    struct Node *recipient = find_client_by_name(ctx, recipient_name);
-    if (!recipient) {
+    return NULL;
+}
+
+static void replay_logged_message(void *arg, uint64_t id, const char *line)
+{
+    server_context_t *ctx = (server_context_t *)arg;
+    size_t len = MSG_TAG_LEN + 22 + strlen(line);
+    char *buffer = malloc(len);
+    if (!buffer) {
         return;
     }
+    snprintf(buffer, len, MSG_TAG "%llu$%s", (unsigned long long)id, line);
+    history_store(ctx, id, buffer);
+}
 
-    if (is_muted(recipient, sender_name)) {
+// refill the in-memory history from the log and continue its numbering
+void replay_log(server_context_t *ctx)
+{
+    ctx->history_epoch = ctx->log->epoch;
+
+    uint64_t oldest, newest;
+    msglog_bounds(ctx->log, &oldest, &newest);
+    if (newest == 0) {
         return;
     }
 
-    char buffer[BUFFER_SIZE];
-    snprintf(buffer, sizeof(buffer), "%s: %s", sender_name, msg);
-    send_to_client(ctx, recipient, buffer);
+    uint64_t from = newest >= GLOBAL_BUFFER_SIZE ? newest - GLOBAL_BUFFER_SIZE + 1 : 1;
+    msglog_read_from(ctx->log, from, GLOBAL_BUFFER_SIZE, replay_logged_message, ctx);
+    ctx->next_msg_id = newest;
+    alog_info("Replayed log: messages %llu..%llu\n", (unsigned long long)oldest, (unsigned long long)newest);
 }
 
-// disconnect client (client will also do a local disconnect)
-void handle_disconn(server_context_t *ctx, struct sockaddr_in *client_addr)
+// ---------------------------------------------------------------------------
+// metrics
+//
+// -M serves a Prometheus text dump on a local socket: a port number means
+// UDP on 127.0.0.1, where any datagram is answered with the dump split at
+// line boundaries and ended by "# EOF"; a path means a unix stream socket
+// that writes the dump to each connection and closes it. Counters are the
+// per-thread ones in ThreadStats, summed here when someone asks, so the
+// data path never does more than a plain increment for them. Gauges are
+// read without locks and may be a moment out of date.
+// ---------------------------------------------------------------------------
+
+static long long metrics_started_us;
+
+static void metrics_printf(struct SnapBuf *b, const char *fmt, ...)
 {
-    pthread_rwlock_wrlock(&ctx->clients_lock);
-    struct Node *prev = NULL;
-    struct Node *cur = ctx->clients_head;
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n > 0) snap_put(b, line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
 
-    while (cur != NULL) {
-        if (cur->addr.sin_addr.s_addr == client_addr->sin_addr.s_addr &&
-            cur->addr.sin_port        == client_addr->sin_port) {
+static void metrics_family(struct SnapBuf *b, const char *name, const char *type, const char *help)
+{
+    metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
 
-            if (prev == NULL) ctx->clients_head = cur->next;
+static void metrics_render(server_context_t *ctx, struct SnapBuf *b)
+{
+    unsigned long packets_in = 0, packets_out = 0, send_errors = 0, loss_dropped = 0;
+    unsigned long long bytes_in = 0, bytes_out = 0;
+    unsigned long commands[STAT_COMMANDS + 1] = { 0 };
+    pthread_mutex_lock(&all_stats_lock);
+    for (struct ThreadStats *ts = all_stats; ts != NULL; ts = ts->next) {
+        packets_in += ts->packets_in;
+        bytes_in += ts->bytes_in;
+        packets_out += ts->udp.packets_out;
+        bytes_out += ts->udp.bytes_out;
+        send_errors += ts->udp.send_errors;
+        loss_dropped += ts->udp.loss_dropped;
+        for (int c = 0; c <= STAT_COMMANDS; c++) commands[c] += ts->commands[c];
+    }
+    pthread_mutex_unlock(&all_stats_lock);
 
-            else prev->next = cur->next;
-                
+    unsigned long log_dropped = 0;
+    for (alog_ring_t *r = __atomic_load_n(&alog.rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        log_dropped += r->dropped;
+    }
 
-            char name[MAX_NAME_LEN];
-            strncpy(name, cur->client_name, MAX_NAME_LEN);
-            heap_remove(ctx, cur);
-            free(cur);
-            pthread_rwlock_unlock(&ctx->clients_lock);
+    metrics_family(b, "chat_uptime_seconds", "gauge", "Seconds since the server started.");
+    metrics_printf(b, "chat_uptime_seconds %.3f\n", (udp_now_us() - metrics_started_us) / 1e6);
 
-            char response[BUFFER_SIZE];
-            snprintf(response, sizeof(response), "Disconnected. Bye! (%s)", name);
-            udp_socket_write(ctx->sd, client_addr, response, BUFFER_SIZE);
-            return;
-        }
-        prev = cur;
-        cur = cur->next;
+    metrics_family(b, "chat_packets_received_total", "counter", "Datagrams read from the chat socket.");
+    metrics_printf(b, "chat_packets_received_total %lu\n", packets_in);
+    metrics_family(b, "chat_bytes_received_total", "counter", "Bytes read from the chat socket.");
+    metrics_printf(b, "chat_bytes_received_total %llu\n", bytes_in);
+    metrics_family(b, "chat_packets_sent_total", "counter", "Datagrams handed to the kernel.");
+    metrics_printf(b, "chat_packets_sent_total %lu\n", packets_out);
+    metrics_family(b, "chat_bytes_sent_total", "counter", "Bytes handed to the kernel.");
+    metrics_printf(b, "chat_bytes_sent_total %llu\n", bytes_out);
+    metrics_family(b, "chat_send_errors_total", "counter", "Datagrams the kernel refused to send.");
+    metrics_printf(b, "chat_send_errors_total %lu\n", send_errors);
+
+    metrics_family(b, "chat_drops_total", "counter", "Work the server gave up on instead of waiting.");
+    metrics_printf(b, "chat_drops_total{reason=\"injected_loss\"} %lu\n", loss_dropped);
+    metrics_printf(b, "chat_drops_total{reason=\"log_ring_full\"} %lu\n", log_dropped);
+    metrics_printf(b, "chat_drops_total{reason=\"search_queue_full\"} %lu\n", ctx->search->dropped);
+
+    long long overflows = udp_socket_drops(ctx->sd);
+    if (overflows >= 0) {
+        metrics_family(b, "chat_receive_queue_overflows_total", "counter",
+                       "Datagrams the kernel dropped because the socket's receive queue was full.");
+        metrics_printf(b, "chat_receive_queue_overflows_total %lld\n", overflows);
     }
 
-    pthread_rwlock_unlock(&ctx->clients_lock);
+    metrics_family(b, "chat_clients", "gauge", "Connected clients.");
+    metrics_printf(b, "chat_clients %d\n", ctx->client_count);
+    metrics_family(b, "chat_activity_heap_size", "gauge", "Clients in the inactivity heap.");
+    metrics_printf(b, "chat_activity_heap_size %d\n", ctx->heap_size);
+    metrics_family(b, "chat_activity_heap_capacity", "gauge", "Slots allocated for the inactivity heap.");
+    metrics_printf(b, "chat_activity_heap_capacity %d\n", ctx->heap_cap);
+    metrics_family(b, "chat_history_depth", "gauge", "Global messages held in the history ring.");
+    metrics_printf(b, "chat_history_depth %d\n", ctx->global_count);
+    metrics_family(b, "chat_messages_total", "counter", "Global messages published (the newest id).");
+    metrics_printf(b, "chat_messages_total %llu\n", (unsigned long long)ctx->next_msg_id);
+
+    metrics_family(b, "chat_requests_total", "counter", "Requests handled, by command.");
+    for (int c = 0; c <= STAT_COMMANDS; c++) {
+        metrics_printf(b, "chat_requests_total{command=\"%s\"} %lu\n",
+                       c < STAT_COMMANDS ? stat_commands[c] : "other", commands[c]);
+    }
+    metrics_printf(b, "# EOF\n");
 }
 
-// change client name in linked list
-void handle_rename(server_context_t *ctx, struct sockaddr_in *client_addr, const char *new_name)
+// "9100" -> UDP on 127.0.0.1:9100, anything else -> unix socket at that path
+int metrics_open(server_context_t *ctx, const char *spec)
 {
-    pthread_rwlock_wrlock(&ctx->clients_lock);
-    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
-    if (client) {
-        strncpy(client->client_name, new_name, MAX_NAME_LEN - 1);
-        client->client_name[MAX_NAME_LEN - 1] = '\0';
+    char *end;
+    long port = strtol(spec, &end, 10);
+    if (*spec != '\0' && *end == '\0') {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0 || port <= 0 || port > 65535) {
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        set_socket_addr(&addr, "127.0.0.1", (int)port);
+        int one = 1;   // a hot restart successor binds while we still have it
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        ctx->metrics_sd = fd;
+        ctx->metrics_stream = 0;
+        return 0;
     }
-    pthread_rwlock_unlock(&ctx->clients_lock);
 
-    if (client) {
-        char response[BUFFER_SIZE];
-        snprintf(response, sizeof(response), "You are now known as %s", client->client_name);
-        send_to_client(ctx, client, response);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", spec);
+    unlink(spec);   // a predecessor's socket, or a stale one
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
     }
+    ctx->metrics_sd = fd;
+    ctx->metrics_stream = 1;
+    return 0;
 }
 
-// mute other clients
-void handle_mute(server_context_t *ctx, struct sockaddr_in *client_addr, const char *name)
+// answer one scrape over UDP, cutting the dump after whole lines
+static void metrics_send_datagrams(int fd, struct sockaddr_in *to, const struct SnapBuf *dump)
 {
-    pthread_rwlock_wrlock(&ctx->clients_lock);
-    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
-    if (client) {
-        add_mute(client, name);
+    size_t off = 0;
+    while (off < dump->len) {
+        size_t n = dump->len - off;
+        if (n > UDP_PAYLOAD_MAX) {
+            n = UDP_PAYLOAD_MAX;
+            while (n > 0 && dump->data[off + n - 1] != '\n') n--;
+            if (n == 0) n = UDP_PAYLOAD_MAX;
+        }
+        sendto(fd, dump->data + off, n, 0, (struct sockaddr *)to, sizeof(*to));
+        off += n;
     }
-    pthread_rwlock_unlock(&ctx->clients_lock);
 }
 
-// unmute other clients
-void handle_unmute(server_context_t *ctx, struct sockaddr_in *client_addr, const char *name)
+void *metrics_thread(void *arg)
 {
-    pthread_rwlock_wrlock(&ctx->clients_lock);
-    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
-    if (client) {
-        remove_mute(client, name);
+    server_context_t *ctx = (server_context_t *)arg;
+    struct pollfd pfd = { ctx->metrics_sd, POLLIN, 0 };
+
+    while (ctx->running) {
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0) {
+            continue;
+        }
+
+        struct SnapBuf dump = { NULL, 0, 0, 0 };
+        if (ctx->metrics_stream) {
+            int conn = accept(ctx->metrics_sd, NULL, NULL);
+            if (conn < 0) continue;
+            metrics_render(ctx, &dump);
+            size_t off = 0;
+            while (off < dump.len) {
+                ssize_t w = write(conn, dump.data + off, dump.len - off);
+                if (w <= 0) break;
+                off += (size_t)w;
+            }
+            close(conn);
+        }
+        else {
+            char request[64];
+            struct sockaddr_in from;
+            if (udp_socket_read(ctx->metrics_sd, &from, request, sizeof(request)) < 0) continue;
+            metrics_render(ctx, &dump);
+            metrics_send_datagrams(ctx->metrics_sd, &from, &dump);
+        }
+        free(dump.data);
     }
-    pthread_rwlock_unlock(&ctx->clients_lock);
+
+    return NULL;
 }
 
-// if admin (server port = 6666), kick, otherwise don't
-void handle_kick(server_context_t *ctx, struct sockaddr_in *client_addr, const char *name)
+// everything a context needs before handle_request can run; the optional
+// parts (log, federation, snapshots, capture, handover) start out off
+void server_context_init(server_context_t *ctx, int sd, int coalesce_ms)
 {
-    if (client_addr->sin_port != htons(6666)) {
-        char msg[BUFFER_SIZE];
-        snprintf(msg, sizeof(msg), "You are not authorized to kick users.");
-        udp_socket_write(ctx->sd, client_addr, msg, BUFFER_SIZE);
-        return;
+    ctx->sd = sd;
+    ctx->running = 1;
+    ctx->clients_head = NULL;
+    pthread_rwlock_init(&ctx->clients_lock, NULL);
+    ctx->global_count = 0;
+    ctx->global_start = 0;
+    ctx->next_msg_id = 0;
+    do {
+        ctx->history_epoch = (uint32_t)udp_random64();
+    } while (ctx->history_epoch == 0);
+    pthread_mutex_init(&ctx->history_lock, NULL);
+    ctx->activity_heap = NULL;
+    ctx->heap_size = 0;
+    ctx->heap_cap = 0;
+    ctx->coalesce_ms = coalesce_ms < 0 ? 0 : coalesce_ms;
+    pthread_mutex_init(&ctx->outbound_lock, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->outbound_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    ctx->outbound_due = LLONG_MAX;
+    ctx->rel_request = 0;
+    frag_table_init(&ctx->frags);
+    ctx->next_frag_id = 1;
+    ctx->rooms = calloc(ROOM_BUCKETS, sizeof(struct RoomBucket));
+    assert(ctx->rooms != NULL);
+    for (int i = 0; i < ROOM_BUCKETS; i++) {
+        pthread_mutex_init(&ctx->rooms[i].lock, NULL);
     }
 
-    pthread_rwlock_wrlock(&ctx->clients_lock);
-    struct Node *prev = NULL;
-    struct Node *cur = ctx->clients_head;
+    ctx->topics = calloc(1, sizeof(struct TopicTree));
+    assert(ctx->topics != NULL);
+    pthread_rwlock_init(&ctx->topics->lock, NULL);
 
-    while (cur != NULL) {
-        if (strcmp(cur->client_name, name) == 0) {
+    ctx->mailboxes = calloc(1, sizeof(struct Mailboxes));
+    assert(ctx->mailboxes != NULL);
+    pthread_mutex_init(&ctx->mailboxes->lock, NULL);
 
-            if (prev == NULL) ctx->clients_head = cur->next;
+    ctx->search = calloc(1, sizeof(struct Search));
+    assert(ctx->search != NULL);
+    pthread_rwlock_init(&ctx->search->lock, NULL);
 
-            else prev->next = cur->next;
+    ctx->presence = calloc(1, sizeof(struct Presence));
+    assert(ctx->presence != NULL);
+    pthread_mutex_init(&ctx->presence->lock, NULL);
 
-            struct sockaddr_in kicked_addr = cur->addr;
-            heap_remove(ctx, cur);
-            free(cur);
-            pthread_rwlock_unlock(&ctx->clients_lock);
+    ctx->log = NULL;
+    ctx->sync_ms = DEFAULT_SYNC_MS;
+    ctx->fed = NULL;
+    ctx->capture = NULL;
+    ctx->client_count = 0;
+    ctx->metrics_sd = -1;
+    ctx->metrics_stream = 0;
+    ctx->snapshot_path = NULL;
+    ctx->snapshot_interval_s = DEFAULT_SNAPSHOT_S;
+    ctx->handover_path = NULL;
+    ctx->handover_fd = -1;
+}
 
-            char msg_kicked[BUFFER_SIZE];
-            snprintf(msg_kicked, sizeof(msg_kicked), "You have been removed from the chat");
-            udp_socket_write(ctx->sd, &kicked_addr, msg_kicked, BUFFER_SIZE);
+#ifndef CHAT_SERVER_NO_MAIN   // server_bench.c and chat_replay.c include this file for its internals
 
-            char msg_bcast[BUFFER_SIZE];
-            snprintf(msg_bcast, sizeof(msg_bcast), "%s has been removed from the chat", name);
-            broadcast_message(ctx, NULL, msg_bcast);
-            return;
+// initialise server
+// usage: chat_server [-c coalesce_ms] [-p port] [-a self_ip] [-f peer_ip:port]...
+//                    [-l log_dir] [-s sync_ms] [-S snapshot_file] [-i snapshot_s]
+//                    [-H handover_socket] [-L level] [-R n] [-C capture_file]
+//                    [-M metrics_port_or_path] [-T every:trace_file]
+//   -c  pack lines for the same client into one datagram, flushed after
+//       coalesce_ms or as soon as the datagram is full (default: off)
+//   -p  UDP port to serve on (default 12000)
+//   -a  address peers know us by (default 127.0.0.1)
+//   -f  federate with another chat_server; repeat for each peer
+//   -l  keep global messages in an on-disk log in this directory
+//   -s  flush the log to disk every sync_ms (default 100)
+//   -S  snapshot the client registry to this file and restore it at startup
+//   -i  seconds between snapshots (default 5)
+//   -H  hot restart: take over from the server listening on this unix
+//       socket if there is one, then listen there for our own successor
+//   -L  least severe log level printed: debug, info, warning, error or off
+//       (default info)
+//   -R  log only every n-th request received, 0 for none (default 1)
+//   -C  record every inbound datagram to this file for chat_replay (see
+//       dgcap.h); the file is overwritten, so a hot restart successor
+//       should be given a new one
+//   -M  serve metrics in Prometheus text format: a port number for UDP on
+//       127.0.0.1, or a path for a unix stream socket (see metrics_render)
+//   -T  trace every say$ whose message id is a multiple of every (see
+//       trace.h); the admin's trace$ appends the spans to trace_file, and
+//       chat_client -T with the same spec adds the clients' side
+int main(int argc, char *argv[])
+{
+    int coalesce_ms = 0;
+    int port = SERVER_PORT;
+    const char *self_ip = "127.0.0.1";
+    const char *peer_specs[MAX_PEERS];
+    int peer_specs_count = 0;
+    const char *log_dir = NULL;
+    int sync_ms = DEFAULT_SYNC_MS;
+    const char *snapshot_path = NULL;
+    int snapshot_s = DEFAULT_SNAPSHOT_S;
+    const char *handover_path = NULL;
+    const char *capture_path = NULL;
+    const char *metrics_spec = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:p:a:f:l:s:S:i:H:L:R:C:M:T:")) != -1) {
+        switch (opt) {
+        case 'c':
+            coalesce_ms = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'a':
+            self_ip = optarg;
+            break;
+        case 'f':
+            if (peer_specs_count < MAX_PEERS) {
+                peer_specs[peer_specs_count++] = optarg;
+            }
+            break;
+        case 'l':
+            log_dir = optarg;
+            break;
+        case 's':
+            sync_ms = atoi(optarg);
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'i':
+            snapshot_s = atoi(optarg);
+            break;
+        case 'H':
+            handover_path = optarg;
+            break;
+        case 'L':
+            alog.level = alog_parse_level(optarg);
+            if (alog.level < 0) {
+                fprintf(stderr, "Unknown log level %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            alog.sample_every = atoi(optarg);
+            break;
+        case 'C':
+            capture_path = optarg;
+            break;
+        case 'M':
+            metrics_spec = optarg;
+            break;
+        case 'T':
+            if (trace_init(optarg, "chat_server") < 0) {
+                fprintf(stderr, "Bad trace spec %s (want every:file)\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c coalesce_ms] [-p port] [-a self_ip] [-f peer_ip:port]... "
+                            "[-l log_dir] [-s sync_ms] [-S snapshot_file] [-i snapshot_s] [-H handover_socket] "
+                            "[-L level] [-R n] [-C capture_file] [-M metrics_port_or_path] [-T every:trace_file]\n", argv[0]);
+            return 1;
         }
-        prev = cur;
-        cur = cur->next;
     }
 
-    pthread_rwlock_unlock(&ctx->clients_lock);
-}
+    if (alog_start() != 0) {
+        fprintf(stderr, "Failed to create log writer thread\n");
+        return 1;
+    }
 
-void handle_ret_ping(server_context_t *ctx, struct sockaddr_in *client_addr)
-{
-    pthread_rwlock_wrlock(&ctx->clients_lock);
+    struct SnapBuf handover_state = { NULL, 0, 0, 0 };
+    handover_msg_t handover;
+    int handover_conn = -1;
+    int sd = -1;
+    if (handover_path) {
+        sd = handover_receive(handover_path, &handover_state, &handover, &handover_conn);
+    }
+    if (sd < 0) {
+        sd = udp_socket_open(port);
+        assert(sd > -1);
+        int rcvbuf = SERVER_RCVBUF;   // room to queue requests while a successor takes over
+        setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        alog_info("Chat server running on port %d...\n", port);
+    }
+    else {
+        alog_info("Took over the chat server socket from the previous process\n");
+    }
+    if (handover_path) {
+        struct timeval tv = { 0, HANDOVER_POLL_MS * 1000 };
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    if (tracer.every) {
+        int one = 1;   // kernel arrival times, for the "kernel queue" span
+        setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    }
 
-    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
-    if (client) {
-        client->last_active = time(NULL);
-        client->awaiting_ping_reply = 0;
-        client->ping_sent_time = 0;
+    server_context_t ctx;
+    server_context_init(&ctx, sd, coalesce_ms);
 
-        if (client->heap_index >= 0) {
-            heap_update(ctx, client);
+    ctx.sync_ms = sync_ms > 0 ? sync_ms : DEFAULT_SYNC_MS;
+    if (log_dir) {
+        ctx.log = malloc(sizeof(msglog_t));
+        assert(ctx.log != NULL);
+        if (msglog_open(ctx.log, log_dir) < 0) {
+            perror("msglog_open");
+            return 1;
         }
+        replay_log(&ctx);
     }
 
-    pthread_rwlock_unlock(&ctx->clients_lock);
-}
-
-// tokenise request and use handle_... functions to handle the request
-void handle_request(server_context_t *ctx, struct sockaddr_in *client_addr, char *client_request, int length)
-{
-    char *command = NULL;
-    char *content = NULL;
-
-    parse_request(client_request, &command, &content);
+    if (capture_path) {
+        ctx.capture = malloc(sizeof(dgcap_writer_t));
+        assert(ctx.capture != NULL);
+        if (dgcap_create(ctx.capture, capture_path, udp_now_us(), (long long)time(NULL) * 1000000LL) < 0) {
+            perror("dgcap_create");
+            return 1;
+        }
+        alog_info("Capturing inbound datagrams to %s\n", capture_path);
+    }
 
-    if (command == NULL) {
-        return;
+    metrics_started_us = udp_now_us();
+    if (metrics_spec && metrics_open(&ctx, metrics_spec) < 0) {
+        alog_warn("Cannot serve metrics on %s; running without them\n", metrics_spec);
     }
 
-    pthread_rwlock_wrlock(&ctx->clients_lock);
-    struct Node *client = find_client_by_addr_nolock(ctx, client_addr);
-    time_t now = time(NULL);
-    if (client) {
-        client->last_active = now;
-        client->awaiting_ping_reply = 0;
-        client->ping_sent_time = 0;
-        if (client->heap_index >= 0) {
-            heap_update(ctx, client);
+    if (peer_specs_count > 0) {
+        ctx.fed = calloc(1, sizeof(struct Federation));
+        assert(ctx.fed != NULL);
+        struct sockaddr_in self_addr;
+        if (set_socket_addr(&self_addr, self_ip, port) < 0) {
+            fprintf(stderr, "Bad self address %s\n", self_ip);
+            return 1;
+        }
+        snprintf(ctx.fed->self, sizeof(ctx.fed->self), "%s:%d", inet_ntoa(self_addr.sin_addr), port);
+        pthread_mutex_init(&ctx.fed->remote_lock, NULL);
+        pthread_rwlock_init(&ctx.fed->ring_lock, NULL);
+        for (int i = 0; i < peer_specs_count; i++) {
+            if (fed_add_peer(&ctx, peer_specs[i]) < 0) {
+                fprintf(stderr, "Bad peer address %s\n", peer_specs[i]);
+                return 1;
+            }
         }
+        ring_rebuild(ctx.fed);
     }
-    pthread_rwlock_unlock(&ctx->clients_lock);
 
-    if (strcmp(command, "conn") == 0) {
-        handle_conn(ctx, client_addr, content);
-    } 
-    else if (strcmp(command, "say") == 0) {
-        handle_say(ctx, client_addr, content);
-    } 
-    else if (strcmp(command, "sayto") == 0) {
-        handle_sayto(ctx, client_addr, content);
-    } 
-    else if (strcmp(command, "disconn") == 0) {
-        handle_disconn(ctx, client_addr);
-    } 
-    else if (strcmp(command, "rename") == 0) {
-        handle_rename(ctx, client_addr, content);
-    } 
-    else if (strcmp(command, "mute") == 0) {
-        handle_mute(ctx, client_addr, content);
-    } 
-    else if (strcmp(command, "unmute") == 0) {
-        handle_unmute(ctx, client_addr, content);
-    } 
-    else if (strcmp(command, "kick") == 0) {
-        handle_kick(ctx, client_addr, content);
-    }
-    else if (strcmp(command, "ret-ping") == 0) {
-        handle_ret_ping(ctx, client_addr);
+    ctx.snapshot_path = snapshot_path;
+    ctx.snapshot_interval_s = snapshot_s > 0 ? snapshot_s : DEFAULT_SNAPSHOT_S;
+    ctx.handover_path = handover_path;
+    if (handover_conn >= 0) {
+        if (snapshot_decode(&ctx, handover_state.data, handover_state.len) < 0) {
+            fprintf(stderr, "Handover state is damaged\n");
+        }
+        free(handover_state.data);
     }
-    else {
-        char msg[BUFFER_SIZE];
-        snprintf(msg, sizeof(msg), "Invalid command: %s", command);
-        udp_socket_write(ctx->sd, client_addr, msg, BUFFER_SIZE);
+    else if (ctx.snapshot_path) {
+        snapshot_load(&ctx);
     }
-}
 
-// initialise server
-int main(int argc, char *argv[])
-{
-    int sd = udp_socket_open(SERVER_PORT);
-    assert(sd > -1);
-    printf("Chat server running on port %d...\n", SERVER_PORT);
+    int rc;
+    pthread_t handover_tid;
+    if (ctx.handover_path) {
+        rc = pthread_create(&handover_tid, NULL, handover_thread, &ctx);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to create handover thread\n");
+            return 1;
+        }
+        pthread_detach(handover_tid);
+    }
 
-    server_context_t ctx;
-    ctx.sd = sd;
-    ctx.running = 1;
-    ctx.clients_head = NULL;
-    pthread_rwlock_init(&ctx.clients_lock, NULL);
-    ctx.global_count = 0;
-    ctx.global_start = 0;
-    ctx.heap_size = 0;
-
-    pthread_t listener_tid, ping_tid;
-    int rc = pthread_create(&listener_tid, NULL, listener_thread, &ctx);
+    pthread_t listener_tid, ping_tid, outbound_tid, fed_tid, log_tid, snapshot_tid, search_tid, metrics_tid;
+    rc = pthread_create(&listener_tid, NULL, listener_thread, &ctx);
     if (rc != 0) {
         fprintf(stderr, "Failed to create listener thread\n");
         return 1;
     }
 
+    if (handover_conn >= 0) {
+        // we are reading the socket now; let the old process go
+        long long drops = udp_socket_drops(sd);
+        if (write(handover_conn, "k", 1) != 1) {
+            perror("handover ack");
+        }
+        close(handover_conn);
+        alog_info("Hot restart took %.3f ms; datagrams dropped during handover: %lld\n",
+               (udp_now_us() - handover.started_us) / 1000.0, drops - (long long)handover.drops);
+    }
+
+    stats_calibrate();   // takes 20 ms, so not before a handover is acknowledged
+
     rc = pthread_create(&ping_tid, NULL, ping_monitor_thread, &ctx);
     if (rc != 0) {
         fprintf(stderr, "Failed to create ping monitor thread\n");
         return 1;
     }
+
+    rc = pthread_create(&outbound_tid, NULL, outbound_thread, &ctx);
+    if (rc != 0) {
+        fprintf(stderr, "Failed to create outbound thread\n");
+        return 1;
+    }
+
+    if (ctx.fed) {
+        rc = pthread_create(&fed_tid, NULL, fed_thread, &ctx);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to create federation thread\n");
+            return 1;
+        }
+    }
+
+    if (ctx.log) {
+        rc = pthread_create(&log_tid, NULL, log_sync_thread, &ctx);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to create log sync thread\n");
+            return 1;
+        }
+    }
+
+    if (ctx.snapshot_path) {
+        rc = pthread_create(&snapshot_tid, NULL, snapshot_thread, &ctx);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to create snapshot thread\n");
+            return 1;
+        }
+    }
+
+    rc = pthread_create(&search_tid, NULL, search_thread, &ctx);
+    if (rc != 0) {
+        fprintf(stderr, "Failed to create search thread\n");
+        return 1;
+    }
+
+    if (ctx.metrics_sd >= 0) {
+        rc = pthread_create(&metrics_tid, NULL, metrics_thread, &ctx);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to create metrics thread\n");
+            return 1;
+        }
+    }
     
     pthread_join(listener_tid, NULL);
     ctx.running = 0;
     pthread_join(ping_tid, NULL);
+    pthread_join(outbound_tid, NULL);
+    pthread_join(search_tid, NULL);
+    if (ctx.metrics_sd >= 0) {
+        pthread_join(metrics_tid, NULL);
+        close(ctx.metrics_sd);   // the path stays: a successor may have it by now
+    }
+    if (ctx.fed) {
+        pthread_join(fed_tid, NULL);
+    }
+    if (ctx.snapshot_path) {
+        pthread_join(snapshot_tid, NULL);
+    }
+    if (ctx.log) {
+        pthread_join(log_tid, NULL);
+        msglog_close(ctx.log);
+        free(ctx.log);
+    }
+    if (ctx.capture) {
+        dgcap_close(ctx.capture);
+        free(ctx.capture);
+    }
 
     close(sd);
     pthread_rwlock_destroy(&ctx.clients_lock);
+    frag_table_destroy(&ctx.frags);
+    for (int i = 0; i < ctx.global_count; i++) {
+        free(ctx.global_buffer[(ctx.global_start + i) % GLOBAL_BUFFER_SIZE]);
+    }
 
+    if (tracer.every) {
+        trace_export();
+    }
+    alog_stop();
     return 0;
 }
+
+#endif
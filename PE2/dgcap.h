@@ -0,0 +1,220 @@
+#ifndef DGCAP_H
+#define DGCAP_H
+
+// Capture file of inbound datagrams, for replaying real traffic offline.
+//
+// The file is a 16 byte header ("DGCAP001" and the wall-clock start time in
+// microseconds) followed by one record per datagram:
+//   varint  microseconds since the previous record (since the start for the first)
+//   4 bytes source IPv4 address, network order
+//   2 bytes source port, network order
+//   varint  payload length
+//   payload the datagram exactly as received
+// so a small request costs its own bytes plus about 9. A record cut short
+// by a crash is simply where the capture ends.
+//
+// The writer has a single producer (the listener) and buffers records in
+// memory; dgcap_flush is also safe from another thread, so an idle
+// capture still reaches the disk.
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define DGCAP_MAGIC "DGCAP001"
+#define DGCAP_HEADER_SIZE 16
+#define DGCAP_BUFFER_SIZE (256 * 1024)
+#define DGCAP_RECORD_OVERHEAD 16     // two varints and the address, at most
+
+typedef struct dgcap_writer {
+    int fd;
+    pthread_mutex_t lock;
+    uint8_t *buf;                // DGCAP_BUFFER_SIZE bytes not yet written
+    size_t used;
+    long long last_us;           // time of the previous record
+    unsigned long records;
+    unsigned long long bytes;    // written to the file so far
+    int failed;                  // a write failed; nothing more is recorded
+} dgcap_writer_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    long long at_us;             // since the start of the capture
+    const char *data;            // points into the mapped file
+    int len;
+} dgcap_record_t;
+
+typedef struct {
+    const uint8_t *base;
+    size_t size;
+    size_t off;
+    long long start_wall_us;
+    long long at_us;
+} dgcap_reader_t;
+
+static inline size_t dgcap_put_varint(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+// 0 when the varint runs past end
+static inline size_t dgcap_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    uint64_t x = 0;
+    for (size_t n = 0; n < 10 && p + n < end; n++) {
+        x |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *v = x;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static int dgcap_write_all(int fd, const uint8_t *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w <= 0) return -1;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// now_us and wall_us: the caller's monotonic and wall clocks at the start
+static inline int dgcap_create(dgcap_writer_t *w, const char *path, long long now_us, long long wall_us)
+{
+    memset(w, 0, sizeof(*w));
+    w->buf = malloc(DGCAP_BUFFER_SIZE);
+    if (!w->buf) return -1;
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        free(w->buf);
+        return -1;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    memcpy(w->buf, DGCAP_MAGIC, 8);
+    memcpy(w->buf + 8, &wall_us, 8);
+    w->used = DGCAP_HEADER_SIZE;
+    w->last_us = now_us;
+    return 0;
+}
+
+// caller holds w->lock
+static void dgcap_flush_locked(dgcap_writer_t *w)
+{
+    if (w->used == 0 || w->failed) return;
+    if (dgcap_write_all(w->fd, w->buf, w->used) < 0) {
+        w->failed = 1;
+        return;
+    }
+    w->bytes += w->used;
+    w->used = 0;
+}
+
+static void dgcap_flush(dgcap_writer_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    dgcap_flush_locked(w);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void dgcap_append(dgcap_writer_t *w, long long now_us, const struct sockaddr_in *addr, const char *data, int len)
+{
+    if (len < 0 || (size_t)len + DGCAP_RECORD_OVERHEAD > DGCAP_BUFFER_SIZE) return;
+    pthread_mutex_lock(&w->lock);
+    if (w->used + DGCAP_RECORD_OVERHEAD + (size_t)len > DGCAP_BUFFER_SIZE) {
+        dgcap_flush_locked(w);
+    }
+    if (!w->failed) {
+        uint8_t *p = w->buf + w->used;
+        p += dgcap_put_varint(p, (uint64_t)(now_us > w->last_us ? now_us - w->last_us : 0));
+        memcpy(p, &addr->sin_addr.s_addr, 4);
+        memcpy(p + 4, &addr->sin_port, 2);
+        p += 6;
+        p += dgcap_put_varint(p, (uint64_t)len);
+        memcpy(p, data, (size_t)len);
+        w->used = (size_t)(p + len - w->buf);
+        if (now_us > w->last_us) w->last_us = now_us;
+        w->records++;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static inline void dgcap_close(dgcap_writer_t *w)
+{
+    dgcap_flush(w);
+    close(w->fd);
+    free(w->buf);
+    pthread_mutex_destroy(&w->lock);
+}
+
+static inline int dgcap_open(dgcap_reader_t *r, const char *path)
+{
+    memset(r, 0, sizeof(*r));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < DGCAP_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+    if (memcmp(base, DGCAP_MAGIC, 8) != 0) {
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+    r->base = base;
+    r->size = (size_t)st.st_size;
+    memcpy(&r->start_wall_us, r->base + 8, 8);
+    r->off = DGCAP_HEADER_SIZE;
+    return 0;
+}
+
+// 1 and the next record, or 0 at the end of the capture
+static inline int dgcap_next(dgcap_reader_t *r, dgcap_record_t *rec)
+{
+    const uint8_t *p = r->base + r->off;
+    const uint8_t *end = r->base + r->size;
+    uint64_t delta, len;
+    size_t n = dgcap_get_varint(p, end, &delta);
+    if (n == 0 || end - (p + n) < 6) return 0;
+    p += n;
+    memset(&rec->addr, 0, sizeof(rec->addr));
+    rec->addr.sin_family = AF_INET;
+    memcpy(&rec->addr.sin_addr.s_addr, p, 4);
+    memcpy(&rec->addr.sin_port, p + 4, 2);
+    p += 6;
+    n = dgcap_get_varint(p, end, &len);
+    if (n == 0 || (uint64_t)(end - (p + n)) < len) return 0;
+    p += n;
+    r->at_us += (long long)delta;
+    rec->at_us = r->at_us;
+    rec->data = (const char *)p;
+    rec->len = (int)len;
+    r->off = (size_t)(p + len - r->base);
+    return 1;
+}
+
+static inline void dgcap_close_reader(dgcap_reader_t *r)
+{
+    if (r->base) munmap((void *)r->base, r->size);
+    r->base = NULL;
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "udp.h"
+
+// Checks frag$ reassembly with the largest messages that really occur: a
+// paste of FRAG_MAX_MESSAGE - 1 bytes as the client wraps it (tok$, id$,
+// say$), the same paste as the server relays it ("msg$<id>$<name>: ..."),
+// and the largest message frag_send accepts at all. Pieces are delivered
+// out of order and some twice. Exits non-zero on the first mismatch.
+//
+// compile: gcc -fsanitize=address -g frag_test.c -o frag_test -lpthread
+// usage:   frag_test
+
+typedef struct {
+    char *pieces[FRAG_MAX_COUNT + 1];
+    int lens[FRAG_MAX_COUNT + 1];
+    int count;
+} piece_list_t;
+
+static int collect(void *arg, const char *buffer, int n)
+{
+    piece_list_t *list = (piece_list_t *)arg;
+    if (list->count > FRAG_MAX_COUNT) return -1;
+    list->pieces[list->count] = malloc(n + 1);   // frag_receive wants a spare byte
+    memcpy(list->pieces[list->count], buffer, n);
+    list->lens[list->count] = n;
+    list->count++;
+    return 0;
+}
+
+static void free_pieces(piece_list_t *list)
+{
+    for (int i = 0; i < list->count; i++) free(list->pieces[i]);
+    list->count = 0;
+}
+
+// fragment msg, feed the pieces back in a scrambled order; 0 if it comes out whole
+static int round_trip(frag_table_t *t, const char *name, uint32_t msg_id, const char *msg, int n)
+{
+    piece_list_t list = { .count = 0 };
+    if (frag_send(msg_id, msg, n, collect, &list) < 0) {
+        printf("%s: frag_send refused %d bytes\n", name, n);
+        free_pieces(&list);
+        return -1;
+    }
+
+    struct sockaddr_in from;
+    set_socket_addr(&from, "127.0.0.1", 40000);
+
+    // back to front, every third piece twice
+    int done = 0;
+    for (int i = list.count - 1; i >= 0; i--) {
+        for (int rep = 0; rep < (i % 3 == 0 ? 2 : 1); rep++) {
+            char *out;
+            int len = frag_receive(t, &from, list.pieces[i], list.lens[i], &out);
+            if (len == 0) continue;
+            if (done || i != 0 || len != n || memcmp(out, msg, n) != 0 || out[len] != '\0') {
+                printf("%s: reassembled %d bytes after piece %d, expected %d\n", name, len, i, n);
+                free_pieces(&list);
+                return -1;
+            }
+            done = 1;
+        }
+    }
+    printf("%s: %d bytes in %d pieces %s\n", name, n, list.count, done ? "ok" : "FAILED");
+    free_pieces(&list);
+    return done ? 0 : -1;
+}
+
+int main(void)
+{
+    frag_table_t t;
+    frag_table_init(&t);
+
+    int paste_len = FRAG_MAX_MESSAGE - 1;
+    char *paste = malloc(paste_len + 1);
+    for (int i = 0; i < paste_len; i++) paste[i] = (char)('a' + i % 26);
+    paste[paste_len] = '\0';
+
+    char *msg = malloc(FRAG_ASSEMBLED_MAX + 2);
+    int failed = 0;
+
+    // what the client sends for a maximum paste
+    int n = snprintf(msg, FRAG_ASSEMBLED_MAX + 1, TOK_TAG "%016llx$" ID_TAG "%u$say$%s$%llu",
+                     0x0123456789abcdefULL, 4000000000u, paste, 18446744073709551615ULL);
+    failed |= round_trip(&t, "client paste", 1, msg, n);
+
+    // what the server relays for it
+    n = snprintf(msg, FRAG_ASSEMBLED_MAX + 1, MSG_TAG "%llu$%.63s: %s",
+                 18446744073709551615ULL,
+                 "nnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnn", paste);
+    failed |= round_trip(&t, "server relay", 2, msg, n);
+
+    // the largest message frag_send takes, and one byte more
+    memset(msg, 'z', FRAG_ASSEMBLED_MAX + 1);
+    failed |= round_trip(&t, "largest", 3, msg, FRAG_ASSEMBLED_MAX);
+    piece_list_t list = { .count = 0 };
+    if (frag_send(4, msg, FRAG_ASSEMBLED_MAX + 1, collect, &list) == 0) {
+        printf("oversized: frag_send accepted %d bytes\n", FRAG_ASSEMBLED_MAX + 1);
+        failed = 1;
+    }
+    free_pieces(&list);
+
+    free(msg);
+    free(paste);
+    frag_table_destroy(&t);
+    return failed ? 1 : 0;
+}
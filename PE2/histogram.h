@@ -0,0 +1,103 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+// Log-linear latency histogram in the style of HdrHistogram.
+//
+// Values below 2 * HIST_SUB are counted exactly; above that every power of
+// two is split into HIST_SUB equal buckets, so any recorded value is known
+// to within 1 / HIST_SUB (about 3%). Recording is a few instructions and
+// never allocates. Histograms of the same layout merge by adding counts.
+
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} hist_t;
+
+// values of 2^63 and up share the last bucket (a negative delta read as
+// unsigned lands there, not past the end)
+static inline int hist_bucket(uint64_t v)
+{
+    if (v < 2 * HIST_SUB) {
+        return (int)v;
+    }
+    if (v >> 63) {
+        return HIST_BUCKETS - 1;
+    }
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+}
+
+// largest value that falls in bucket b
+static inline uint64_t hist_bucket_top(int b)
+{
+    if (b < 2 * HIST_SUB) {
+        return (uint64_t)b;
+    }
+    int shift = b / HIST_SUB - 1;
+    uint64_t mantissa = (uint64_t)(b % HIST_SUB + HIST_SUB);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static inline void hist_reset(hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+static inline void hist_record(hist_t *h, uint64_t v)
+{
+    h->counts[hist_bucket(v)]++;
+    if (h->count == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->count++;
+    h->sum += v;
+}
+
+static inline void hist_merge(hist_t *dst, const hist_t *src)
+{
+    if (src->count == 0) {
+        return;
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        dst->counts[b] += src->counts[b];
+    }
+    if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+}
+
+// value at or below which pct percent of the recordings fall
+static inline uint64_t hist_percentile(const hist_t *h, double pct)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t top = hist_bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static inline double hist_mean(const hist_t *h)
+{
+    return h->count ? (double)h->sum / (double)h->count : 0.0;
+}
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+// Contention profile for a pthread rwlock, per call site.
+//
+// PROFILED_RDLOCK / PROFILED_WRLOCK / PROFILED_UNLOCK stand in for the
+// pthread_rwlock_* calls. Built with -DLOCK_PROFILE, every use site gets a
+// static lockprof_site_t recording how often it took the lock, how often it
+// had to wait, how long it waited and how long it then held the lock. The
+// uncontended path costs a trylock and two clock reads. Without the flag the
+// macros are the plain pthread calls and nothing here is compiled in.
+//
+// Hold times are matched up per thread: the unlock is charged to the site
+// of that thread's most recent acquisition of the same lock.
+
+#include <pthread.h>
+
+#ifdef LOCK_PROFILE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOCKPROF_DEPTH 8        // locks one thread may hold at once
+
+typedef struct lockprof_site {
+    const char *lock_name;
+    const char *func;
+    int line;
+    char mode;                  // 'r' or 'w'
+    int registered;
+    struct lockprof_site *next;
+    unsigned long acquires;
+    unsigned long contended;
+    uint64_t wait_ns, wait_max_ns;
+    uint64_t hold_ns, hold_max_ns;
+} lockprof_site_t;
+
+static lockprof_site_t *lockprof_sites;
+
+static __thread struct {
+    pthread_rwlock_t *lock;
+    lockprof_site_t *site;
+    uint64_t since;
+} lockprof_held[LOCKPROF_DEPTH];
+static __thread int lockprof_depth;
+
+static inline uint64_t lockprof_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline void lockprof_max(uint64_t *slot, uint64_t v)
+{
+    uint64_t cur = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(slot, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void lockprof_register(lockprof_site_t *site)
+{
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&site->registered, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    lockprof_site_t *head = __atomic_load_n(&lockprof_sites, __ATOMIC_RELAXED);
+    do {
+        site->next = head;
+    } while (!__atomic_compare_exchange_n(&lockprof_sites, &head, site, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static inline void lockprof_acquire(pthread_rwlock_t *lock, lockprof_site_t *site, int write)
+{
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) {
+        lockprof_register(site);
+    }
+    uint64_t now;
+    if ((write ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock)) == 0) {
+        now = lockprof_now();
+    }
+    else {
+        uint64_t start = lockprof_now();
+        if (write) pthread_rwlock_wrlock(lock);
+        else pthread_rwlock_rdlock(lock);
+        now = lockprof_now();
+        __atomic_add_fetch(&site->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&site->wait_ns, now - start, __ATOMIC_RELAXED);
+        lockprof_max(&site->wait_max_ns, now - start);
+    }
+    __atomic_add_fetch(&site->acquires, 1, __ATOMIC_RELAXED);
+
+    if (lockprof_depth < LOCKPROF_DEPTH) {
+        lockprof_held[lockprof_depth].lock = lock;
+        lockprof_held[lockprof_depth].site = site;
+        lockprof_held[lockprof_depth].since = now;
+    }
+    lockprof_depth++;
+}
+
+static inline void lockprof_release(pthread_rwlock_t *lock)
+{
+    uint64_t now = lockprof_now();
+    pthread_rwlock_unlock(lock);
+    for (int i = (lockprof_depth < LOCKPROF_DEPTH ? lockprof_depth : LOCKPROF_DEPTH) - 1; i >= 0; i--) {
+        if (lockprof_held[i].lock != lock) continue;
+        lockprof_site_t *site = lockprof_held[i].site;
+        uint64_t held = now - lockprof_held[i].since;
+        __atomic_add_fetch(&site->hold_ns, held, __ATOMIC_RELAXED);
+        lockprof_max(&site->hold_max_ns, held);
+        for (int j = i; j + 1 < lockprof_depth && j + 1 < LOCKPROF_DEPTH; j++) {
+            lockprof_held[j] = lockprof_held[j + 1];
+        }
+        break;
+    }
+    if (lockprof_depth > 0) lockprof_depth--;
+}
+
+#define LOCKPROF_SITE(lock, m) \
+    static lockprof_site_t lockprof_site_ = { #lock, __func__, __LINE__, m, 0, NULL, 0, 0, 0, 0, 0, 0 }
+
+#define PROFILED_RDLOCK(lock) do { LOCKPROF_SITE(lock, 'r'); lockprof_acquire((lock), &lockprof_site_, 0); } while (0)
+#define PROFILED_WRLOCK(lock) do { LOCKPROF_SITE(lock, 'w'); lockprof_acquire((lock), &lockprof_site_, 1); } while (0)
+#define PROFILED_UNLOCK(lock) lockprof_release(lock)
+
+static int lockprof_cmp(const void *a, const void *b)
+{
+    const lockprof_site_t *x = *(lockprof_site_t *const *)a;
+    const lockprof_site_t *y = *(lockprof_site_t *const *)b;
+    return x->wait_ns < y->wait_ns ? 1 : x->wait_ns > y->wait_ns ? -1 : 0;
+}
+
+// one line per site that has been used, most total waiting first
+static void lockprof_dump(void (*fn)(void *arg, const char *line), void *arg)
+{
+    int count = 0;
+    for (lockprof_site_t *s = __atomic_load_n(&lockprof_sites, __ATOMIC_ACQUIRE); s; s = s->next) count++;
+    lockprof_site_t **sorted = malloc((count ? count : 1) * sizeof(*sorted));
+    if (!sorted) return;
+    int n = 0;
+    for (lockprof_site_t *s = __atomic_load_n(&lockprof_sites, __ATOMIC_ACQUIRE); s && n < count; s = s->next) {
+        sorted[n++] = s;
+    }
+    qsort(sorted, n, sizeof(*sorted), lockprof_cmp);
+
+    char line[256];
+    for (int i = 0; i < n; i++) {
+        lockprof_site_t *s = sorted[i];
+        unsigned long acquires = s->acquires ? s->acquires : 1;
+        snprintf(line, sizeof(line),
+                 "%s %c %s:%d n=%lu waited=%lu (%.1f%%) wait avg=%.1fus max=%.1fus hold avg=%.1fus max=%.1fus",
+                 s->lock_name, s->mode, s->func, s->line, s->acquires, s->contended,
+                 100.0 * s->contended / acquires,
+                 s->contended ? s->wait_ns / 1000.0 / s->contended : 0.0, s->wait_max_ns / 1000.0,
+                 s->hold_ns / 1000.0 / acquires, s->hold_max_ns / 1000.0);
+        fn(arg, line);
+    }
+    free(sorted);
+}
+
+// start counting afresh (sites stay registered)
+static void lockprof_reset(void)
+{
+    for (lockprof_site_t *s = __atomic_load_n(&lockprof_sites, __ATOMIC_ACQUIRE); s; s = s->next) {
+        __atomic_store_n(&s->acquires, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->wait_max_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->hold_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->hold_max_ns, 0, __ATOMIC_RELAXED);
+    }
+}
+
+#else
+
+#define PROFILED_RDLOCK(lock) pthread_rwlock_rdlock(lock)
+#define PROFILED_WRLOCK(lock) pthread_rwlock_wrlock(lock)
+#define PROFILED_UNLOCK(lock) pthread_rwlock_unlock(lock)
+
+#endif
+
+#endif
@@ -0,0 +1,457 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+// Append-only on-disk log of global chat messages.
+//
+// The log is a directory of fixed-size segment files named after the id of
+// their first message ("00000000000000000001.seg"). Each segment is mapped
+// with mmap, so appending a message is a memcpy into the mapping: no system
+// call on the say$ path. A commit (msglog_commit, run every sync interval by
+// the server) msyncs whatever was appended since the previous one, so many
+// messages share one flush to disk (group commit).
+//
+// A record is
+//   uint32 len    payload bytes including the terminating NUL, 0 = end
+//   uint32 check  FNV-1a of id and payload, so a torn tail is detected
+//   uint64 id
+//   payload       the chat line, NUL-terminated, padded to 8 bytes
+// and every MSGLOG_INDEX_EVERY-th record goes into an in-memory sparse index
+// (id -> offset), so finding a message id costs a binary search plus a
+// short scan. Readers get copies, taken under the lock in batches.
+//
+// The file "epoch" in the directory holds the id space's epoch (hex),
+// chosen when the log is first created, so ids and epoch stay together
+// across restarts.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <pthread.h>
+
+#define MSGLOG_SEGMENT_SIZE (16 * 1024 * 1024)
+#define MSGLOG_INDEX_EVERY 64
+#define MSGLOG_HEADER_SIZE 16
+#define MSGLOG_READ_BATCH (64 * 1024)
+
+typedef struct {
+    uint64_t id;
+    uint32_t offset;
+} msglog_index_entry_t;
+
+typedef struct {
+    uint64_t first_id;          // 0 while the segment is empty
+    uint64_t last_id;
+    int fd;
+    char *base;                 // MSGLOG_SEGMENT_SIZE bytes, MAP_SHARED
+    uint32_t end;               // append offset
+    uint32_t synced;            // everything before this is on disk
+    uint32_t records;
+    msglog_index_entry_t *index;
+    int index_count, index_cap;
+} msglog_segment_t;
+
+typedef struct msglog {
+    char dir[256];
+    pthread_mutex_t lock;       // guards the segment list and offsets
+    msglog_segment_t *segs;     // oldest first; the last one takes appends
+    int seg_count, seg_cap;
+
+    uint32_t epoch;             // of the ids in this log, never 0
+
+    unsigned long appended;
+    unsigned long commits;
+} msglog_t;
+
+static uint32_t msglog_check(uint64_t id, const char *payload, uint32_t len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 8; i++) {
+        h ^= (uint8_t)(id >> (8 * i));
+        h *= 16777619u;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= (uint8_t)payload[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t msglog_record_size(uint32_t len)
+{
+    return (MSGLOG_HEADER_SIZE + len + 7) & ~7u;
+}
+
+static void msglog_index_add(msglog_segment_t *seg, uint64_t id, uint32_t offset)
+{
+    if (seg->index_count == seg->index_cap) {
+        int cap = seg->index_cap ? seg->index_cap * 2 : 64;
+        msglog_index_entry_t *index = realloc(seg->index, cap * sizeof(*index));
+        if (!index) return; // a sparser index still works, just scans further
+        seg->index = index;
+        seg->index_cap = cap;
+    }
+    seg->index[seg->index_count].id = id;
+    seg->index[seg->index_count].offset = offset;
+    seg->index_count++;
+}
+
+// map a segment file, creating it at full size if needed. The blocks are
+// allocated up front, so an append never faults on a full disk (SIGBUS)
+static int msglog_map(msglog_segment_t *seg, const char *path, int create)
+{
+    seg->fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (seg->fd < 0) {
+        return -1;
+    }
+    if (create && (posix_fallocate(seg->fd, 0, MSGLOG_SEGMENT_SIZE) != 0 || fsync(seg->fd) < 0)) {
+        close(seg->fd);
+        return -1;
+    }
+    seg->base = mmap(NULL, MSGLOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->base == MAP_FAILED) {
+        close(seg->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// walk a mapped segment to find its end and rebuild its sparse index
+static void msglog_scan(msglog_segment_t *seg)
+{
+    uint32_t off = 0;
+    seg->records = 0;
+    while (off + MSGLOG_HEADER_SIZE <= MSGLOG_SEGMENT_SIZE) {
+        uint32_t len, check;
+        uint64_t id;
+        memcpy(&len, seg->base + off, 4);
+        memcpy(&check, seg->base + off + 4, 4);
+        memcpy(&id, seg->base + off + 8, 8);
+        if (len == 0 || off + msglog_record_size(len) > MSGLOG_SEGMENT_SIZE ||
+            msglog_check(id, seg->base + off + MSGLOG_HEADER_SIZE, len) != check) {
+            break; // end of log, or a record torn by a crash
+        }
+        if (seg->records % MSGLOG_INDEX_EVERY == 0) {
+            msglog_index_add(seg, id, off);
+        }
+        if (seg->records == 0) seg->first_id = id;
+        seg->last_id = id;
+        seg->records++;
+        off += msglog_record_size(len);
+    }
+    // clear a torn tail so the next append starts from clean bytes
+    if (off + MSGLOG_HEADER_SIZE <= MSGLOG_SEGMENT_SIZE) {
+        memset(seg->base + off, 0, MSGLOG_HEADER_SIZE);
+    }
+    seg->end = off;
+    seg->synced = off;
+}
+
+static msglog_segment_t *msglog_push_segment(msglog_t *log)
+{
+    if (log->seg_count == log->seg_cap) {
+        int cap = log->seg_cap ? log->seg_cap * 2 : 16;
+        msglog_segment_t *segs = realloc(log->segs, cap * sizeof(*segs));
+        if (!segs) return NULL;
+        log->segs = segs;
+        log->seg_cap = cap;
+    }
+    msglog_segment_t *seg = &log->segs[log->seg_count];
+    memset(seg, 0, sizeof(*seg));
+    return seg;
+}
+
+static int msglog_name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// open (or create) the log in dir and map every existing segment
+int msglog_open(msglog_t *log, const char *dir)
+{
+    memset(log, 0, sizeof(*log));
+    snprintf(log->dir, sizeof(log->dir), "%s", dir);
+    pthread_mutex_init(&log->lock, NULL);
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+
+    // segment names are zero-padded ids, so name order is id order
+    char **names = NULL;
+    int count = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        size_t n = strlen(e->d_name);
+        if (n != 24 || strcmp(e->d_name + 20, ".seg") != 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            char **grown = realloc(names, cap * sizeof(char *));
+            if (!grown) break;
+            names = grown;
+        }
+        names[count++] = strdup(e->d_name);
+    }
+    closedir(d);
+    qsort(names, count, sizeof(char *), msglog_name_cmp);
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/epoch", dir);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%x", &log->epoch) != 1) log->epoch = 0;
+        fclose(f);
+    }
+    if (log->epoch == 0) {
+        do {
+            if (getrandom(&log->epoch, sizeof(log->epoch), 0) != sizeof(log->epoch)) {
+                log->epoch = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+            }
+        } while (log->epoch == 0);
+        f = fopen(path, "w");
+        if (!f) return -1;
+        fprintf(f, "%08x\n", log->epoch);
+        if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+            fclose(f);
+            return -1;
+        }
+        fclose(f);
+    }
+
+    for (int i = 0; i < count; i++) {
+        msglog_segment_t *seg = msglog_push_segment(log);
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        if (seg && msglog_map(seg, path, 0) == 0) {
+            msglog_scan(seg);
+            log->seg_count++;
+        }
+        free(names[i]);
+    }
+    free(names);
+    return 0;
+}
+
+// start a segment whose first message will be first_id (hold lock)
+static msglog_segment_t *msglog_roll_locked(msglog_t *log, uint64_t first_id)
+{
+    msglog_segment_t *seg = msglog_push_segment(log);
+    if (!seg) return NULL;
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%020llu.seg", log->dir, (unsigned long long)first_id);
+    if (msglog_map(seg, path, 1) < 0) {
+        perror("msglog segment");
+        return NULL;
+    }
+    log->seg_count++;
+    return seg;
+}
+
+// append one message; ids must increase. No system call unless a segment
+// fills up and the next one has to be created.
+int msglog_append(msglog_t *log, uint64_t id, const char *line)
+{
+    uint32_t len = (uint32_t)strlen(line) + 1;
+    uint32_t size = msglog_record_size(len);
+    if (size + MSGLOG_HEADER_SIZE > MSGLOG_SEGMENT_SIZE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    msglog_segment_t *seg = log->seg_count ? &log->segs[log->seg_count - 1] : NULL;
+    // keep room for the zero length that terminates the segment
+    if (seg == NULL || seg->end + size + MSGLOG_HEADER_SIZE > MSGLOG_SEGMENT_SIZE) {
+        seg = msglog_roll_locked(log, id);
+        if (seg == NULL) {
+            pthread_mutex_unlock(&log->lock);
+            return -1;
+        }
+    }
+
+    char *rec = seg->base + seg->end;
+    uint32_t check = msglog_check(id, line, len);
+    memcpy(rec + MSGLOG_HEADER_SIZE, line, len);
+    memcpy(rec + 4, &check, 4);
+    memcpy(rec + 8, &id, 8);
+    __atomic_store_n((uint32_t *)rec, len, __ATOMIC_RELEASE);  // length last: the record is complete
+
+    if (seg->records % MSGLOG_INDEX_EVERY == 0) {
+        msglog_index_add(seg, id, seg->end);
+    }
+    if (seg->records == 0) seg->first_id = id;
+    seg->last_id = id;
+    seg->records++;
+    seg->end += size;
+    log->appended++;
+    pthread_mutex_unlock(&log->lock);
+    return 0;
+}
+
+// flush everything appended since the last commit to disk
+void msglog_commit(msglog_t *log)
+{
+    long page = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&log->lock);
+    int first = log->seg_count;
+    while (first > 0 && log->segs[first - 1].synced < log->segs[first - 1].end) {
+        first--;
+    }
+    struct { char *base; uint32_t from, to; } dirty[4];
+    int n = 0;
+    for (int i = first; i < log->seg_count && n < 4; i++) {
+        dirty[n].base = log->segs[i].base;
+        dirty[n].from = log->segs[i].synced;
+        dirty[n].to = log->segs[i].end;
+        n++;
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    if (n == 0) {
+        return;
+    }
+
+    // msync outside the lock so appends carry on while we wait for the disk;
+    // segments are never unmapped while the server runs
+    for (int i = 0; i < n; i++) {
+        uint32_t start = dirty[i].from & ~(uint32_t)(page - 1);
+        if (msync(dirty[i].base + start, dirty[i].to - start, MS_SYNC) < 0) {
+            perror("msync");
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&log->lock);
+    for (int i = 0; i < n; i++) {
+        for (int s = 0; s < log->seg_count; s++) {
+            if (log->segs[s].base == dirty[i].base && log->segs[s].synced < dirty[i].to) {
+                log->segs[s].synced = dirty[i].to;
+            }
+        }
+    }
+    log->commits++;
+    pthread_mutex_unlock(&log->lock);
+}
+
+// oldest and newest id in the log (0, 0 when empty)
+void msglog_bounds(msglog_t *log, uint64_t *oldest, uint64_t *newest)
+{
+    pthread_mutex_lock(&log->lock);
+    *oldest = *newest = 0;
+    for (int i = 0; i < log->seg_count; i++) {
+        if (log->segs[i].records == 0) continue;
+        if (*oldest == 0) *oldest = log->segs[i].first_id;
+        *newest = log->segs[i].last_id;
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Call fn for up to max messages with id >= from_id, oldest first. Records
+// are copied out in batches of about MSGLOG_READ_BATCH bytes and fn runs on
+// the copy with the log unlocked, so a slow callback never holds up appends.
+// Returns the number of messages visited.
+int msglog_read_from(msglog_t *log, uint64_t from_id, int max,
+                     void (*fn)(void *arg, uint64_t id, const char *line), void *arg)
+{
+    uint32_t cap = MSGLOG_READ_BATCH;
+    char *batch = malloc(cap);
+    if (!batch) return 0;
+
+    int visited = 0;
+    while (visited < max) {
+        uint32_t used = 0;
+        int copied = 0, more = 0;
+
+        pthread_mutex_lock(&log->lock);
+
+        // last segment starting at or before from_id
+        int lo = 0, hi = log->seg_count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (log->segs[mid].records > 0 && log->segs[mid].first_id <= from_id) lo = mid + 1;
+            else hi = mid;
+        }
+        int s = lo > 0 ? lo - 1 : 0;
+
+        for (; s < log->seg_count && visited + copied < max && !more; s++) {
+            msglog_segment_t *seg = &log->segs[s];
+            if (seg->records == 0 || seg->last_id < from_id) continue;
+
+            // sparse index: last entry at or before from_id
+            uint32_t off = 0;
+            int a = 0, b = seg->index_count;
+            while (a < b) {
+                int mid = (a + b) / 2;
+                if (seg->index[mid].id <= from_id) a = mid + 1;
+                else b = mid;
+            }
+            if (a > 0) off = seg->index[a - 1].offset;
+
+            while (off < seg->end && visited + copied < max) {
+                uint32_t len;
+                uint64_t id;
+                memcpy(&len, seg->base + off, 4);
+                memcpy(&id, seg->base + off + 8, 8);
+                uint32_t size = msglog_record_size(len);
+                if (id >= from_id) {
+                    if (used + size > cap) {
+                        if (copied > 0) {
+                            more = 1;   // batch full, pick up here next round
+                            break;
+                        }
+                        char *bigger = realloc(batch, size);
+                        if (!bigger) break;
+                        batch = bigger;
+                        cap = size;
+                    }
+                    memcpy(batch + used, seg->base + off, size);
+                    used += size;
+                    copied++;
+                    from_id = id + 1;
+                }
+                off += size;
+            }
+        }
+        pthread_mutex_unlock(&log->lock);
+
+        for (uint32_t off = 0; off < used; ) {
+            uint32_t len;
+            uint64_t id;
+            memcpy(&len, batch + off, 4);
+            memcpy(&id, batch + off + 8, 8);
+            fn(arg, id, batch + off + MSGLOG_HEADER_SIZE);
+            off += msglog_record_size(len);
+        }
+        visited += copied;
+        if (!more) break;
+    }
+
+    free(batch);
+    return visited;
+}
+
+void msglog_close(msglog_t *log)
+{
+    msglog_commit(log);
+    for (int i = 0; i < log->seg_count; i++) {
+        munmap(log->segs[i].base, MSGLOG_SEGMENT_SIZE);
+        close(log->segs[i].fd);
+        free(log->segs[i].index);
+    }
+    free(log->segs);
+    pthread_mutex_destroy(&log->lock);
+}
+
+#endif
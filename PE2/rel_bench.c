@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "udp.h"
+
+// Goodput of the rel$ layer under injected loss.
+// A sender and a receiver talk over loopback in one process; udp_loss_rate
+// drops datagrams in both directions (data and acks), and we time how long
+// it takes until every message has been acked. Exits non-zero if any
+// message was not delivered.
+//
+// compile: gcc rel_bench.c -o rel_bench -lpthread
+// usage:   rel_bench [-s seed] [-B] [messages] [payload_bytes]
+//   -s  seed for the loss pattern (and session ids); default from the clock,
+//       printed so a failing run can be repeated
+//   -B  hand every message to rel_send at once, as a history catch-up
+//       does, instead of only as the window has room (so the backlog is
+//       exercised); messages beyond REL_BACKLOG_MAX are refused and count
+//       as undelivered
+
+#define BENCH_PORT_A 12101
+#define BENCH_PORT_B 12102
+#define BENCH_TIMEOUT_S 60
+
+typedef struct {
+    int sd;
+    rel_session_t rel;
+    volatile int running;
+    volatile long delivered;
+    volatile long delivered_bytes;
+} bench_end_t;
+
+static void *bench_reader(void *arg)
+{
+    bench_end_t *end = (bench_end_t *)arg;
+    char buffer[UDP_MTU + 1];
+    struct sockaddr_in from;
+
+    while (end->running) {
+        int rc = udp_socket_read(end->sd, &from, buffer, UDP_MTU);
+        if (rc <= 0) continue; // receive timeout, check running again
+
+        char *payload;
+        int n = rel_receive(&end->rel, end->sd, &from, buffer, rc, &payload);
+        if (n > 0) {
+            end->delivered++;
+            end->delivered_bytes += n;
+        }
+    }
+    return NULL;
+}
+
+static int bench_open(bench_end_t *end, int port)
+{
+    end->sd = udp_socket_open(port);
+    if (end->sd < 0) return -1;
+
+    struct timeval tv = { 0, 50000 };
+    setsockopt(end->sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    rel_init(&end->rel);
+    end->running = 1;
+    end->delivered = 0;
+    end->delivered_bytes = 0;
+    return 0;
+}
+
+static void bench_close(bench_end_t *end)
+{
+    close(end->sd);
+    rel_destroy(&end->rel);
+}
+
+// 1 if every message arrived, 0 if not, -1 on setup failure
+static int run_once(double loss, int messages, int payload_bytes, int burst)
+{
+    bench_end_t a, b;
+    if (bench_open(&a, BENCH_PORT_A) < 0 || bench_open(&b, BENCH_PORT_B) < 0) {
+        perror("udp_socket_open");
+        return -1;
+    }
+
+    struct sockaddr_in to_b;
+    set_socket_addr(&to_b, "127.0.0.1", BENCH_PORT_B);
+
+    pthread_t ta, tb;
+    pthread_create(&ta, NULL, bench_reader, &a);
+    pthread_create(&tb, NULL, bench_reader, &b);
+
+    char *payload = malloc(payload_bytes);
+    memset(payload, 'x', payload_bytes);
+
+    udp_loss_rate = loss;
+    long long start = udp_now_us();
+    long long deadline = start + BENCH_TIMEOUT_S * 1000000LL;
+
+    int sent = 0;
+    while (udp_now_us() < deadline) {
+        // fill the window, then let timers and acks drain it
+        while (sent < messages && (burst || rel_can_send(&a.rel))) {
+            rel_send(&a.rel, a.sd, &to_b, payload, payload_bytes);
+            sent++;
+        }
+        rel_poll(&a.rel, a.sd, &to_b);
+
+        pthread_mutex_lock(&a.rel.lock);
+        int in_flight = a.rel.in_flight + a.rel.backlog;
+        pthread_mutex_unlock(&a.rel.lock);
+        if (sent == messages && in_flight == 0) break;
+
+        usleep(200);
+    }
+    long long elapsed = udp_now_us() - start;
+    udp_loss_rate = 0;
+
+    usleep(100000);     // the last acked datagram may still be in b's reader
+    a.running = b.running = 0;
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+
+    double secs = elapsed / 1e6;
+    printf("%5.1f%%  %8ld/%-8d %10.3f  %12.1f  %8lu  %6lu  %7lu  %8lld\n",
+           loss * 100, b.delivered, messages, secs,
+           b.delivered_bytes / secs / 1024.0,
+           a.rel.retransmitted, a.rel.given_up, a.rel.refused, a.rel.srtt_us);
+    int all = b.delivered == messages;
+
+    free(payload);
+    bench_close(&a);
+    bench_close(&b);
+    return all;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned seed = (unsigned)udp_now_us();
+    int burst = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:B")) != -1) {
+        switch (opt) {
+            case 's': seed = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'B': burst = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-s seed] [-B] [messages] [payload_bytes]\n", argv[0]);
+                return 1;
+        }
+    }
+    int messages = optind < argc ? atoi(argv[optind]) : 20000;
+    int payload_bytes = optind + 1 < argc ? atoi(argv[optind + 1]) : 512;
+    if (payload_bytes <= 0 || payload_bytes > UDP_PAYLOAD_MAX) {
+        fprintf(stderr, "payload_bytes must be 1..%d\n", UDP_PAYLOAD_MAX);
+        return 1;
+    }
+
+    static const double losses[] = { 0.0, 0.01, 0.05, 0.20 };
+
+    srandom(seed);
+    printf("%d messages of %d bytes, window %d%s, seed %u\n", messages, payload_bytes, REL_WINDOW,
+           burst ? ", all at once" : "", seed);
+    printf("  loss  delivered/sent      secs  goodput KiB/s  retrans  gaveup  refused  srtt_us\n");
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++) {
+        int rc = run_once(losses[i], messages, payload_bytes, burst);
+        if (rc < 0) return 1;
+        if (rc == 0) failed = 1;
+    }
+    if (failed) fprintf(stderr, "some messages were not delivered (seed %u)\n", seed);
+    return failed;
+}
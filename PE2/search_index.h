@@ -0,0 +1,337 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+// Inverted index over chat messages for search$.
+//
+// Every word of a message (lower-cased runs of letters and digits, up to
+// SEARCH_MAX_TERM bytes) maps to the list of message ids containing it.
+// Ids only grow, so a list is stored as varint-encoded gaps from the
+// previous id: a message a few ids after the last one costs one byte.
+// Every SEARCH_BLOCK ids a skip entry records where the next block starts
+// and the id before it, so a block decodes on its own. Queries walk the
+// rarest word's list from its newest block back, look each id up in the
+// other words' lists through their skips, and stop at the newest k: only
+// the blocks they touch are decoded.
+//
+// search_index_prune forgets ids older than a bound: whole blocks before it
+// are cut off each list, a word left with none is freed, and queries skip
+// what remains below the bound in a list's first block.
+//
+// The index has one writer (the indexer thread) and any number of readers;
+// callers provide the locking (see search_* in chat_server.c).
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define SEARCH_BUCKETS 65536
+#define SEARCH_MAX_TERM 32
+#define SEARCH_MAX_QUERY_TERMS 8
+#define SEARCH_BLOCK 128
+
+typedef struct {
+    uint64_t base;              // id before the block; its first gap counts from here
+    uint32_t offset;            // of the block in postings
+} search_skip_t;
+
+typedef struct search_term {
+    struct search_term *next;
+    uint8_t *postings;          // varint gaps between ascending ids
+    uint32_t len, cap;
+    uint32_t count;
+    uint64_t last_id;
+    search_skip_t *skips;       // one per SEARCH_BLOCK ids
+    uint32_t skip_count, skip_cap;
+    char word[];
+} search_term_t;
+
+typedef struct {
+    search_term_t *buckets[SEARCH_BUCKETS];
+    unsigned long terms;
+    unsigned long documents;
+    unsigned long postings_bytes;
+    uint64_t min_id;            // ids below this are pruned
+} search_index_t;
+
+static uint32_t search_hash(const char *word, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (uint8_t)word[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static search_term_t *search_find(search_index_t *idx, const char *word, size_t n, int create)
+{
+    search_term_t **link = &idx->buckets[search_hash(word, n) % SEARCH_BUCKETS];
+    for (; *link != NULL; link = &(*link)->next) {
+        if (strncmp((*link)->word, word, n) == 0 && (*link)->word[n] == '\0') {
+            return *link;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    search_term_t *t = calloc(1, sizeof(*t) + n + 1);
+    if (!t) return NULL;
+    memcpy(t->word, word, n);
+    *link = t;
+    idx->terms++;
+    return t;
+}
+
+static int search_postings_add(search_index_t *idx, search_term_t *t, uint64_t id)
+{
+    if (t->count > 0 && id <= t->last_id) {
+        return 0; // word repeated in the same message
+    }
+    if (t->count % SEARCH_BLOCK == 0) {
+        if (t->skip_count == t->skip_cap) {
+            uint32_t cap = t->skip_cap ? t->skip_cap * 2 : 4;
+            search_skip_t *grown = realloc(t->skips, cap * sizeof(*grown));
+            if (!grown) return -1;
+            t->skips = grown;
+            t->skip_cap = cap;
+        }
+        t->skips[t->skip_count].base = t->count > 0 ? t->last_id : 0;
+        t->skips[t->skip_count].offset = t->len;
+        t->skip_count++;
+    }
+    if (t->len + 10 > t->cap) {
+        uint32_t cap = t->cap ? t->cap * 2 : 16;
+        uint8_t *grown = realloc(t->postings, cap);
+        if (!grown) return -1;
+        idx->postings_bytes += cap - t->cap;
+        t->postings = grown;
+        t->cap = cap;
+    }
+    uint64_t gap = t->count > 0 ? id - t->last_id : id;
+    while (gap >= 0x80) {
+        t->postings[t->len++] = (uint8_t)(gap | 0x80);
+        gap >>= 7;
+    }
+    t->postings[t->len++] = (uint8_t)gap;
+    t->last_id = id;
+    t->count++;
+    return 0;
+}
+
+// split text into words; calls fn(word, len) with a lower-cased copy
+static void search_tokenize(const char *text, void (*fn)(void *arg, const char *word, size_t n), void *arg)
+{
+    char word[SEARCH_MAX_TERM + 1];
+    size_t n = 0;
+    int too_long = 0;
+    for (const char *p = text; ; p++) {
+        if (*p != '\0' && isalnum((unsigned char)*p)) {
+            if (n < SEARCH_MAX_TERM) word[n++] = (char)tolower((unsigned char)*p);
+            else too_long = 1;
+            continue;
+        }
+        if (n > 0 && !too_long) {
+            word[n] = '\0';
+            fn(arg, word, n);
+        }
+        n = 0;
+        too_long = 0;
+        if (*p == '\0') break;
+    }
+}
+
+struct search_add_arg {
+    search_index_t *idx;
+    uint64_t id;
+};
+
+static void search_add_word(void *arg, const char *word, size_t n)
+{
+    struct search_add_arg *a = (struct search_add_arg *)arg;
+    search_term_t *t = search_find(a->idx, word, n, 1);
+    if (t) search_postings_add(a->idx, t, a->id);
+}
+
+// index one message; ids must be added in increasing order
+void search_index_add(search_index_t *idx, uint64_t id, const char *text)
+{
+    struct search_add_arg arg = { idx, id };
+    search_tokenize(text, search_add_word, &arg);
+    idx->documents++;
+}
+
+// decode block b of a posting list into ascending ids; returns how many
+static uint32_t search_block_decode(const search_term_t *t, uint32_t b, uint64_t *ids)
+{
+    uint32_t n = b + 1 < t->skip_count ? SEARCH_BLOCK : t->count - b * SEARCH_BLOCK;
+    uint64_t id = t->skips[b].base;
+    uint32_t pos = t->skips[b].offset;
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t gap = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = t->postings[pos++];
+            gap |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        id += gap;
+        ids[i] = id;
+    }
+    return n;
+}
+
+// one decoded block of a posting list, for membership tests
+typedef struct {
+    const search_term_t *t;
+    uint32_t block;             // UINT32_MAX until one is decoded
+    uint32_t n;
+    uint64_t ids[SEARCH_BLOCK];
+} search_cursor_t;
+
+static int search_cursor_has(search_cursor_t *c, uint64_t id)
+{
+    const search_term_t *t = c->t;
+    if (t->count == 0 || id <= t->skips[0].base || id > t->last_id) {
+        return 0;
+    }
+    // block b holds the ids after skips[b].base up to skips[b + 1].base
+    uint32_t lo = 0, hi = t->skip_count;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (t->skips[mid].base < id) lo = mid;
+        else hi = mid;
+    }
+    if (c->block != lo) {
+        c->n = search_block_decode(t, lo, c->ids);
+        c->block = lo;
+    }
+    uint32_t a = 0, b = c->n;
+    while (a < b) {
+        uint32_t mid = (a + b) / 2;
+        if (c->ids[mid] < id) a = mid + 1;
+        else b = mid;
+    }
+    return a < c->n && c->ids[a] == id;
+}
+
+struct search_query {
+    search_index_t *idx;
+    search_term_t *terms[SEARCH_MAX_QUERY_TERMS];
+    int count;
+    int missing;                // a word that occurs nowhere
+};
+
+static void search_query_word(void *arg, const char *word, size_t n)
+{
+    struct search_query *q = (struct search_query *)arg;
+    search_term_t *t = search_find(q->idx, word, n, 0);
+    if (t == NULL) {
+        q->missing = 1;
+        return;
+    }
+    for (int i = 0; i < q->count; i++) {
+        if (q->terms[i] == t) return;
+    }
+    if (q->count < SEARCH_MAX_QUERY_TERMS) q->terms[q->count++] = t;
+}
+
+// ids of the k newest messages containing every word of query, newest
+// first; returns how many were written to out (-1 if the query has no words)
+int search_index_query(search_index_t *idx, const char *query, uint64_t *out, int k)
+{
+    struct search_query q;
+    memset(&q, 0, sizeof(q));
+    q.idx = idx;
+    search_tokenize(query, search_query_word, &q);
+    if (q.missing) return 0;
+    if (q.count == 0) return -1;
+
+    // start from the rarest word and look its ids up in the others
+    for (int i = 1; i < q.count; i++) {
+        for (int j = i; j > 0 && q.terms[j]->count < q.terms[j - 1]->count; j--) {
+            search_term_t *tmp = q.terms[j];
+            q.terms[j] = q.terms[j - 1];
+            q.terms[j - 1] = tmp;
+        }
+    }
+    search_cursor_t *cursors = malloc(q.count * sizeof(*cursors));
+    if (!cursors) return 0;
+    for (int i = 0; i < q.count; i++) {
+        cursors[i].t = q.terms[i];
+        cursors[i].block = UINT32_MAX;
+        cursors[i].n = 0;
+    }
+
+    // newest first through the rarest list; cursors[0] holds its block
+    int found = 0;
+    const search_term_t *rarest = q.terms[0];
+    for (uint32_t b = rarest->skip_count; b-- > 0 && found < k; ) {
+        cursors[0].n = search_block_decode(rarest, b, cursors[0].ids);
+        for (uint32_t i = cursors[0].n; i-- > 0 && found < k; ) {
+            uint64_t id = cursors[0].ids[i];
+            if (id < idx->min_id) {
+                b = 0;  // the rest is older still
+                break;
+            }
+            int all = 1;
+            for (int j = 1; j < q.count && all; j++) {
+                all = search_cursor_has(&cursors[j], id);
+            }
+            if (all) out[found++] = id;
+        }
+    }
+    free(cursors);
+    return found;
+}
+
+// forget every id below min_id; the caller holds the index exclusively
+void search_index_prune(search_index_t *idx, uint64_t min_id)
+{
+    if (min_id <= idx->min_id) {
+        return;
+    }
+    idx->min_id = min_id;
+
+    for (int i = 0; i < SEARCH_BUCKETS; i++) {
+        search_term_t **link = &idx->buckets[i];
+        while (*link != NULL) {
+            search_term_t *t = *link;
+            if (t->last_id < min_id) {
+                *link = t->next;
+                idx->postings_bytes -= t->cap;
+                idx->terms--;
+                free(t->postings);
+                free(t->skips);
+                free(t);
+                continue;
+            }
+
+            // block d ends at skips[d + 1].base; drop the ones ending below min_id
+            uint32_t d = 0;
+            while (d + 1 < t->skip_count && t->skips[d + 1].base < min_id) d++;
+            if (d > 0) {
+                uint32_t cut = t->skips[d].offset;
+                memmove(t->postings, t->postings + cut, t->len - cut);
+                t->len -= cut;
+                memmove(t->skips, t->skips + d, (t->skip_count - d) * sizeof(*t->skips));
+                t->skip_count -= d;
+                for (uint32_t b = 0; b < t->skip_count; b++) t->skips[b].offset -= cut;
+                t->count -= d * SEARCH_BLOCK;
+
+                if (t->cap > 64 && t->len * 4 < t->cap) {
+                    uint8_t *shrunk = realloc(t->postings, t->cap / 2);
+                    if (shrunk) {
+                        idx->postings_bytes -= t->cap / 2;
+                        t->postings = shrunk;
+                        t->cap /= 2;
+                    }
+                }
+            }
+            link = &t->next;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,478 @@
+#define CHAT_SERVER_NO_MAIN
+#include "chat_server.c"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+// Microbenchmarks for the server's hot data structures.
+// chat_server.c is compiled in whole (without its main), so the functions
+// measured are exactly the ones the server runs.
+//
+//   find_client_by_addr  find_client_by_addr_nolock over N clients
+//   find_client_by_name  find_client_by_name over N clients
+//   is_muted             is_muted against N muted names (N <= MAX_MUTED)
+//   heap_insert          heap_insert of N clients into an empty heap
+//   heap_update          heap_update of a random client in a heap of N
+//   heap_remove          heap_remove of every client, in random order
+//   parse_request        parse_request of a say$ request of N bytes
+//   history_publish      publish_global (history ring, no clients), N per round
+//
+// Each case runs for at least -t ms and reports ns/op. Where the kernel
+// lets us open perf events, cache misses and instructions per op are
+// reported too (null otherwise). Results go to stdout as one JSON document
+// for comparing server versions; progress goes to stderr.
+//
+// compile: gcc -O2 server_bench.c -o server_bench -lpthread
+// usage:   server_bench [-t min_ms] [-M max_mib] [-f filter] [-l label]
+//   -t  minimum time per case (default 200)
+//   -M  skip client-list sizes that need more memory than this (default 2048)
+//   -f  run only benchmarks whose name contains filter
+//   -l  label stored in the output, e.g. the git revision being measured
+
+#define BENCH_LOOKUPS 4096      // random keys cycled through by lookups
+#define BENCH_MAX_RESULTS 64
+
+static const int bench_sizes[] = { 10, 100, 1000, 10000, 100000, 1000000 };
+
+typedef struct {
+    const char *name;
+    int size;
+    int skipped;
+    unsigned long long ops;
+    double ns_per_op;
+    double misses_per_op;       // < 0 when perf events are unavailable
+    double instructions_per_op;
+} bench_result_t;
+
+static struct {
+    int min_ms;
+    long max_mib;
+    const char *filter;
+    const char *label;
+    int perf_fd[2];             // cache misses, instructions; -1 if unavailable
+    bench_result_t results[BENCH_MAX_RESULTS];
+    int result_count;
+    volatile uintptr_t sink;    // keeps results of measured calls alive
+} bench;
+
+static int perf_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_start(void)
+{
+    for (int i = 0; i < 2; i++) {
+        if (bench.perf_fd[i] < 0) continue;
+        ioctl(bench.perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(bench.perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void perf_stop(long long counts[2])
+{
+    for (int i = 0; i < 2; i++) {
+        counts[i] = -1;
+        if (bench.perf_fd[i] < 0) continue;
+        ioctl(bench.perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(bench.perf_fd[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) counts[i] = -1;
+    }
+}
+
+static int bench_wanted(const char *name)
+{
+    return bench.filter == NULL || strstr(name, bench.filter) != NULL;
+}
+
+static bench_result_t *bench_record(const char *name, int size)
+{
+    assert(bench.result_count < BENCH_MAX_RESULTS);
+    bench_result_t *r = &bench.results[bench.result_count++];
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->size = size;
+    r->misses_per_op = r->instructions_per_op = -1;
+    return r;
+}
+
+static void bench_skip(const char *name, int size, const char *why)
+{
+    if (!bench_wanted(name)) return;
+    bench_record(name, size)->skipped = 1;
+    fprintf(stderr, "%-20s %8d  skipped (%s)\n", name, size, why);
+}
+
+// A measured case: step(arg, i) performs operation i. Rounds double until
+// one takes min_ms; a case whose rounds are capped at max_round (because
+// reset must run between them) repeats full rounds and adds them up.
+// Only the time inside rounds is measured, never reset().
+typedef void (*bench_step_fn)(void *arg, unsigned long long i);
+
+static void bench_run(const char *name, int size, bench_step_fn step, void *arg,
+                      void (*reset)(void *arg), unsigned long long max_round)
+{
+    if (!bench_wanted(name)) return;
+
+    unsigned long long round = 1, ops = 0;
+    long long elapsed_ns = 0, totals[2] = { 0, 0 };
+    for (;;) {
+        if (reset) reset(arg);
+        long long counts[2];
+        perf_start();
+        long long t0 = udp_now_us();
+        for (unsigned long long i = 0; i < round; i++) {
+            step(arg, i);
+        }
+        long long ns = (udp_now_us() - t0) * 1000;
+        perf_stop(counts);
+        if (ns < bench.min_ms * 1000000LL && round < max_round) {
+            round = round * 2 < max_round ? round * 2 : max_round;
+            continue;   // warm-up round, discarded
+        }
+        ops += round;
+        elapsed_ns += ns;
+        for (int c = 0; c < 2; c++) {
+            totals[c] = counts[c] < 0 || totals[c] < 0 ? -1 : totals[c] + counts[c];
+        }
+        if (elapsed_ns >= bench.min_ms * 1000000LL) break;
+    }
+
+    bench_result_t *r = bench_record(name, size);
+    r->ops = ops;
+    r->ns_per_op = (double)elapsed_ns / (double)ops;
+    if (totals[0] >= 0) r->misses_per_op = (double)totals[0] / (double)ops;
+    if (totals[1] >= 0) r->instructions_per_op = (double)totals[1] / (double)ops;
+    fprintf(stderr, "%-20s %8d  %12.1f ns/op  %10.2f misses/op  %10llu ops\n",
+            name, size, r->ns_per_op, r->misses_per_op, ops);
+}
+
+// ---------------------------------------------------------------------------
+// client list and activity heap
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    server_context_t *ctx;
+    struct Node **nodes;        // in list order
+    int n;
+    int *keys;                  // BENCH_LOOKUPS random indices into nodes
+    int *order;                 // permutation of 0..n-1 for heap_remove
+} client_bench_t;
+
+static uint64_t bench_rng = 88172645463325252ULL;
+
+static uint64_t bench_random(void)
+{
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 7;
+    bench_rng ^= bench_rng << 17;
+    return bench_rng;
+}
+
+static void bench_addr(struct sockaddr_in *addr, int i)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x0a000000u + (uint32_t)(i >> 8));
+    addr->sin_port = htons((uint16_t)(1024 + (i & 0xff)));
+}
+
+static void step_find_addr(void *arg, unsigned long long i)
+{
+    client_bench_t *cb = (client_bench_t *)arg;
+    struct Node *node = cb->nodes[cb->keys[i % BENCH_LOOKUPS]];
+    bench.sink += (uintptr_t)find_client_by_addr_nolock(cb->ctx, &node->addr);
+}
+
+static void step_find_name(void *arg, unsigned long long i)
+{
+    client_bench_t *cb = (client_bench_t *)arg;
+    struct Node *node = cb->nodes[cb->keys[i % BENCH_LOOKUPS]];
+    bench.sink += (uintptr_t)find_client_by_name(cb->ctx, node->client_name);
+}
+
+static void reset_heap_empty(void *arg)
+{
+    client_bench_t *cb = (client_bench_t *)arg;
+    for (int j = 0; j < cb->ctx->heap_size; j++) {
+        cb->ctx->activity_heap[j]->heap_index = -1;
+    }
+    cb->ctx->heap_size = 0;
+}
+
+static void step_heap_insert(void *arg, unsigned long long i)
+{
+    client_bench_t *cb = (client_bench_t *)arg;
+    heap_insert(cb->ctx, cb->nodes[i % cb->n]);
+}
+
+static void reset_heap_full(void *arg)
+{
+    client_bench_t *cb = (client_bench_t *)arg;
+    reset_heap_empty(cb);
+    for (int j = 0; j < cb->n; j++) {
+        heap_insert(cb->ctx, cb->nodes[j]);
+    }
+}
+
+static void step_heap_update(void *arg, unsigned long long i)
+{
+    client_bench_t *cb = (client_bench_t *)arg;
+    struct Node *node = cb->nodes[cb->keys[i % BENCH_LOOKUPS]];
+    node->last_active += (time_t)(i % 7) - 3;   // moves both up and down
+    heap_update(cb->ctx, node);
+}
+
+static void step_heap_remove(void *arg, unsigned long long i)
+{
+    client_bench_t *cb = (client_bench_t *)arg;
+    heap_remove(cb->ctx, cb->nodes[cb->order[i % cb->n]]);
+}
+
+static void client_benches(int n)
+{
+    const char *names[] = { "find_client_by_addr", "find_client_by_name", "heap_insert", "heap_update", "heap_remove" };
+    long need_mib = (long)((double)n * sizeof(struct Node) / (1024 * 1024));
+    int wanted = 0;
+    for (int i = 0; i < 5; i++) wanted |= bench_wanted(names[i]);
+    if (!wanted) return;
+    if (need_mib > bench.max_mib) {
+        char why[64];
+        snprintf(why, sizeof(why), "needs %ld MiB, limit %ld", need_mib, bench.max_mib);
+        for (int i = 0; i < 5; i++) bench_skip(names[i], n, why);
+        return;
+    }
+
+    server_context_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    pthread_rwlock_init(&ctx.clients_lock, NULL);
+
+    client_bench_t cb = { &ctx, malloc(n * sizeof(struct Node *)), n,
+                          malloc(BENCH_LOOKUPS * sizeof(int)), malloc(n * sizeof(int)) };
+    assert(cb.nodes && cb.keys && cb.order);
+    time_t now = time(NULL);
+    for (int i = n - 1; i >= 0; i--) {
+        char name[MAX_NAME_LEN];
+        struct sockaddr_in addr;
+        snprintf(name, sizeof(name), "user%d", i);
+        bench_addr(&addr, i);
+        push_front(&ctx.clients_head, name, &addr);
+        cb.nodes[i] = ctx.clients_head;
+        cb.nodes[i]->last_active = now - (time_t)(bench_random() % INACTIVE_THRESHOLD);
+    }
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        cb.keys[i] = (int)(bench_random() % (uint64_t)n);
+    }
+    for (int i = 0; i < n; i++) cb.order[i] = i;
+    for (int i = n - 1; i > 0; i--) {
+        int j = (int)(bench_random() % (uint64_t)(i + 1));
+        int tmp = cb.order[i];
+        cb.order[i] = cb.order[j];
+        cb.order[j] = tmp;
+    }
+
+    bench_run("find_client_by_addr", n, step_find_addr, &cb, NULL, ~0ULL);
+    bench_run("find_client_by_name", n, step_find_name, &cb, NULL, ~0ULL);
+    bench_run("heap_insert", n, step_heap_insert, &cb, reset_heap_empty, (unsigned long long)n);
+    bench_run("heap_update", n, step_heap_update, &cb, reset_heap_full, ~0ULL);
+    bench_run("heap_remove", n, step_heap_remove, &cb, reset_heap_full, (unsigned long long)n);
+
+    struct Node *cur = ctx.clients_head;
+    while (cur) {
+        struct Node *next = cur->next;
+        rel_destroy(&cur->rel);
+        pthread_mutex_destroy(&cur->out_lock);
+        free(cur);
+        cur = next;
+    }
+    free(ctx.activity_heap);
+    free(cb.nodes);
+    free(cb.keys);
+    free(cb.order);
+    pthread_rwlock_destroy(&ctx.clients_lock);
+}
+
+// ---------------------------------------------------------------------------
+// mute list, parser, history ring
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    struct Node *node;
+    char names[BENCH_LOOKUPS][MAX_NAME_LEN];
+} mute_bench_t;
+
+static void step_is_muted(void *arg, unsigned long long i)
+{
+    mute_bench_t *mb = (mute_bench_t *)arg;
+    bench.sink += (uintptr_t)is_muted(mb->node, mb->names[i % BENCH_LOOKUPS]);
+}
+
+static void mute_bench(int n)
+{
+    if (!bench_wanted("is_muted")) return;
+    if (n > MAX_MUTED) {
+        char why[64];
+        snprintf(why, sizeof(why), "a client mutes at most %d names", MAX_MUTED);
+        bench_skip("is_muted", n, why);
+        return;
+    }
+    struct sockaddr_in addr;
+    bench_addr(&addr, 0);
+    mute_bench_t *mb = malloc(sizeof(*mb));
+    assert(mb != NULL);
+    mb->node = create_node("receiver", &addr);
+    for (int i = 0; i < n; i++) {
+        char name[MAX_NAME_LEN];
+        snprintf(name, sizeof(name), "user%d", i);
+        add_mute(mb->node, name);
+    }
+    // half the senders are muted, half are not (a full scan)
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        snprintf(mb->names[i], MAX_NAME_LEN, "user%d", (int)(bench_random() % (uint64_t)(2 * n)));
+    }
+    bench_run("is_muted", n, step_is_muted, mb, NULL, ~0ULL);
+    rel_destroy(&mb->node->rel);
+    free(mb->node);
+    free(mb);
+}
+
+typedef struct {
+    char *buffer;
+    size_t dollar;              // where parse_request put its NUL
+} parse_bench_t;
+
+static void step_parse(void *arg, unsigned long long i)
+{
+    (void)i;
+    parse_bench_t *pb = (parse_bench_t *)arg;
+    char *command, *content;
+    pb->buffer[pb->dollar] = '$';
+    parse_request(pb->buffer, &command, &content);
+    bench.sink += (uintptr_t)content;
+}
+
+static void parse_bench(int n)
+{
+    if (!bench_wanted("parse_request")) return;
+    parse_bench_t pb;
+    pb.buffer = malloc(n + 1);
+    assert(pb.buffer != NULL);
+    memset(pb.buffer, 'x', n);
+    memcpy(pb.buffer, "say$", n < 4 ? n : 4);
+    pb.buffer[n] = '\0';
+    pb.dollar = 3;
+    bench_run("parse_request", n, step_parse, &pb, NULL, ~0ULL);
+    free(pb.buffer);
+}
+
+typedef struct {
+    server_context_t *ctx;
+} history_bench_t;
+
+static void step_publish(void *arg, unsigned long long i)
+{
+    (void)i;
+    history_bench_t *hb = (history_bench_t *)arg;
+    publish_global(hb->ctx, "alice", "a typical chat line of modest length");
+}
+
+static void history_reset(void *arg)
+{
+    history_bench_t *hb = (history_bench_t *)arg;
+    server_context_t *ctx = hb->ctx;
+    for (int i = 0; i < ctx->global_count; i++) {
+        free(ctx->global_buffer[(ctx->global_start + i) % GLOBAL_BUFFER_SIZE]);
+    }
+    ctx->global_count = 0;
+    ctx->global_start = 0;
+}
+
+static void history_bench(int n)
+{
+    if (!bench_wanted("history_publish")) return;
+    server_context_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    pthread_rwlock_init(&ctx.clients_lock, NULL);
+    pthread_mutex_init(&ctx.history_lock, NULL);
+    history_bench_t hb = { &ctx };
+
+    // rounds of n messages from an empty ring: the first GLOBAL_BUFFER_SIZE
+    // fill it, the rest each evict the oldest
+    bench_run("history_publish", n, step_publish, &hb, history_reset, (unsigned long long)n);
+    history_reset(&hb);
+    pthread_mutex_destroy(&ctx.history_lock);
+    pthread_rwlock_destroy(&ctx.clients_lock);
+}
+
+// ---------------------------------------------------------------------------
+
+static void print_json(void)
+{
+    printf("{\n  \"label\": \"%s\",\n  \"node_bytes\": %zu,\n  \"perf_events\": %s,\n  \"results\": [\n",
+           bench.label ? bench.label : "", sizeof(struct Node),
+           bench.perf_fd[0] >= 0 || bench.perf_fd[1] >= 0 ? "true" : "false");
+    for (int i = 0; i < bench.result_count; i++) {
+        bench_result_t *r = &bench.results[i];
+        printf("    {\"bench\": \"%s\", \"size\": %d, ", r->name, r->size);
+        if (r->skipped) {
+            printf("\"skipped\": true}");
+        }
+        else {
+            printf("\"ops\": %llu, \"ns_per_op\": %.2f, ", r->ops, r->ns_per_op);
+            if (r->misses_per_op >= 0) printf("\"cache_misses_per_op\": %.3f, ", r->misses_per_op);
+            else printf("\"cache_misses_per_op\": null, ");
+            if (r->instructions_per_op >= 0) printf("\"instructions_per_op\": %.1f}", r->instructions_per_op);
+            else printf("\"instructions_per_op\": null}");
+        }
+        printf("%s\n", i + 1 < bench.result_count ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bench.min_ms = 200;
+    bench.max_mib = 2048;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:M:f:l:")) != -1) {
+        switch (opt) {
+            case 't': bench.min_ms = atoi(optarg); break;
+            case 'M': bench.max_mib = atol(optarg); break;
+            case 'f': bench.filter = optarg; break;
+            case 'l': bench.label = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-t min_ms] [-M max_mib] [-f filter] [-l label]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    bench.perf_fd[0] = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+    bench.perf_fd[1] = perf_open(PERF_COUNT_HW_INSTRUCTIONS);
+    if (bench.perf_fd[0] < 0 && bench.perf_fd[1] < 0) {
+        fprintf(stderr, "perf events unavailable (perf_event_paranoid?); timing only\n");
+    }
+
+    for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        int n = bench_sizes[s];
+        client_benches(n);
+        mute_bench(n);
+        parse_bench(n);
+        history_bench(n);
+    }
+    // the mute list is bounded: measure it full as well
+    mute_bench(MAX_MUTED);
+
+    print_json();
+    for (int i = 0; i < 2; i++) {
+        if (bench.perf_fd[i] >= 0) close(bench.perf_fd[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,169 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Sampled tracing of chat messages, exported as Chrome trace events.
+//
+// A message is traced when its id is a multiple of the sampling interval,
+// so the server and every client pick the same messages without telling
+// each other; the message id is the trace id. Spans go into an in-memory
+// ring (the oldest are overwritten) and trace_export appends the ones not
+// exported yet to a file in Chrome's JSON array format. Several processes
+// may share the file: each event is one O_APPEND write, the file opens
+// with "[" and the closing "]" is optional, so chrome://tracing or
+// ui.perfetto.dev load it as it is, with a row per process.
+//
+// Times are CLOCK_MONOTONIC, which is the same for every process on the
+// host, so server and client spans line up.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING_SIZE 32768           // spans, power of two
+#define TRACE_DETAIL 32
+
+typedef struct {
+    uint64_t seq;                       // ring position + 1 once written
+    uint64_t id;
+    const char *name;                   // a string literal
+    uint64_t start_ns, end_ns;
+    int tid;
+    char detail[TRACE_DETAIL];          // e.g. the recipient of a send
+} trace_span_t;
+
+static struct {
+    int every;                          // trace ids divisible by this, 0 = off
+    const char *path;
+    const char *process;
+    trace_span_t *ring;
+    uint64_t head;                      // next ring position
+    uint64_t exported;                  // everything before this is in the file
+    int named;                          // our process_name event is in the file
+} tracer;
+
+static __thread int trace_tid;
+
+static inline int trace_sampled(uint64_t id)
+{
+    return tracer.every > 0 && id % (uint64_t)tracer.every == 0;
+}
+
+static inline uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// a CLOCK_REALTIME stamp (such as SO_TIMESTAMPNS gives) on our clock
+static inline uint64_t trace_from_realtime(const struct timespec *stamp)
+{
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    int64_t ago = ((int64_t)real.tv_sec - stamp->tv_sec) * 1000000000LL + (real.tv_nsec - stamp->tv_nsec);
+    return trace_now_ns() - (uint64_t)(ago > 0 ? ago : 0);
+}
+
+// "every:file"; process names our row in the viewer. 0, or -1 if the spec
+// or the ring is no good.
+static inline int trace_init(const char *spec, const char *process)
+{
+    char *colon;
+    long every = strtol(spec, &colon, 10);
+    if (every <= 0 || *colon != ':' || colon[1] == '\0') return -1;
+    tracer.ring = calloc(TRACE_RING_SIZE, sizeof(trace_span_t));
+    if (!tracer.ring) return -1;
+    tracer.every = (int)every;
+    tracer.path = colon + 1;
+    tracer.process = process;
+    return 0;
+}
+
+static void trace_span(uint64_t id, const char *name, uint64_t start_ns, uint64_t end_ns, const char *detail)
+{
+    if (!tracer.ring) return;
+    uint64_t pos = __atomic_fetch_add(&tracer.head, 1, __ATOMIC_RELAXED);
+    trace_span_t *s = &tracer.ring[pos & (TRACE_RING_SIZE - 1)];
+    __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+    s->id = id;
+    s->name = name;
+    s->start_ns = start_ns;
+    s->end_ns = end_ns > start_ns ? end_ns : start_ns;
+    if (trace_tid == 0) trace_tid = (int)syscall(SYS_gettid);
+    s->tid = trace_tid;
+    // the export puts this in a JSON string as it is
+    int i = 0;
+    for (; detail && detail[i] && i < TRACE_DETAIL - 1; i++) {
+        char c = detail[i];
+        s->detail[i] = (c == '"' || c == '\\' || (unsigned char)c < 0x20) ? '_' : c;
+    }
+    s->detail[i] = '\0';
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int trace_write(int fd, const char *buf, int n)
+{
+    return write(fd, buf, (size_t)n) == n ? 0 : -1;
+}
+
+// append the spans recorded since the last export; the number written, or
+// -1 if the file cannot be written. Spans the ring has already overwritten
+// are skipped.
+static int trace_export(void)
+{
+    if (!tracer.ring) return -1;
+    int fd = open(tracer.path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    if (fd >= 0) {
+        trace_write(fd, "[\n", 2);
+    }
+    else if (errno == EEXIST) {
+        fd = open(tracer.path, O_WRONLY | O_APPEND);
+    }
+    if (fd < 0) return -1;
+
+    char line[512];
+    int pid = getpid();
+    int n;
+    if (!tracer.named) {
+        tracer.named = 1;
+        n = snprintf(line, sizeof(line),
+                     "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s %d\"}},\n",
+                     pid, tracer.process, pid);
+        trace_write(fd, line, n);
+    }
+
+    uint64_t head = __atomic_load_n(&tracer.head, __ATOMIC_ACQUIRE);
+    uint64_t from = tracer.exported;
+    if (head - from > TRACE_RING_SIZE) from = head - TRACE_RING_SIZE;
+    int written = 0;
+    for (uint64_t pos = from; pos < head; pos++) {
+        trace_span_t *slot = &tracer.ring[pos & (TRACE_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) continue;   // being written or overwritten
+        trace_span_t copy = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos + 1) continue;
+        trace_span_t *s = &copy;
+        uint64_t dur = s->end_ns - s->start_ns;
+        n = snprintf(line, sizeof(line),
+                     "{\"name\":\"%s\",\"cat\":\"msg\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                     "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"args\":{\"msg\":%llu%s%s%s}},\n",
+                     s->name, pid, s->tid,
+                     (unsigned long long)(s->start_ns / 1000), (unsigned long long)(s->start_ns % 1000),
+                     (unsigned long long)(dur / 1000), (unsigned long long)(dur % 1000),
+                     (unsigned long long)s->id,
+                     s->detail[0] ? ",\"to\":\"" : "", s->detail, s->detail[0] ? "\"" : "");
+        if (trace_write(fd, line, n) < 0) break;
+        written++;
+    }
+    tracer.exported = head;
+    close(fd);
+    return written;
+}
+
+#endif
@@ -7,12 +7,32 @@
 #include <arpa/inet.h>  // inet_pton(), inet_ntop()
 #include <unistd.h>     // close()
 #include <string.h>     // memset(), memcpy()
+#include <stdio.h>      // snprintf()
+#include <stdlib.h>     // malloc(), free(), getenv(), strtoul()
+#include <stdint.h>     // uint32_t, uint64_t
+#include <limits.h>     // LLONG_MAX
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>       // clock_gettime()
+#include <sys/random.h> // getrandom()
 
 #define BUFFER_SIZE 1024
 #define SERVER_PORT 12000
-#define MAX_CLIENTS 32
+#define MAX_CLIENTS 32         // initial size of the activity heap, which grows
+
+// largest datagram payload we put on the wire; keeps us under a 1500 byte
+// ethernet path MTU once the IP and UDP headers are added
+#define UDP_MTU 1400
+
+// room kept free in every datagram for transport headers such as "rel$";
+// application payloads (including batches) stay within UDP_PAYLOAD_MAX
+#define UDP_HDR_ROOM 32
+#define UDP_PAYLOAD_MAX (UDP_MTU - UDP_HDR_ROOM)
+
+// a coalesced datagram starts with this tag and carries several
+// NUL-terminated chat lines back to back
+#define BATCH_TAG "batch$"
+#define BATCH_TAG_LEN 6
 
 struct Node; 
 
@@ -86,6 +106,62 @@ int udp_socket_read(int sd, struct sockaddr_in *addr, char *buffer, int n)
     return recvfrom(sd, buffer, n, 0, (struct sockaddr *)addr, &len);
 }
 
+int udp_socket_read_stamped(int sd, struct sockaddr_in *addr, char *buffer, int n, struct timespec *stamp)
+{
+    // udp_socket_read that also says when the kernel received the datagram
+    // (CLOCK_REALTIME), for a socket with SO_TIMESTAMPNS turned on; stamp is
+    // zero if the kernel gave none
+    struct iovec iov = { buffer, (size_t)n };
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = addr;
+    mh.msg_namelen = sizeof(struct sockaddr_in);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    int rc = recvmsg(sd, &mh, 0);
+    memset(stamp, 0, sizeof(*stamp));
+    if (rc >= 0) {
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+                memcpy(stamp, CMSG_DATA(c), sizeof(*stamp));
+            }
+        }
+    }
+    return rc;
+}
+
+// loss injection: probability in [0, 1] of dropping an outgoing datagram.
+// -1 means "not read from UDP_LOSS yet"; programs may also set it directly.
+double udp_loss_rate = -1.0;
+
+int udp_should_drop(void)
+{
+    if (udp_loss_rate < 0) {
+        const char *env = getenv("UDP_LOSS");
+        udp_loss_rate = env ? atof(env) / 100.0 : 0.0;
+    }
+    if (udp_loss_rate <= 0) {
+        return 0;
+    }
+    return random() < (long)(udp_loss_rate * RAND_MAX);
+}
+
+// traffic counters kept by udp_socket_write. A program that wants them
+// points udp_counters at a block of its own in each sending thread, so the
+// counts are never shared and cost a plain increment.
+typedef struct {
+    unsigned long packets_out;
+    unsigned long long bytes_out;
+    unsigned long send_errors;
+    unsigned long loss_dropped;     // withheld by UDP_LOSS
+} udp_counters_t;
+
+__thread udp_counters_t *udp_counters;
+
 int udp_socket_write(int sd, struct sockaddr_in *addr, char *buffer, int n)
 {
     // Send the contents of buffer (n bytes) to the given destination
@@ -102,15 +178,702 @@ int udp_socket_write(int sd, struct sockaddr_in *addr, char *buffer, int n)
 
     // The fourth parameter 'flags' of sendto is normally set to 0
 
+    // For testing, UDP_LOSS=<percent> in the environment silently drops
+    // that share of outgoing datagrams (see udp_should_drop)
+    if (udp_should_drop()) {
+        if (udp_counters) udp_counters->loss_dropped++;
+        return n;
+    }
+
     int addr_len = sizeof(struct sockaddr_in);
-    return sendto(sd, buffer, n, 0, (struct sockaddr *)addr, addr_len);
+    int rc = sendto(sd, buffer, n, 0, (struct sockaddr *)addr, addr_len);
+    if (udp_counters) {
+        if (rc < 0) {
+            udp_counters->send_errors++;
+        }
+        else {
+            udp_counters->packets_out++;
+            udp_counters->bytes_out += rc;
+        }
+    }
+    return rc;
+}
+
+long long udp_now_us(void)
+{
+    // monotonic clock in microseconds, used for flush deadlines and timers
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Session ids, tokens, history epochs and request runs come from here. A
+// nonzero udp_random_seed (chat_replay sets one) turns it into a splitmix64
+// sequence so a replay hands out the same values every time; otherwise it
+// is getrandom, or the clock and random() if that fails.
+uint64_t udp_random_seed;
+
+uint64_t udp_random64(void)
+{
+    uint64_t x;
+    if (udp_random_seed != 0) {
+        x = __atomic_add_fetch(&udp_random_seed, 0x9e3779b97f4a7c15ULL, __ATOMIC_RELAXED);
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+    if (getrandom(&x, sizeof(x), 0) != sizeof(x)) {
+        x = ((uint64_t)random() << 32) ^ (uint64_t)random() ^ (uint64_t)udp_now_us();
+    }
+    return x;
+}
+
+void udp_for_each_message(char *buffer, int n, void (*deliver)(void *arg, char *msg), void *arg)
+{
+    // Hand every chat line in a received datagram to deliver().
+    // A plain datagram is a single line; a "batch$" datagram packs several
+    // NUL-terminated lines so that one recvfrom can drain a burst.
+    // buffer must have room for one extra byte past n.
+
+    buffer[n] = '\0';
+
+    if (n < BATCH_TAG_LEN || strncmp(buffer, BATCH_TAG, BATCH_TAG_LEN) != 0) {
+        deliver(arg, buffer);
+        return;
+    }
+
+    int off = BATCH_TAG_LEN;
+    while (off < n) {
+        char *msg = buffer + off;
+        int len = (int)strlen(msg);
+        if (len > 0) deliver(arg, msg);
+        off += len + 1;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Optional reliable delivery.
+//
+// A sender wraps each datagram as "rel$<sid>$<seq>$<payload>" where sid is a
+// random id for the sending session (so a restarted peer is not confused with
+// an old one) and seq counts up from 1. The receiver answers every data
+// datagram with "ack$<sid>$<cum>$<mask>": every seq <= cum has arrived, and
+// bit i of the 64-bit hex mask says that seq cum + 2 + i has arrived too.
+//
+// The sender keeps at most REL_WINDOW unacked datagrams; more wait in a
+// backlog (up to REL_BACKLOG_MAX, beyond which rel_send refuses them) and go
+// out as acks free the window. Each one is retransmitted on its own timer
+// (RTO from measured RTT as in RFC 6298, with Karn's rule and exponential
+// backoff), or straight away once three later datagrams have been
+// selectively acked. After REL_MAX_RETRIES it gives up, and the receiver
+// slides its window past holes that can no longer be filled.
+// ---------------------------------------------------------------------------
+
+#define REL_TAG "rel$"
+#define REL_TAG_LEN 4
+#define ACK_TAG "ack$"
+#define ACK_TAG_LEN 4
+#define REL_WINDOW 64
+#define REL_BACKLOG_MAX 4096    // datagrams waiting for room in the window
+#define REL_MAX_RETRIES 8
+#define REL_DUP_THRESH 3
+#define REL_INITIAL_RTO_US 200000
+#define REL_MIN_RTO_US 10000
+#define REL_MAX_RTO_US 2000000
+
+typedef struct {
+    uint32_t seq;       // 0 = free slot
+    int len;
+    char *data;         // whole datagram, header included
+    long long sent_us;
+    int retries;
+    int fast_retransmitted;
+} rel_slot_t;
+
+typedef struct rel_pending {
+    struct rel_pending *next;
+    int len;
+    char payload[];
+} rel_pending_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t sid;
+
+    // send side: slot for seq is slots[seq % REL_WINDOW]
+    uint32_t next_seq;
+    rel_slot_t slots[REL_WINDOW];
+    int in_flight;
+    rel_pending_t *backlog_head, *backlog_tail;   // not given a seq yet
+    int backlog;
+    long long srtt_us;
+    long long rttvar_us;
+    long long rto_us;
+
+    // receive side
+    uint32_t peer_sid;  // 0 = nothing received yet
+    uint32_t rcv_cum;
+    uint64_t rcv_mask;
+
+    unsigned long sent;
+    unsigned long retransmitted;
+    unsigned long given_up;
+    unsigned long refused;      // rel_send with the backlog full
+} rel_session_t;
+
+void rel_init(rel_session_t *s)
+{
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_init(&s->lock, NULL);
+    do {
+        s->sid = (uint32_t)udp_random64();
+    } while (s->sid == 0);
+    s->next_seq = 1;
+    s->rto_us = REL_INITIAL_RTO_US;
+}
+
+static void rel_free_slot(rel_session_t *s, rel_slot_t *slot)
+{
+    free(slot->data);
+    slot->data = NULL;
+    slot->seq = 0;
+    s->in_flight--;
+}
+
+void rel_destroy(rel_session_t *s)
+{
+    for (int i = 0; i < REL_WINDOW; i++) {
+        if (s->slots[i].seq != 0) rel_free_slot(s, &s->slots[i]);
+    }
+    while (s->backlog_head) {
+        rel_pending_t *p = s->backlog_head;
+        s->backlog_head = p->next;
+        free(p);
+    }
+    pthread_mutex_destroy(&s->lock);
+}
+
+static int rel_window_open_locked(rel_session_t *s)
+{
+    return s->slots[s->next_seq % REL_WINDOW].seq == 0;
+}
+
+int rel_can_send(rel_session_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    int ok = s->backlog == 0 && rel_window_open_locked(s);
+    pthread_mutex_unlock(&s->lock);
+    return ok;
+}
+
+// give payload the next seq and send it (hold s->lock, window open)
+static int rel_transmit_locked(rel_session_t *s, int sd, struct sockaddr_in *addr, const char *payload, int n)
+{
+    char header[UDP_HDR_ROOM];
+    int hlen = snprintf(header, sizeof(header), REL_TAG "%x$%u$", s->sid, s->next_seq);
+
+    char *data = malloc(hlen + n);
+    if (!data) return -1;
+    memcpy(data, header, hlen);
+    memcpy(data + hlen, payload, n);
+
+    uint32_t seq = s->next_seq++;
+    rel_slot_t *slot = &s->slots[seq % REL_WINDOW];
+    slot->seq = seq;
+    slot->len = hlen + n;
+    slot->data = data;
+    slot->sent_us = udp_now_us();
+    slot->retries = 0;
+    slot->fast_retransmitted = 0;
+    s->in_flight++;
+    s->sent++;
+    return udp_socket_write(sd, addr, data, hlen + n);
+}
+
+// move backlogged datagrams into whatever room the window has (hold s->lock)
+static void rel_drain_locked(rel_session_t *s, int sd, struct sockaddr_in *addr)
+{
+    while (s->backlog_head && rel_window_open_locked(s)) {
+        rel_pending_t *p = s->backlog_head;
+        s->backlog_head = p->next;
+        if (!s->backlog_head) s->backlog_tail = NULL;
+        s->backlog--;
+        rel_transmit_locked(s, sd, addr, p->payload, p->len);
+        free(p);
+    }
+}
+
+// send payload reliably. With the window full it waits in the backlog; -1
+// if that is full too (the peer has stopped acking), and nothing is sent.
+int rel_send(rel_session_t *s, int sd, struct sockaddr_in *addr, const char *payload, int n)
+{
+    pthread_mutex_lock(&s->lock);
+    int rc;
+    if (s->backlog == 0 && rel_window_open_locked(s)) {
+        rc = rel_transmit_locked(s, sd, addr, payload, n);
+    }
+    else if (s->backlog >= REL_BACKLOG_MAX) {
+        s->refused++;
+        rc = -1;
+    }
+    else {
+        rel_pending_t *p = malloc(sizeof(*p) + n);
+        rc = -1;
+        if (p) {
+            p->next = NULL;
+            p->len = n;
+            memcpy(p->payload, payload, n);
+            if (s->backlog_tail) s->backlog_tail->next = p;
+            else s->backlog_head = p;
+            s->backlog_tail = p;
+            s->backlog++;
+            rc = n;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return rc < 0 ? rc : n;
+}
+
+static void rel_retransmit_locked(rel_session_t *s, int sd, struct sockaddr_in *addr, rel_slot_t *slot, long long now)
+{
+    slot->retries++;
+    slot->sent_us = now;
+    s->retransmitted++;
+    udp_socket_write(sd, addr, slot->data, slot->len);
+}
+
+static long long rel_slot_rto(rel_session_t *s, rel_slot_t *slot)
+{
+    long long rto = s->rto_us << slot->retries;
+    return rto > REL_MAX_RTO_US ? REL_MAX_RTO_US : rto;
+}
+
+// retransmit whatever has timed out; returns when the next timer is due
+// (LLONG_MAX if nothing is in flight), so the caller can sleep until then
+long long rel_poll(rel_session_t *s, int sd, struct sockaddr_in *addr)
+{
+    long long now = udp_now_us();
+    long long next = LLONG_MAX;
+
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < REL_WINDOW && s->in_flight > 0; i++) {
+        rel_slot_t *slot = &s->slots[i];
+        if (slot->seq == 0) continue;
+
+        if (now - slot->sent_us >= rel_slot_rto(s, slot)) {
+            if (slot->retries >= REL_MAX_RETRIES) {
+                rel_free_slot(s, slot);
+                s->given_up++;
+                continue;
+            }
+            rel_retransmit_locked(s, sd, addr, slot, now);
+        }
+        long long due = slot->sent_us + rel_slot_rto(s, slot);
+        if (due < next) next = due;
+    }
+    if (s->backlog_head && rel_window_open_locked(s)) {
+        rel_drain_locked(s, sd, addr);   // gave up on some, which made room
+        if (now + s->rto_us < next) next = now + s->rto_us;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return next;
+}
+
+static void rel_rtt_sample_locked(rel_session_t *s, long long sample)
+{
+    if (s->srtt_us == 0) {
+        s->srtt_us = sample;
+        s->rttvar_us = sample / 2;
+    }
+    else {
+        long long err = s->srtt_us - sample;
+        if (err < 0) err = -err;
+        s->rttvar_us = (3 * s->rttvar_us + err) / 4;
+        s->srtt_us = (7 * s->srtt_us + sample) / 8;
+    }
+    s->rto_us = s->srtt_us + 4 * s->rttvar_us;
+    if (s->rto_us < REL_MIN_RTO_US) s->rto_us = REL_MIN_RTO_US;
+    if (s->rto_us > REL_MAX_RTO_US) s->rto_us = REL_MAX_RTO_US;
+}
+
+// process the "<sid>$<cum>$<mask>" part of an ack
+void rel_on_ack(rel_session_t *s, int sd, struct sockaddr_in *addr, const char *content)
+{
+    char *end;
+    uint32_t sid = (uint32_t)strtoul(content, &end, 16);
+    if (*end != '$' || sid != s->sid) return;
+    uint32_t cum = (uint32_t)strtoul(end + 1, &end, 10);
+    if (*end != '$') return;
+    uint64_t mask = strtoull(end + 1, NULL, 16);
+
+    long long now = udp_now_us();
+
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < REL_WINDOW && s->in_flight > 0; i++) {
+        rel_slot_t *slot = &s->slots[i];
+        if (slot->seq == 0) continue;
+
+        int acked = slot->seq <= cum;
+        if (!acked && slot->seq >= cum + 2 && slot->seq - cum - 2 < 64) {
+            acked = (mask >> (slot->seq - cum - 2)) & 1;
+        }
+        if (acked) {
+            if (slot->retries == 0) rel_rtt_sample_locked(s, now - slot->sent_us);
+            rel_free_slot(s, slot);
+        }
+    }
+
+    // selective retransmit: a hole with REL_DUP_THRESH later arrivals is lost
+    for (int i = 0; i < REL_WINDOW && s->in_flight > 0 && mask != 0; i++) {
+        rel_slot_t *slot = &s->slots[i];
+        if (slot->seq == 0 || slot->fast_retransmitted) continue;
+
+        uint32_t first_bit = slot->seq >= cum + 2 ? slot->seq - cum - 1 : 0;
+        if (first_bit >= 64) continue;
+        if (__builtin_popcountll(mask >> first_bit) >= REL_DUP_THRESH) {
+            slot->fast_retransmitted = 1;
+            rel_retransmit_locked(s, sd, addr, slot, now);
+        }
+    }
+    rel_drain_locked(s, sd, addr);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// record an arriving seq and acknowledge it; returns 1 if it is new
+int rel_on_data(rel_session_t *s, int sd, struct sockaddr_in *addr, uint32_t sid, uint32_t seq)
+{
+    int fresh = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (sid != s->peer_sid) {
+        // new or restarted peer session; its seqs start at 1, whichever
+        // arrives first (one that joins late slides the window below)
+        s->peer_sid = sid;
+        s->rcv_cum = 0;
+        s->rcv_mask = 0;
+    }
+
+    if (seq > s->rcv_cum + 65) {
+        // the sender gave up on everything before its window; slide past it
+        uint32_t shift = seq - s->rcv_cum - 65;
+        s->rcv_mask = shift >= 64 ? 0 : s->rcv_mask >> shift;
+        s->rcv_cum += shift;
+    }
+
+    if (seq == s->rcv_cum + 1) {
+        fresh = 1;
+        s->rcv_cum++;
+        while (s->rcv_mask & 1) {
+            s->rcv_mask >>= 1;
+            s->rcv_cum++;
+        }
+        s->rcv_mask >>= 1;
+    }
+    else if (seq > s->rcv_cum + 1) {
+        uint64_t bit = 1ULL << (seq - s->rcv_cum - 2);
+        fresh = !(s->rcv_mask & bit);
+        s->rcv_mask |= bit;
+    }
+
+    char ack[64];
+    int n = snprintf(ack, sizeof(ack), ACK_TAG "%x$%u$%llx", sid, s->rcv_cum, (unsigned long long)s->rcv_mask);
+    pthread_mutex_unlock(&s->lock);
+
+    udp_socket_write(sd, addr, ack, n);
+    return fresh;
+}
+
+// split "rel$<sid>$<seq>$payload"; returns 0 if buffer is not a rel datagram
+int rel_parse(char *buffer, int n, uint32_t *sid, uint32_t *seq, char **payload, int *payload_len)
+{
+    if (n < REL_TAG_LEN || strncmp(buffer, REL_TAG, REL_TAG_LEN) != 0) return 0;
+
+    char *end;
+    *sid = (uint32_t)strtoul(buffer + REL_TAG_LEN, &end, 16);
+    if (end >= buffer + n || *end != '$') return 0;
+    *seq = (uint32_t)strtoul(end + 1, &end, 10);
+    if (end >= buffer + n || *end != '$' || *seq == 0) return 0;
+
+    *payload = end + 1;
+    *payload_len = (int)(buffer + n - *payload);
+    return 1;
+}
+
+// Strip the reliability layer from a received datagram (buffer needs one
+// spare byte past n). Acks are consumed; data is acked and returned once.
+// Returns the number of payload bytes to deliver from *payload, or 0.
+int rel_receive(rel_session_t *s, int sd, struct sockaddr_in *from, char *buffer, int n, char **payload)
+{
+    uint32_t sid, seq;
+    int payload_len;
+
+    buffer[n] = '\0';
+
+    if (n >= ACK_TAG_LEN && strncmp(buffer, ACK_TAG, ACK_TAG_LEN) == 0) {
+        rel_on_ack(s, sd, from, buffer + ACK_TAG_LEN);
+        return 0;
+    }
+    if (rel_parse(buffer, n, &sid, &seq, payload, &payload_len)) {
+        return rel_on_data(s, sd, from, sid, seq) ? payload_len : 0;
+    }
+
+    *payload = buffer;
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// Fragmentation for messages that do not fit in one datagram.
+//
+// A message longer than UDP_PAYLOAD_MAX is cut into pieces sent as
+// "frag$<msg_id>$<index>$<count>$<bytes>", each small enough that neither
+// the IP layer nor rel$ has to split it further. The receiver collects
+// pieces per (sender address, msg_id); incomplete messages are dropped after
+// FRAG_TIMEOUT_US, and the oldest one is evicted when FRAG_SLOTS are busy or
+// FRAG_MEMORY_CAP bytes of reassembly buffers are in use.
+// ---------------------------------------------------------------------------
+
+#define FRAG_TAG "frag$"
+#define FRAG_TAG_LEN 5
+#define FRAG_MAX_MESSAGE 65536
+#define FRAG_DATA_MAX (UDP_PAYLOAD_MAX - 32)
+#define FRAG_MAX_COUNT ((FRAG_MAX_MESSAGE + FRAG_DATA_MAX - 1) / FRAG_DATA_MAX)
+// the most a complete message can hold: a bit over FRAG_MAX_MESSAGE, which
+// leaves room for the headers (tok$, id$, "name: ") wrapped around a paste
+// of FRAG_MAX_MESSAGE - 1 bytes on its way through the server
+#define FRAG_ASSEMBLED_MAX (FRAG_MAX_COUNT * FRAG_DATA_MAX)
+#define FRAG_SLOTS 64
+#define FRAG_MEMORY_CAP (4 * 1024 * 1024)
+#define FRAG_TIMEOUT_US 5000000
+
+typedef int (*udp_send_fn)(void *arg, const char *buffer, int n);
+
+// send msg as fragments through send(); returns 0, or -1 if send failed
+int frag_send(uint32_t msg_id, const char *msg, int n, udp_send_fn send, void *arg)
+{
+    char piece[UDP_PAYLOAD_MAX];
+    int count = (n + FRAG_DATA_MAX - 1) / FRAG_DATA_MAX;
+    if (count > FRAG_MAX_COUNT) return -1;
+
+    for (int i = 0; i < count; i++) {
+        int off = i * FRAG_DATA_MAX;
+        int len = n - off < FRAG_DATA_MAX ? n - off : FRAG_DATA_MAX;
+        int hlen = snprintf(piece, sizeof(piece), FRAG_TAG "%x$%d$%d$", msg_id, i, count);
+        memcpy(piece + hlen, msg + off, len);
+        if (send(arg, piece, hlen + len) < 0) return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    int in_use;
+    in_addr_t ip;
+    in_port_t port;
+    uint32_t msg_id;
+    int count;
+    int received;
+    uint64_t received_mask;
+    int last_len;       // length of the final piece, once it has arrived
+    char *data;         // count * FRAG_DATA_MAX bytes
+    long long started_us;
+} frag_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    frag_entry_t entries[FRAG_SLOTS];
+    long memory;
+    char *assembled;    // FRAG_ASSEMBLED_MAX + 1 bytes, holds the last completed message
+
+    unsigned long completed;
+    unsigned long expired;
+    unsigned long evicted;
+} frag_table_t;
+
+void frag_table_init(frag_table_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+    t->assembled = malloc(FRAG_ASSEMBLED_MAX + 1);
+    assert(t->assembled != NULL);
+}
+
+static void frag_entry_release(frag_table_t *t, frag_entry_t *e)
+{
+    t->memory -= (long)e->count * FRAG_DATA_MAX;
+    free(e->data);
+    e->data = NULL;
+    e->in_use = 0;
+}
+
+void frag_table_destroy(frag_table_t *t)
+{
+    for (int i = 0; i < FRAG_SLOTS; i++) {
+        if (t->entries[i].in_use) frag_entry_release(t, &t->entries[i]);
+    }
+    free(t->assembled);
+    pthread_mutex_destroy(&t->lock);
+}
+
+// find the entry for this piece, creating it (and making room) if needed
+static frag_entry_t *frag_lookup_locked(frag_table_t *t, struct sockaddr_in *from, uint32_t msg_id, int count)
+{
+    long long now = udp_now_us();
+    frag_entry_t *free_slot = NULL;
+    frag_entry_t *oldest = NULL;
+
+    for (int i = 0; i < FRAG_SLOTS; i++) {
+        frag_entry_t *e = &t->entries[i];
+        if (e->in_use && now - e->started_us > FRAG_TIMEOUT_US) {
+            frag_entry_release(t, e);
+            t->expired++;
+        }
+        if (!e->in_use) {
+            if (!free_slot) free_slot = e;
+            continue;
+        }
+        if (e->ip == from->sin_addr.s_addr && e->port == from->sin_port && e->msg_id == msg_id) {
+            return e->count == count ? e : NULL;
+        }
+        if (!oldest || e->started_us < oldest->started_us) oldest = e;
+    }
+
+    long need = (long)count * FRAG_DATA_MAX;
+    while (oldest && (!free_slot || t->memory + need > FRAG_MEMORY_CAP)) {
+        frag_entry_release(t, oldest);
+        t->evicted++;
+        if (!free_slot) free_slot = oldest;
+
+        oldest = NULL;
+        for (int i = 0; i < FRAG_SLOTS; i++) {
+            frag_entry_t *e = &t->entries[i];
+            if (e->in_use && (!oldest || e->started_us < oldest->started_us)) oldest = e;
+        }
+    }
+    if (!free_slot || t->memory + need > FRAG_MEMORY_CAP) return NULL;
+
+    free_slot->data = malloc(need);
+    if (!free_slot->data) return NULL;
+    free_slot->in_use = 1;
+    free_slot->ip = from->sin_addr.s_addr;
+    free_slot->port = from->sin_port;
+    free_slot->msg_id = msg_id;
+    free_slot->count = count;
+    free_slot->received = 0;
+    free_slot->received_mask = 0;
+    free_slot->last_len = 0;
+    free_slot->started_us = now;
+    t->memory += need;
+    return free_slot;
+}
+
+// Feed one received payload through reassembly. Returns the length of a
+// message ready for delivery, with *msg pointing at it (NUL-terminated;
+// either payload itself or t->assembled), or 0 while pieces are missing.
+int frag_receive(frag_table_t *t, struct sockaddr_in *from, char *payload, int n, char **msg)
+{
+    if (n < FRAG_TAG_LEN || strncmp(payload, FRAG_TAG, FRAG_TAG_LEN) != 0) {
+        *msg = payload;
+        return n;
+    }
+
+    char *end;
+    uint32_t msg_id = (uint32_t)strtoul(payload + FRAG_TAG_LEN, &end, 16);
+    if (*end != '$') return 0;
+    int index = (int)strtol(end + 1, &end, 10);
+    if (*end != '$') return 0;
+    int count = (int)strtol(end + 1, &end, 10);
+    if (*end != '$') return 0;
+    if (count < 1 || count > FRAG_MAX_COUNT || index < 0 || index >= count) return 0;
+
+    char *data = end + 1;
+    int len = (int)(payload + n - data);
+    if (len < 0 || len > FRAG_DATA_MAX || (index < count - 1 && len != FRAG_DATA_MAX)) return 0;
+
+    int ready = 0;
+    pthread_mutex_lock(&t->lock);
+    frag_entry_t *e = frag_lookup_locked(t, from, msg_id, count);
+    if (e && !(e->received_mask & (1ULL << index))) {
+        memcpy(e->data + (long)index * FRAG_DATA_MAX, data, len);
+        e->received_mask |= 1ULL << index;
+        e->received++;
+        if (index == count - 1) e->last_len = len;
+
+        if (e->received == count) {
+            ready = (count - 1) * FRAG_DATA_MAX + e->last_len;   // <= FRAG_ASSEMBLED_MAX
+            memcpy(t->assembled, e->data, ready);
+            t->assembled[ready] = '\0';
+            frag_entry_release(t, e);
+            t->completed++;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    *msg = t->assembled;
+    return ready;
 }
 
 #define BUFFER_SIZE 1024
 #define SERVER_PORT 12000
 #define GLOBAL_BUFFER_SIZE 15   // store last 15 global messages
 
+// Global messages go out as "msg$<id>$<line>" with increasing ids. A client
+// reconnects with "conn$<name>$<last_id>$<epoch>" and gets only newer
+// messages, or "gap$<last_id>$<oldest_id>" followed by what is left when it
+// missed more than the server still holds. The epoch (hex, from the token$
+// line below) names the id space: it changes when a server starts over
+// from id 1, so an old last_id is never mistaken for one of the new ids.
+#define MSG_TAG "msg$"
+#define MSG_TAG_LEN 4
+#define GAP_TAG "gap$"
+#define GAP_TAG_LEN 4
+
+// conn$ hands the client a session token ("token$<hex>$<epoch>"). A client that has
+// one wraps its requests as "tok$<hex>$<request>", so when its address
+// changes (NAT rebinding, restart on a new port) the server moves the
+// existing session over instead of registering a new user.
+#define TOKEN_TAG "token$"
+#define TOKEN_TAG_LEN 6
+#define TOK_TAG "tok$"
+#define TOK_TAG_LEN 4
+
+// With several federated servers each user name has an owner node. A conn$
+// for a new user that reaches another node is answered with
+// "redirect$<ip>:<port>" and the client reconnects there.
+#define REDIRECT_TAG "redirect$"
+#define REDIRECT_TAG_LEN 9
+
+// sayto$ to a user who is not connected is kept in their mailbox and
+// delivered at their next conn$; the sender gets "queued$<recipient>" so it
+// knows not to retry.
+#define QUEUED_TAG "queued$"
+#define QUEUED_TAG_LEN 7
+
+// Requests may carry a client-chosen, increasing id as "id$<n>:<run>$<request>".
+// The server remembers recently seen ids per session and answers a repeat
+// from its response cache instead of running the handler again. The run
+// (hex, from request_run_new) is picked once per client process, so a
+// restarted client that numbers from 1 again gets a fresh window.
+#define ID_TAG "id$"
+#define ID_TAG_LEN 3
+
+unsigned long long request_run_new(void)
+{
+    unsigned long long run = 0;
+    while (run == 0) {
+        run = udp_random64();
+    }
+    return run;
+}
+
 struct Node; 
+struct RoomBucket;
+struct Federation;
+struct Presence;
+struct TopicTree;
+struct msglog;
+struct Mailboxes;
+struct Search;
+struct dgcap_writer;
 
 typedef struct {
     int sd;
@@ -118,12 +881,57 @@ typedef struct {
     struct Node *clients_head;
     pthread_rwlock_t clients_lock;
 
-    char global_buffer[GLOBAL_BUFFER_SIZE][BUFFER_SIZE];
+    char *global_buffer[GLOBAL_BUFFER_SIZE];   // heap copies of "msg$<id>$<line>"
+    uint64_t global_ids[GLOBAL_BUFFER_SIZE];
     int global_count;
     int global_start;
+    uint64_t next_msg_id;                      // ids are never reused
+    uint32_t history_epoch;                    // ...within one epoch (see MSG_TAG)
+    pthread_mutex_t history_lock;              // held while the ring changes, so a snapshot sees it whole
 
-    struct Node *activity_heap[MAX_CLIENTS];
+    struct Node **activity_heap;
     int heap_size;
+    int heap_cap;
+
+    int coalesce_ms;   // 0 = send every line in its own datagram
+
+    // the outbound thread (coalesced flushes, rel retransmits, presence)
+    // sleeps until outbound_due; whoever gives it earlier work signals it
+    pthread_mutex_t outbound_lock;
+    pthread_cond_t outbound_cond;     // on CLOCK_MONOTONIC, like udp_now_us
+    long long outbound_due;           // LLONG_MAX = nothing pending
+    int rel_request;   // the request being handled arrived as rel$
+
+    frag_table_t frags;          // reassembly of inbound frag$ requests
+    volatile uint32_t next_frag_id;
+
+    struct RoomBucket *rooms;    // ROOM_BUCKETS chains, each with its own lock
+
+    struct Federation *fed;      // peer servers, NULL when running alone
+
+    struct Presence *presence;   // who is online, see presence_* in chat_server.c
+
+    struct TopicTree *topics;    // pub/sub subscriptions
+
+    struct msglog *log;          // on-disk history (msglog.h), NULL without -l
+    int sync_ms;                 // group commit interval for the log
+
+    const char *snapshot_path;   // registry snapshot file, NULL without -S
+    int snapshot_interval_s;
+
+    struct Mailboxes *mailboxes; // sayto$ for users who are offline
+
+    struct Search *search;       // word index behind search$
+
+    struct dgcap_writer *capture; // inbound datagrams (dgcap.h), NULL without -C
+
+    int client_count;            // length of clients_head, under clients_lock
+
+    int metrics_sd;              // -M socket, -1 without
+    int metrics_stream;          // it is a unix stream socket, not UDP
+
+    const char *handover_path;   // unix socket for hot restarts, NULL without -H
+    volatile int handover_fd;    // connection from a successor, -1 until one arrives
 } server_context_t;
 
 void handle_request(server_context_t *ctx, struct sockaddr_in *client_addr, char *client_request, int length);